@@ -0,0 +1,52 @@
+//-----------------------------------
+// testDataLog.ino
+//-----------------------------------
+// A myIOTDataLogT<> schema, as in myIOTDataLogSchema.h, that adds a
+// record every minute.  With the default WITH_SD=0 it is kept in a
+// RAM ring buffer; with WITH_SD=1 it is written to the SD card.
+// addRecord() refuses records until the clock has been set.
+
+#include <myIOTDataLogSchema.h>
+#include <myIOTLog.h>
+
+#define LOG_INTERVAL_MS     60000
+#define RAM_RECS            1440        // one day
+
+typedef myIOTDataLogT<
+    LOG_COL_TYPE_CENTIGRADE_RAW,
+    LOG_COL_TYPE_CENTIGRADE_RAW,
+    LOG_COL_TYPE_UINT8 > fridgeLog;
+
+static fridgeLog data_log("fridge", {
+    { "temp1", 5 },
+    { "temp2", 5 },
+    { "state", 1 } });
+
+
+void setup()
+{
+    Serial.begin(115200);
+    #if !WITH_SD
+        data_log.setRamBuffer(RAM_RECS);
+    #endif
+}
+
+
+void loop()
+{
+    static uint32_t last_ms;
+    static uint8_t state;
+
+    uint32_t now = millis();
+    if (now - last_ms < LOG_INTERVAL_MS)
+        return;
+    last_ms = now;
+    state = !state;
+
+    fridgeLog::Record rec;
+    rec.set<0>(80);         // 5.0C in 1/16 degrees, as read from a DS18B20
+    rec.set<1>(-288);       // -18.0C
+    rec.set<2>(state);
+    if (!data_log.addRecord(rec))
+        LOGW("testDataLog could not add a record");
+}
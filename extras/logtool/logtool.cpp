@@ -0,0 +1,848 @@
+//-----------------------------------------------
+// logtool.cpp - offline analysis of .datalog files
+//-----------------------------------------------
+// A Linux command line tool that memory maps .datalog files copied off
+// a device's SD card, to check or export multi-year logs at disk speed,
+// and as a reference for the results the device gives for them:
+//
+//		logtool [options] stats|scan|csv|ndjson file.datalog [file.datalog ...]
+//
+//		-h header.json		the columns, as returned by chart_header
+//		-c name:type,...	or given directly, with the type names of the
+//							chart header, i.e. "temp1:centigradeRaw_t,on:uint8_t"
+//		-f from_dt			the time window for stats, csv and ndjson,
+//		-t to_dt			0 = all
+//		-F					temperatures in Farenheit for csv and ndjson
+//
+//	stats	prints the same JSON as getColStats()
+//	scan	the same as scanFile(), except that the spikes are exact, as the
+//			device's spike stack is never thinned, and pending is 0
+//	csv		the same as exportData(), with times in the local time of
+//	ndjson	the host, so run it with TZ set to that of the device
+//
+// Several files are the segments of a segmented datalog, in order, which
+// is the order the shell sorts them in.  Only whole records are decoded,
+// i.e. not compressed or columnar datalogs; use exportData() for those.
+//
+// The records are decoded a column at a time, CHUNK records at a time,
+// into an array per column, so that the min, max, and sum loops have no
+// branches or per record type switch, and the compiler vectorizes them.
+//
+// Build it with:
+//
+//		g++ -O3 -march=native -I../.. -o logtool logtool.cpp
+
+#include "myIOTDataLogColumns.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <string>
+#include <vector>
+
+
+#define CHUNK				4096
+
+#define TEMP_RAW_ERROR		32767		// as in myIOTTempSensor.h
+#define TEMPERATURE_ERROR	10000.0
+
+
+typedef struct {
+	std::string name;
+	uint32_t type;
+	int offset;
+} toolCol_t;
+
+typedef struct {
+	std::string name;			// without the directory
+	const uint8_t *data;		// NULL if empty
+	uint32_t num_recs;			// whole records
+} dataFile_t;
+
+
+static std::vector<toolCol_t> cols;
+static int rec_size = 4;		// 4 for the dt
+
+static const struct {
+	const char *name;
+	uint32_t type;
+} col_types[] = {
+	// the names used by getChartHeader()
+	{ "uint32_t",			LOG_COL_TYPE_UINT32 },
+	{ "uint16_t",			LOG_COL_TYPE_UINT16 },
+	{ "uint8_t",			LOG_COL_TYPE_UINT8 },
+	{ "uint8x10_t",			LOG_COL_TYPE_UINT8x10 },
+	{ "int32_t",			LOG_COL_TYPE_INT32 },
+	{ "int16_t",			LOG_COL_TYPE_INT16 },
+	{ "int8_t",				LOG_COL_TYPE_INT8 },
+	{ "float32_t",			LOG_COL_TYPE_FLOAT32 },
+	{ "centigrade32_t",		LOG_COL_TYPE_CENTIGRADE32 },
+	{ "centigradeRaw_t",	LOG_COL_TYPE_CENTIGRADE_RAW },
+	{ "centigrade8_t",		LOG_COL_TYPE_CENTIGRADE8 },
+	{ "int16div10_t",		LOG_COL_TYPE_INT16_10 },
+};
+
+
+//------------------------------------
+// columns
+//------------------------------------
+
+static int colSize(uint32_t typ)
+{
+	if (typ == LOG_COL_TYPE_UINT8 ||
+		typ == LOG_COL_TYPE_UINT8x10 ||
+		typ == LOG_COL_TYPE_INT8 ||
+		typ == LOG_COL_TYPE_CENTIGRADE8)
+		return 1;
+	if (typ == LOG_COL_TYPE_UINT16 ||
+		typ == LOG_COL_TYPE_INT16 ||
+		typ == LOG_COL_TYPE_CENTIGRADE_RAW ||
+		typ == LOG_COL_TYPE_INT16_10)
+		return 2;
+	return 4;
+}
+
+static bool colIsFloat(uint32_t typ)
+{
+	return
+		typ == LOG_COL_TYPE_FLOAT32 ||
+		typ == LOG_COL_TYPE_CENTIGRADE32;
+}
+
+
+static bool addCol(const std::string &name, const std::string &type_name)
+{
+	if (cols.size() == DATA_COLS_MAX)
+	{
+		fprintf(stderr,"more than %d columns\n",DATA_COLS_MAX);
+		return false;
+	}
+	for (size_t i=0; i<sizeof(col_types)/sizeof(col_types[0]); i++)
+	{
+		if (type_name == col_types[i].name)
+		{
+			toolCol_t col;
+			col.name = name;
+			col.type = col_types[i].type;
+			col.offset = rec_size;
+			cols.push_back(col);
+			rec_size += colSize(col.type);
+			return true;
+		}
+	}
+	fprintf(stderr,"unknown column type '%s'\n",type_name.c_str());
+	return false;
+}
+
+
+static bool parseCols(const char *spec)
+	// name:type,name:type...
+{
+	std::string str = spec;
+	size_t pos = 0;
+	while (pos <= str.size())
+	{
+		size_t end = str.find(',', pos);
+		if (end == std::string::npos)
+			end = str.size();
+		std::string item = str.substr(pos, end - pos);
+		size_t colon = item.find(':');
+		if (colon == std::string::npos)
+		{
+			fprintf(stderr,"expected name:type, not '%s'\n",item.c_str());
+			return false;
+		}
+		if (!addCol(item.substr(0, colon), item.substr(colon + 1)))
+			return false;
+		pos = end + 1;
+	}
+	return true;
+}
+
+
+static bool parseHeader(const char *filename)
+	// Takes the name and type of each col[] of a chart_header.  Not a
+	// general JSON parser; the header is always in the same form.
+{
+	FILE *file = fopen(filename, "rb");
+	if (!file)
+	{
+		perror(filename);
+		return false;
+	}
+	std::string json;
+	char buf[4096];
+	size_t got;
+	while ((got = fread(buf, 1, sizeof(buf), file)) > 0)
+		json.append(buf, got);
+	fclose(file);
+
+	if (json.find("\"cols\":") != std::string::npos)
+	{
+		fprintf(stderr,"%s is for a projection (cols=) of the records\n",filename);
+		return false;
+	}
+	size_t pos = json.find("\"col\":[");
+	if (pos == std::string::npos)
+	{
+		fprintf(stderr,"%s is not a chart_header\n",filename);
+		return false;
+	}
+	while ((pos = json.find("\"name\":\"", pos)) != std::string::npos)
+	{
+		size_t name_start = pos + 8;
+		size_t name_end = json.find('"', name_start);
+		size_t type_start = json.find("\"type\":\"", name_end);
+		if (name_end == std::string::npos || type_start == std::string::npos)
+			break;
+		type_start += 8;
+		size_t type_end = json.find('"', type_start);
+		if (type_end == std::string::npos)
+			break;
+		if (!addCol(
+				json.substr(name_start, name_end - name_start),
+				json.substr(type_start, type_end - type_start)))
+			return false;
+		pos = type_end;
+	}
+
+	size_t size_pos = json.find("\"rec_size\":");
+	if (size_pos != std::string::npos && atoi(json.c_str() + size_pos + 11) != rec_size)
+	{
+		fprintf(stderr,"%s rec_size does not match its columns\n",filename);
+		return false;
+	}
+	return true;
+}
+
+
+//------------------------------------
+// files
+//------------------------------------
+
+static bool openFile(const char *path, dataFile_t *file)
+{
+	int fd = open(path, O_RDONLY);
+	struct stat st;
+	if (fd < 0 || fstat(fd, &st))
+	{
+		perror(path);
+		if (fd >= 0)
+			close(fd);
+		return false;
+	}
+
+	const char *slash = strrchr(path, '/');
+	file->name = slash ? slash + 1 : path;
+	file->data = NULL;
+	file->num_recs = st.st_size / rec_size;
+	if (st.st_size)
+	{
+		void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (data == MAP_FAILED)
+		{
+			perror(path);
+			close(fd);
+			return false;
+		}
+		madvise(data, st.st_size, MADV_SEQUENTIAL);
+		file->data = (const uint8_t *) data;
+	}
+	close(fd);
+
+	// a torn append, which the device truncates when it next appends
+
+	if (st.st_size % rec_size)
+		fprintf(stderr,"%s has %d bytes after the last whole record\n",
+			path,(int)(st.st_size % rec_size));
+	return true;
+}
+
+
+static bool isSegment(const std::string &name)
+	// name.yyyymmdd.datalog
+{
+	size_t end = name.rfind('.');
+	size_t start = end == std::string::npos ? end : name.rfind('.', end - 1);
+	if (start == std::string::npos || end - start != 9)
+		return false;
+	for (size_t i = start + 1; i < end; i++)
+	{
+		if (name[i] < '0' || name[i] > '9')
+			return false;
+	}
+	return true;
+}
+
+
+//------------------------------------
+// column decoding
+//------------------------------------
+
+static uint32_t dts[CHUNK];
+static uint8_t keep[CHUNK];
+static int64_t ivals[CHUNK];
+static float fvals[CHUNK];
+
+
+template<typename T, typename O> static void gather(const uint8_t *src, int num, O *out)
+	// one column of num records into an array
+{
+	for (int r=0; r<num; r++)
+	{
+		T val;
+		memcpy(&val, src + r * rec_size, sizeof(T));
+		out[r] = (O) val;
+	}
+}
+
+
+static void decodeInt(const toolCol_t *col, const uint8_t *recs, int num, int64_t *out)
+	// not for float types
+{
+	const uint8_t *src = recs + col->offset;
+	switch (col->type)
+	{
+		case LOG_COL_TYPE_UINT16:
+			gather<uint16_t>(src, num, out);
+			break;
+		case LOG_COL_TYPE_UINT8:
+		case LOG_COL_TYPE_UINT8x10:
+		case LOG_COL_TYPE_CENTIGRADE8:
+			gather<uint8_t>(src, num, out);
+			break;
+		case LOG_COL_TYPE_INT32:
+			gather<int32_t>(src, num, out);
+			break;
+		case LOG_COL_TYPE_INT16:
+		case LOG_COL_TYPE_CENTIGRADE_RAW:
+		case LOG_COL_TYPE_INT16_10:
+			gather<int16_t>(src, num, out);
+			break;
+		case LOG_COL_TYPE_INT8:
+			gather<int8_t>(src, num, out);
+			break;
+		default:
+			gather<uint32_t>(src, num, out);
+			break;
+	}
+}
+
+
+template<typename T, typename S> static void reduce(const T *vals, const uint8_t *keep, int num, T *min, T *max, S *sum)
+	// Selects instead of branching so that it vectorizes.  A NaN is never
+	// less or greater, so like on the device, it only changes the sum.
+{
+	T lo = *min;
+	T hi = *max;
+	S total = 0;
+	for (int r=0; r<num; r++)
+	{
+		T val = vals[r];
+		bool k = keep[r];
+		lo = k && val < lo ? val : lo;
+		hi = k && val > hi ? val : hi;
+		total += k ? (S) val : (S) 0;
+	}
+	*min = lo;
+	*max = hi;
+	*sum += total;
+}
+
+
+//------------------------------------
+// stats
+//------------------------------------
+
+static int doStats(std::vector<dataFile_t> &files, uint32_t from_dt, uint32_t to_dt)
+{
+	struct timeval start;
+	gettimeofday(&start, NULL);
+
+	uint32_t until = to_dt ? to_dt : 0xffffffff;
+	int num_cols = cols.size();
+	uint64_t count = 0;
+	int64_t imin[DATA_COLS_MAX], imax[DATA_COLS_MAX], isum[DATA_COLS_MAX];
+	float fmin[DATA_COLS_MAX], fmax[DATA_COLS_MAX];
+	double fsum[DATA_COLS_MAX];
+	for (int i=0; i<num_cols; i++)
+	{
+		imin[i] = INT64_MAX;
+		imax[i] = INT64_MIN;
+		isum[i] = 0;
+		fmin[i] = INFINITY;
+		fmax[i] = -INFINITY;
+		fsum[i] = 0;
+	}
+
+	for (size_t f=0; f<files.size(); f++)
+	{
+		const dataFile_t *file = &files[f];
+		for (uint32_t base=0; base<file->num_recs; base+=CHUNK)
+		{
+			int num = file->num_recs - base < CHUNK ? file->num_recs - base : CHUNK;
+			const uint8_t *recs = file->data + (size_t) base * rec_size;
+
+			gather<uint32_t>(recs, num, dts);
+			int kept = 0;
+			for (int r=0; r<num; r++)
+			{
+				keep[r] = dts[r] && dts[r] >= from_dt && dts[r] <= until;
+				kept += keep[r];
+			}
+			if (!kept)
+				continue;
+			count += kept;
+
+			for (int i=0; i<num_cols; i++)
+			{
+				const toolCol_t *col = &cols[i];
+				if (colIsFloat(col->type))
+				{
+					gather<float>(recs + col->offset, num, fvals);
+					reduce(fvals, keep, num, &fmin[i], &fmax[i], &fsum[i]);
+				}
+				else
+				{
+					decodeInt(col, recs, num, ivals);
+					reduce(ivals, keep, num, &imin[i], &imax[i], &isum[i]);
+				}
+			}
+		}
+	}
+
+	struct timeval end;
+	gettimeofday(&end, NULL);
+	long ms = (end.tv_sec - start.tv_sec) * 1000 + (end.tv_usec - start.tv_usec) / 1000;
+
+	printf("{\"from\":%u,\"to\":%u,\"count\":%llu,\"cols\":[",
+		from_dt,to_dt,(unsigned long long) count);
+	for (int i=0; i<num_cols; i++)
+	{
+		printf("%s{\"name\":\"%s\"",i?",":"",cols[i].name.c_str());
+		if (!count)
+			printf(",\"min\":null,\"max\":null,\"avg\":null");
+		else if (colIsFloat(cols[i].type))
+			printf(",\"min\":%0.3f,\"max\":%0.3f,\"avg\":%0.3f",
+				fmin[i],fmax[i],fsum[i] / count);
+		else
+			printf(",\"min\":%lld,\"max\":%lld,\"avg\":%0.3f",
+				(long long) imin[i],(long long) imax[i],(double) isum[i] / count);
+		printf("}");
+	}
+	printf("],\"ms\":%ld}\n",ms);
+	return 0;
+}
+
+
+//------------------------------------
+// scan
+//------------------------------------
+
+typedef struct {
+	uint32_t idx;
+	uint32_t dt;
+	uint32_t next_dt;
+} stackEntry_t;
+
+
+static int doScan(std::vector<dataFile_t> &files)
+	// The same forward pass as scanFile(), with a stack that is never thinned.
+{
+	bool segmented = files.size() > 1 || (files.size() && isSegment(files[0].name));
+	uint32_t num_recs = 0;
+	uint32_t first_dt = 0;
+	uint32_t last_dt = 0;
+	uint32_t tombstones = 0;
+	uint32_t num_spikes = 0;
+	std::string spikes_json = "[";
+	std::string segs_json = "[";
+	std::vector<stackEntry_t> stack;
+	char buf[256];
+
+	for (size_t f=0; f<files.size(); f++)
+	{
+		const dataFile_t *file = &files[f];
+		uint32_t base = num_recs;
+		uint32_t seg_first_dt = 0;
+		uint32_t seg_last_dt = 0;
+		uint32_t seg_tombstones = 0;
+		uint32_t file_first_idx = 0;
+		uint32_t file_first_dt = 0;
+
+		// spikes do not extend back into the previous file
+
+		stack.clear();
+
+		for (uint32_t rec_idx=0; rec_idx<file->num_recs; rec_idx++)
+		{
+			uint32_t dt;
+			memcpy(&dt, file->data + (size_t) rec_idx * rec_size, 4);
+			if (!dt)
+			{
+				tombstones++;
+				seg_tombstones++;
+				continue;
+			}
+			if (!first_dt) first_dt = dt;
+			if (!seg_first_dt) seg_first_dt = dt;
+			if (!file_first_dt)
+			{
+				file_first_idx = base + rec_idx;
+				file_first_dt = dt;
+			}
+
+			if (!stack.empty())
+				stack.back().next_dt = dt;
+
+			if (last_dt && dt < last_dt)
+			{
+				while (!stack.empty() && stack.back().dt > dt)
+					stack.pop_back();
+
+				uint32_t end_idx = base + rec_idx - 1;
+				uint32_t start_idx, spike_first_dt, prev_dt;
+				if (!stack.empty())
+				{
+					start_idx = stack.back().idx + 1;
+					spike_first_dt = stack.back().next_dt;
+					prev_dt = stack.back().dt;
+				}
+				else if (file_first_idx < base + rec_idx)
+				{
+					start_idx = file_first_idx;
+					spike_first_dt = file_first_dt;
+					prev_dt = 0;
+				}
+				else	// first record in the file
+				{
+					start_idx = end_idx;
+					spike_first_dt = last_dt;
+					prev_dt = 0;
+				}
+
+				snprintf(buf,sizeof(buf),"%s{\"start_idx\":%u,\"end_idx\":%u,\"count\":%u,"
+					"\"first_dt\":%u,\"last_dt\":%u,\"prev_dt\":%u,\"next_dt\":%u}",
+					num_spikes ? "," : "",
+					start_idx,end_idx,end_idx - start_idx + 1,
+					spike_first_dt,last_dt,prev_dt,dt);
+				spikes_json += buf;
+				num_spikes++;
+			}
+
+			stackEntry_t entry = { base + rec_idx, dt, 0 };
+			stack.push_back(entry);
+			last_dt = dt;
+			seg_last_dt = dt;
+		}
+
+		num_recs += file->num_recs;
+		snprintf(buf,sizeof(buf),"%s{\"name\":\"%s\",\"first_idx\":%u,\"num_recs\":%u,"
+			"\"first_dt\":%u,\"last_dt\":%u,\"tombstones\":%u}",
+			f ? "," : "",
+			file->name.c_str(),base,file->num_recs,
+			seg_first_dt,seg_last_dt,seg_tombstones);
+		segs_json += buf;
+	}
+
+	spikes_json += "]";
+	segs_json += "]";
+
+	printf("{\"num_recs\":%u,\"first_dt\":%u,\"last_dt\":%u,\"tombstones\":%u,\"spikes\":%s,",
+		num_recs,first_dt,last_dt,tombstones,spikes_json.c_str());
+	if (segmented)
+		printf("\"segments\":%s,",segs_json.c_str());
+	printf("\"pending\":0,\"pending_dropped\":0,\"needs_compact\":%s}\n",
+		tombstones ? "true" : "false");
+	return 0;
+}
+
+
+//------------------------------------
+// export
+//------------------------------------
+// Integers and the fixed point types are formatted by hand, as printf()
+// is most of the time of an export.  Floats still use printf(), so that
+// they round exactly as on the device.
+
+static int formatInt(char *out, int64_t val)
+{
+	char digits[24];
+	int num = 0;
+	uint64_t u = val < 0 ? 0 - (uint64_t) val : (uint64_t) val;
+	do
+	{
+		digits[num++] = '0' + u % 10;
+		u /= 10;
+	} while (u);
+
+	int len = 0;
+	if (val < 0)
+		out[len++] = '-';
+	while (num)
+		out[len++] = digits[--num];
+	return len;
+}
+
+
+static int formatFixed(char *out, int64_t val, int decimals)
+	// val / 10^decimals, the same as printf("%0.<decimals>f")
+{
+	int64_t scale = decimals == 1 ? 10 : 100;
+	int len = 0;
+	if (val < 0)
+	{
+		out[len++] = '-';
+		val = -val;
+	}
+	len += formatInt(out + len, val / scale);
+	out[len++] = '.';
+	if (decimals == 2)
+		out[len++] = '0' + (val / 10) % 10;
+	out[len++] = '0' + val % 10;
+	return len;
+}
+
+
+static int exportTime(char *out, uint32_t dt)
+	// The local time, as exportData().  localtime() is only called
+	// once a minute, as offsets are whole minutes, and localtime_r()
+	// does not check the time zone each time.
+{
+	static uint32_t minute_dt = 0;
+	static char minute_str[64];
+	if (!minute_dt || dt < minute_dt || dt >= minute_dt + 60)
+	{
+		time_t t = dt;
+		struct tm tm;
+		localtime_r(&t, &tm);
+		minute_dt = dt - tm.tm_sec;
+		sprintf(minute_str,"%04d-%02d-%02d %02d:%02d:",
+			tm.tm_year + 1900,
+			tm.tm_mon + 1,
+			tm.tm_mday,
+			tm.tm_hour,
+			tm.tm_min);
+	}
+	uint32_t sec = dt - minute_dt;
+	memcpy(out, minute_str, 17);
+	out[17] = '0' + sec / 10;
+	out[18] = '0' + sec % 10;
+	return 19;
+}
+
+
+static int exportValue(char *out, const toolCol_t *col, const uint8_t *val, bool ndjson, bool fahrenheit)
+	// as myIOTDataLog::exportValue()
+{
+	uint32_t typ = col->type;
+	bool temperature =
+		typ == LOG_COL_TYPE_CENTIGRADE32 ||
+		typ == LOG_COL_TYPE_CENTIGRADE_RAW ||
+		typ == LOG_COL_TYPE_CENTIGRADE8;
+
+	if (typ == LOG_COL_TYPE_UINT16)
+	{
+		uint16_t v;
+		memcpy(&v,val,2);
+		return formatInt(out,v);
+	}
+	if (typ == LOG_COL_TYPE_UINT8)
+		return formatInt(out,*val);
+	if (typ == LOG_COL_TYPE_UINT8x10)
+		return formatInt(out,*val * 10);
+	if (typ == LOG_COL_TYPE_INT32)
+	{
+		int32_t v;
+		memcpy(&v,val,4);
+		return formatInt(out,v);
+	}
+	if (typ == LOG_COL_TYPE_INT16)
+	{
+		int16_t v;
+		memcpy(&v,val,2);
+		return formatInt(out,v);
+	}
+	if (typ == LOG_COL_TYPE_INT8)
+		return formatInt(out,(int8_t) *val);
+	if (typ == LOG_COL_TYPE_INT16_10)
+	{
+		int16_t v;
+		memcpy(&v,val,2);
+		return formatFixed(out,v,1);
+	}
+	if (typ == LOG_COL_TYPE_CENTIGRADE8 && !fahrenheit)
+		return formatFixed(out,((int) *val - 40) * 100,2);
+	if (typ != LOG_COL_TYPE_FLOAT32 && !temperature)
+	{
+		uint32_t v;
+		memcpy(&v,val,4);
+		return formatInt(out,v);
+	}
+
+	float f;
+	if (typ == LOG_COL_TYPE_CENTIGRADE_RAW)
+	{
+		int16_t raw;
+		memcpy(&raw,val,2);
+		f = raw == TEMP_RAW_ERROR ? TEMPERATURE_ERROR : (float) raw * 0.0078125f;
+	}
+	else if (typ == LOG_COL_TYPE_CENTIGRADE8)
+		f = (int) *val - 40;
+	else
+		memcpy(&f,val,4);
+
+	if (isnan(f))
+		return ndjson ? sprintf(out,"null") : 0;
+	if (temperature && fahrenheit)
+		f = (((float) f * 9.0) / 5.0) + 32.0;
+	return sprintf(out,temperature ? "%0.2f" : "%0.3f",f);
+}
+
+
+static int doExport(std::vector<dataFile_t> &files, uint32_t from_dt, uint32_t to_dt, bool ndjson, bool fahrenheit)
+{
+	static char out_buf[1 << 20];
+	setvbuf(stdout, out_buf, _IOFBF, sizeof(out_buf));
+
+	uint32_t until = to_dt ? to_dt : 0xffffffff;
+	int num_cols = cols.size();
+	if (!ndjson)
+	{
+		printf("dt,time");
+		for (int i=0; i<num_cols; i++)
+			printf(",%s",cols[i].name.c_str());
+		printf("\n");
+	}
+
+	// the "name": of each column is only formatted once
+
+	std::vector<std::string> prefix;
+	int max_line = 64;
+	for (int i=0; i<num_cols; i++)
+	{
+		prefix.push_back(ndjson ? ",\"" + cols[i].name + "\":" : ",");
+		max_line += prefix[i].size() + 64;
+	}
+
+	std::vector<char> line(max_line);
+	for (size_t f=0; f<files.size(); f++)
+	{
+		const dataFile_t *file = &files[f];
+		for (uint32_t r=0; r<file->num_recs; r++)
+		{
+			const uint8_t *rec = file->data + (size_t) r * rec_size;
+			uint32_t dt;
+			memcpy(&dt, rec, 4);
+			if (!dt || dt < from_dt || dt > until)
+				continue;
+
+			char *p = &line[0];
+			if (ndjson)
+			{
+				memcpy(p, "{\"dt\":", 6);
+				p += 6;
+				p += formatInt(p, dt);
+				memcpy(p, ",\"time\":\"", 9);
+				p += 9;
+			}
+			else
+			{
+				p += formatInt(p, dt);
+				*p++ = ',';
+			}
+			p += exportTime(p, dt);
+			if (ndjson)
+				*p++ = '"';
+			for (int i=0; i<num_cols; i++)
+			{
+				const toolCol_t *col = &cols[i];
+				memcpy(p, prefix[i].data(), prefix[i].size());
+				p += prefix[i].size();
+				p += exportValue(p, col, rec + col->offset, ndjson, fahrenheit);
+			}
+			if (ndjson)
+				*p++ = '}';
+			*p++ = '\n';
+			fwrite(&line[0], 1, p - &line[0], stdout);
+		}
+	}
+	return fflush(stdout) ? 1 : 0;
+}
+
+
+//------------------------------------
+// main
+//------------------------------------
+
+static int usage()
+{
+	fprintf(stderr,
+		"usage: logtool [-h header.json | -c name:type,...] [-f from_dt] [-t to_dt] [-F]\n"
+		"               stats|scan|csv|ndjson file.datalog [file.datalog ...]\n");
+	return 2;
+}
+
+
+int main(int argc, char **argv)
+{
+	uint32_t from_dt = 0;
+	uint32_t to_dt = 0;
+	bool fahrenheit = false;
+	bool have_cols = false;
+
+	int opt;
+	while ((opt = getopt(argc, argv, "h:c:f:t:F")) != -1)
+	{
+		switch (opt)
+		{
+			case 'h':
+			case 'c':
+				if (have_cols)
+					return usage();
+				if (!(opt == 'h' ? parseHeader(optarg) : parseCols(optarg)))
+					return 1;
+				have_cols = true;
+				break;
+			case 'f':
+				from_dt = strtoul(optarg, NULL, 0);
+				break;
+			case 't':
+				to_dt = strtoul(optarg, NULL, 0);
+				break;
+			case 'F':
+				fahrenheit = true;
+				break;
+			default:
+				return usage();
+		}
+	}
+	if (!have_cols || optind + 2 > argc)
+		return usage();
+
+	const char *command = argv[optind++];
+	std::vector<dataFile_t> files;
+	for (int i=optind; i<argc; i++)
+	{
+		dataFile_t file;
+		if (!openFile(argv[i], &file))
+			return 1;
+		files.push_back(file);
+	}
+
+	if (!strcmp(command, "stats"))
+		return doStats(files, from_dt, to_dt);
+	if (!strcmp(command, "scan"))
+		return doScan(files);
+	if (!strcmp(command, "csv"))
+		return doExport(files, from_dt, to_dt, false, fahrenheit);
+	if (!strcmp(command, "ndjson"))
+		return doExport(files, from_dt, to_dt, true, fahrenheit);
+	return usage();
+}
@@ -52,9 +52,6 @@
 #define DEBUG_ITER			0
 
 
-#define ILLEGAL_DT		1726764664		// 2024-09-19  11:51:04a Panama Local Time
-
-
 //------------------------------------
 // implementation
 //------------------------------------
@@ -79,6 +76,418 @@ static int colSize(uint32_t typ)
 }
 
 
+// Raw (stored unit) access to column values.
+// All of the types compare monotonically in their stored units,
+// i.e. CENTIGRADE8 is biased, not signed, so min/max/avg can be
+// done on the raw values and written back in the same type.
+
+static bool colIsFloat(uint32_t typ)
+{
+	return
+		typ == LOG_COL_TYPE_FLOAT32 ||
+		typ == LOG_COL_TYPE_CENTIGRADE32;
+}
+
+static bool colIsSigned(uint32_t typ)
+{
+	return
+		typ == LOG_COL_TYPE_INT32 ||
+		typ == LOG_COL_TYPE_INT16 ||
+		typ == LOG_COL_TYPE_INT8 ||
+		typ == LOG_COL_TYPE_CENTIGRADE_RAW ||
+		typ == LOG_COL_TYPE_INT16_10;
+}
+
+static int64_t getColInt(const uint8_t *p, uint32_t typ)
+	// not for float types
+{
+	int size = colSize(typ);
+	bool is_signed = colIsSigned(typ);
+	if (size == 1)
+		return is_signed ? (int64_t) *((int8_t *)p) : (int64_t) *p;
+	if (size == 2)
+	{
+		uint16_t val;
+		memcpy(&val,p,2);
+		return is_signed ? (int64_t) (int16_t) val : (int64_t) val;
+	}
+	uint32_t val;
+	memcpy(&val,p,4);
+	return is_signed ? (int64_t) (int32_t) val : (int64_t) val;
+}
+
+static void setColInt(uint8_t *p, uint32_t typ, int64_t val)
+{
+	int size = colSize(typ);
+	if (size == 1)
+		*p = (uint8_t) val;
+	else if (size == 2)
+	{
+		uint16_t val16 = (uint16_t) val;
+		memcpy(p,&val16,2);
+	}
+	else
+	{
+		uint32_t val32 = (uint32_t) val;
+		memcpy(p,&val32,4);
+	}
+}
+
+
+//------------------------------------
+// accumulators
+//------------------------------------
+
+int myIOTDataLog::getRollupRecSize() const
+{
+	int size = 8;	// dt and count
+	for (int i=0; i<m_num_cols; i++)
+	{
+		size += 2 * colSize(m_col[i].type) + 8;
+	}
+	return size;
+}
+
+
+void myIOTDataLog::accumClear(logAccum_t *acc) const
+{
+	acc->count = 0;
+}
+
+
+void myIOTDataLog::accumRecord(logAccum_t *acc, const uint8_t *rec) const
+{
+	bool first = !acc->count;
+	acc->count++;
+
+	int offset = 4;	// skip the dt
+	for (int i=0; i<m_num_cols; i++)
+	{
+		uint32_t typ = m_col[i].type;
+		if (colIsFloat(typ))
+		{
+			float val;
+			memcpy(&val,&rec[offset],4);
+			if (first)
+			{
+				acc->min[i].f = acc->max[i].f = val;
+				acc->sum[i].d = val;
+			}
+			else
+			{
+				if (val < acc->min[i].f) acc->min[i].f = val;
+				if (val > acc->max[i].f) acc->max[i].f = val;
+				acc->sum[i].d += val;
+			}
+		}
+		else
+		{
+			int64_t val = getColInt(&rec[offset],typ);
+			if (first)
+			{
+				acc->min[i].i = acc->max[i].i = acc->sum[i].i = val;
+			}
+			else
+			{
+				if (val < acc->min[i].i) acc->min[i].i = val;
+				if (val > acc->max[i].i) acc->max[i].i = val;
+				acc->sum[i].i += val;
+			}
+		}
+		offset += colSize(typ);
+	}
+}
+
+
+template<typename T, typename S> static void accumValues(const T *vals, const uint8_t *keep, int num, T *min, T *max, S *sum)
+	// min, max, and sum of vals[] where keep[], unchanged if none are kept
+{
+	bool first = true;
+	for (int r=0; r<num; r++)
+	{
+		if (!keep[r])
+			continue;
+		T val = vals[r];
+		if (first)
+		{
+			*min = *max = val;
+			*sum = val;
+			first = false;
+		}
+		else
+		{
+			if (val < *min) *min = val;
+			if (val > *max) *max = val;
+			*sum += val;
+		}
+	}
+}
+
+
+void myIOTDataLog::accumColumn(logAccum_t *acc, int col, const void *vals, const uint8_t *keep, int num_recs) const
+	// vals must be aligned for the column type
+{
+	uint32_t typ = m_col[col].type;
+	int size = colSize(typ);
+	bool is_signed = colIsSigned(typ);
+	int64_t min = 0, max = 0, sum = 0;
+
+	if (colIsFloat(typ))
+	{
+		float fmin = 0, fmax = 0;
+		double dsum = 0;
+		accumValues((const float *) vals, keep, num_recs, &fmin, &fmax, &dsum);
+		acc->min[col].f = fmin;
+		acc->max[col].f = fmax;
+		acc->sum[col].d = dsum;
+		return;
+	}
+
+	if (size == 1 && is_signed)
+	{
+		int8_t lo = 0, hi = 0;
+		accumValues((const int8_t *) vals, keep, num_recs, &lo, &hi, &sum);
+		min = lo; max = hi;
+	}
+	else if (size == 1)
+	{
+		uint8_t lo = 0, hi = 0;
+		accumValues((const uint8_t *) vals, keep, num_recs, &lo, &hi, &sum);
+		min = lo; max = hi;
+	}
+	else if (size == 2 && is_signed)
+	{
+		int16_t lo = 0, hi = 0;
+		accumValues((const int16_t *) vals, keep, num_recs, &lo, &hi, &sum);
+		min = lo; max = hi;
+	}
+	else if (size == 2)
+	{
+		uint16_t lo = 0, hi = 0;
+		accumValues((const uint16_t *) vals, keep, num_recs, &lo, &hi, &sum);
+		min = lo; max = hi;
+	}
+	else if (is_signed)
+	{
+		int32_t lo = 0, hi = 0;
+		accumValues((const int32_t *) vals, keep, num_recs, &lo, &hi, &sum);
+		min = lo; max = hi;
+	}
+	else
+	{
+		uint32_t lo = 0, hi = 0;
+		accumValues((const uint32_t *) vals, keep, num_recs, &lo, &hi, &sum);
+		min = lo; max = hi;
+	}
+	acc->min[col].i = min;
+	acc->max[col].i = max;
+	acc->sum[col].i = sum;
+}
+
+
+void myIOTDataLog::accumMerge(logAccum_t *acc, const logAccum_t *other) const
+{
+	if (!other->count)
+		return;
+	if (!acc->count)
+	{
+		memcpy(acc,other,sizeof(logAccum_t));
+		return;
+	}
+
+	acc->count += other->count;
+	for (int i=0; i<m_num_cols; i++)
+	{
+		if (colIsFloat(m_col[i].type))
+		{
+			if (other->min[i].f < acc->min[i].f) acc->min[i].f = other->min[i].f;
+			if (other->max[i].f > acc->max[i].f) acc->max[i].f = other->max[i].f;
+			acc->sum[i].d += other->sum[i].d;
+		}
+		else
+		{
+			if (other->min[i].i < acc->min[i].i) acc->min[i].i = other->min[i].i;
+			if (other->max[i].i > acc->max[i].i) acc->max[i].i = other->max[i].i;
+			acc->sum[i].i += other->sum[i].i;
+		}
+	}
+}
+
+
+void myIOTDataLog::accumRollup(logAccum_t *acc, const uint8_t *rollup_rec) const
+{
+	logAccum_t other;
+	memcpy(&other.count,&rollup_rec[4],4);
+
+	int offset = 8;	// skip the dt and count
+	for (int i=0; i<m_num_cols; i++)
+	{
+		uint32_t typ = m_col[i].type;
+		int size = colSize(typ);
+		if (colIsFloat(typ))
+		{
+			memcpy(&other.min[i].f,&rollup_rec[offset],4);
+			memcpy(&other.max[i].f,&rollup_rec[offset+4],4);
+			memcpy(&other.sum[i].d,&rollup_rec[offset+8],8);
+		}
+		else
+		{
+			other.min[i].i = getColInt(&rollup_rec[offset],typ);
+			other.max[i].i = getColInt(&rollup_rec[offset+size],typ);
+			memcpy(&other.sum[i].i,&rollup_rec[offset+2*size],8);
+		}
+		offset += 2 * size + 8;
+	}
+
+	accumMerge(acc,&other);
+}
+
+
+void myIOTDataLog::accumToRecords(const logAccum_t *acc, uint32_t dt, uint8_t *min_rec, uint8_t *avg_rec, uint8_t *max_rec) const
+	// write the min, average, and max as three normal records
+{
+	memcpy(min_rec,&dt,4);
+	memcpy(avg_rec,&dt,4);
+	memcpy(max_rec,&dt,4);
+
+	int offset = 4;
+	for (int i=0; i<m_num_cols; i++)
+	{
+		uint32_t typ = m_col[i].type;
+		if (colIsFloat(typ))
+		{
+			float avg = acc->sum[i].d / acc->count;
+			memcpy(&min_rec[offset],&acc->min[i].f,4);
+			memcpy(&avg_rec[offset],&avg,4);
+			memcpy(&max_rec[offset],&acc->max[i].f,4);
+		}
+		else
+		{
+			int64_t half = acc->count / 2;
+			int64_t avg = acc->sum[i].i >= 0 ?
+				(acc->sum[i].i + half) / acc->count :
+				(acc->sum[i].i - half) / acc->count;
+			setColInt(&min_rec[offset],typ,acc->min[i].i);
+			setColInt(&avg_rec[offset],typ,avg);
+			setColInt(&max_rec[offset],typ,acc->max[i].i);
+		}
+		offset += colSize(typ);
+	}
+}
+
+
+void myIOTDataLog::accumToRollup(const logAccum_t *acc, uint32_t dt, uint8_t *rollup_rec) const
+{
+	memcpy(rollup_rec,&dt,4);
+	memcpy(&rollup_rec[4],&acc->count,4);
+
+	int offset = 8;
+	for (int i=0; i<m_num_cols; i++)
+	{
+		uint32_t typ = m_col[i].type;
+		int size = colSize(typ);
+		if (colIsFloat(typ))
+		{
+			memcpy(&rollup_rec[offset],&acc->min[i].f,4);
+			memcpy(&rollup_rec[offset+4],&acc->max[i].f,4);
+			memcpy(&rollup_rec[offset+8],&acc->sum[i].d,8);
+		}
+		else
+		{
+			setColInt(&rollup_rec[offset],typ,acc->min[i].i);
+			setColInt(&rollup_rec[offset+size],typ,acc->max[i].i);
+			memcpy(&rollup_rec[offset+2*size],&acc->sum[i].i,8);
+		}
+		offset += 2 * size + 8;
+	}
+}
+
+
+//------------------------------------
+// column projection
+//------------------------------------
+// A chart only needs the columns whose series are shown, so
+// records can be sent with just the dt and the columns in a bitmask.
+
+uint32_t myIOTDataLog::projectCols(uint32_t cols) const
+{
+	uint32_t all = (1UL << m_num_cols) - 1;
+	cols &= all;
+	return cols == all ? 0 : cols;
+}
+
+
+int myIOTDataLog::projectRecSize(uint32_t cols) const
+{
+	cols = projectCols(cols);
+	if (!cols)
+		return m_rec_size;
+	int size = 4;
+	for (int i=0; i<m_num_cols; i++)
+	{
+		if (cols & (1UL << i))
+			size += colSize(m_col[i].type);
+	}
+	return size;
+}
+
+
+int myIOTDataLog::projectRecords(uint8_t *dst, const uint8_t *src, int num_recs, uint32_t cols) const
+{
+	cols = projectCols(cols);
+	if (!cols)
+	{
+		memmove(dst, src, num_recs * m_rec_size);
+		return num_recs * m_rec_size;
+	}
+
+	// merge adjacent selected columns into runs of bytes to copy
+
+	int run_offset[DATA_COLS_MAX + 1];
+	int run_size[DATA_COLS_MAX + 1];
+	int num_runs = 1;
+	run_offset[0] = 0;
+	run_size[0] = 4;		// the dt
+
+	int offset = 4;
+	for (int i=0; i<m_num_cols; i++)
+	{
+		int size = colSize(m_col[i].type);
+		if (cols & (1UL << i))
+		{
+			if (run_offset[num_runs-1] + run_size[num_runs-1] == offset)
+				run_size[num_runs-1] += size;
+			else
+			{
+				run_offset[num_runs] = offset;
+				run_size[num_runs] = size;
+				num_runs++;
+			}
+		}
+		offset += size;
+	}
+
+	// dst is never after src, so this works in place
+
+	uint8_t *out = dst;
+	for (int r=0; r<num_recs; r++)
+	{
+		const uint8_t *rec = src + r * m_rec_size;
+		for (int i=0; i<num_runs; i++)
+		{
+			memmove(out, rec + run_offset[i], run_size[i]);
+			out += run_size[i];
+		}
+	}
+	return out - dst;
+}
+
+
+
+//------------------------------------
+// myIOTDataLog
+//------------------------------------
+
 myIOTDataLog::myIOTDataLog(
 		const char *name,
 		int num_cols,
@@ -86,6 +495,69 @@ myIOTDataLog::myIOTDataLog(
 	m_name(name),
 	m_num_cols(num_cols),
 	m_col(cols)
+	#if WITH_SD
+		,m_idx_every(0)
+		,m_idx_valid(false)
+		,m_idx_count(0)
+		,m_crc_every(0)
+		,m_crc_valid(false)
+		,m_crc_count(0)
+		,m_crc_run(0)
+		,m_z_block(0)
+		,m_z_valid(false)
+		,m_z_fill(0)
+		,m_z_delta(0)
+		,m_z_prev(NULL)
+		,m_c_recs(0)
+		,m_c_valid(false)
+		,m_c_open(0)
+		,m_stats(NULL)
+		,m_stats_state(0)
+		,m_stats_last(0)
+		,m_rollup(NULL)
+		,m_num_rollups(0)
+		,m_wb_buf(NULL)
+		,m_wb_max(0)
+		,m_wb_count(0)
+		,m_wb_flush_ms(0)
+		,m_wb_start_ms(0)
+		,m_pend_buf(NULL)
+		,m_pend_max(LOG_DEFAULT_PENDING)
+		,m_pend_count(0)
+		,m_pend_dropped(0)
+		,m_q_buf(NULL)
+		,m_q_max(0)
+		,m_q_head(0)
+		,m_q_tail(0)
+		,m_q_batch(0)
+		,m_q_flush_ms(0)
+		,m_q_drain_ms(0)
+		,m_q_draining(false)
+		,m_q_high(0)
+		,m_q_overruns(0)
+		,m_q_batches(0)
+		,m_q_max_batch(0)
+		,m_q_max_write_ms(0)
+		,m_q_overruns_id(NULL)
+		,m_q_high_id(NULL)
+		,m_q_shown_overruns(0)
+		,m_q_shown_high(0)
+		,m_q_shown_ms(0)
+		,m_job_busy(false)
+		,m_chart_buf(NULL)
+		,m_chart_ahead_buf(NULL)
+		,m_chart_buf_size(0)
+		,m_seg_type(LOG_SEGMENT_NONE)
+		,m_seg_count(-1)
+		,m_seg_last(0)
+	#else
+		,m_ram_buf(NULL)
+		,m_ram_max(0)
+		,m_ram_head(0)
+		,m_ram_count(0)
+		,m_ram_overwritten(0)
+		,m_ram_stats(false)
+	#endif
 {
 	m_rec_size = 4;		// 4 for the dt
 	for (int i=0; i<num_cols; i++)
@@ -95,6 +567,12 @@ myIOTDataLog::myIOTDataLog(
 }
 
 
+int myIOTDataLog::getColSize(int i) const
+{
+	return colSize(m_col[i].type);
+}
+
+
 
 
 void myIOTDataLog::dbg_rec(const logRecord_t rec)
@@ -194,9 +672,9 @@ void myIOTDataLog::dbg_rec(const logRecord_t rec)
 		return filename;
 	}
 
-	bool myIOTDataLog::addRecord(const logRecord_t rec)
+	bool myIOTDataLog::addRecord(const logRecord_t rec, uint32_t dt/*=0*/)
 	{
-		uint32_t tm = time(NULL);
+		uint32_t tm = dt ? dt : time(NULL);
 		if (tm < ILLEGAL_DT)
 		{
 			String stime = timeToString(tm);
@@ -205,13 +683,130 @@ void myIOTDataLog::dbg_rec(const logRecord_t rec)
 		}
 		*((uint32_t *)rec) = tm;
 
-		if (myIOTDevice::m_suppress_log)
+		// live tail subscribers get it now, on this task, whether
+		// it is queued, appended, buffered, or kept pending
+
+		#if WITH_WS
+			my_iot_device->wsDataLogRecord(this, rec);
+		#endif
+
+		if (m_q_buf)
+			return queueRecord(rec);
+		return writeRecords(rec,1);
+	}
+
+
+	bool myIOTDataLog::writeRecords(const uint8_t *recs, int num_recs)
+		// Called by addRecord(), or by the writer task with the
+		// records in the ring (see myIOTDataLogQueue.cpp).
+	{
+		if (maintaining())
 		{
-			LOGD("myIOTDataLog::addRecord() suppressed during maintenance");
-			return true;
+			bool ok = true;
+			for (int i=0; i<num_recs; i++)
+			{
+				if (!addPending(&recs[i * m_rec_size]))
+					ok = false;
+			}
+			return ok;
+		}
+		if (m_pend_count && !flush())
+			return false;
+
+		if (!m_wb_buf)
+			return appendRecords(recs,num_recs);
+
+		bool ok = true;
+		for (int i=0; i<num_recs; i++)
+		{
+			const uint8_t *rec = &recs[i * m_rec_size];
+			if (!m_wb_count)
+				m_wb_start_ms = millis();
+			memcpy(&m_wb_buf[m_wb_count * m_rec_size], rec, m_rec_size);
+			m_wb_count++;
+
+			#if DEBUG_ADD
+				LOGD("myIOTDataLog::addRecord() buffered(%d/%d) dt=%s",
+					 m_wb_count,
+					 m_wb_max,
+					 timeToString(*((uint32_t *)rec)).c_str());
+				#if DEBUG_ADD > 1
+					dbg_rec((const logRecord_t) rec);
+				#endif
+			#endif
+
+			if (m_wb_count >= m_wb_max && !flush())
+				ok = false;
 		}
+		return ok;
+	}
 
-		String filename = dataFilename();
+
+	bool myIOTDataLog::appendRecords(const uint8_t *recs, int num_recs)
+		// append one or more records to the datalog with a single write
+		// and then add them to the time index, checksums, and rollups.
+		// The running stats are saved first, so that they can only
+		// include records that did not make it to the card.
+	{
+		if (m_stats)
+			statsRecords(recs, num_recs);
+		if (m_seg_type)
+			return appendSegments(recs, num_recs);
+		if (m_z_block)
+		{
+			bool retval = appendCompressed(recs, num_recs);
+			if (retval && m_rollup)
+				rollupRecords(recs, num_recs);
+			return retval;
+		}
+		if (m_c_recs)
+		{
+			bool retval = appendColumnar(recs, num_recs);
+			if (retval && m_rollup)
+				rollupRecords(recs, num_recs);
+			return retval;
+		}
+
+		uint32_t size;
+		bool retval = appendToFile(dataFilename(), recs, num_recs, &size);
+
+		if (retval && m_idx_every)
+			indexRecords(size / m_rec_size, recs, num_recs);
+		if (retval && m_crc_every)
+			crcRecords(size / m_rec_size, recs, num_recs);
+		if (retval && m_rollup)
+			rollupRecords(recs, num_recs);
+
+		return retval;
+	}
+
+
+	static bool repairTornRecord(const String &filename, uint32_t size, int rec_size)
+		// A power loss during an append can leave a partial record at the
+		// end of the file.  Writing a whole tombstone record over it keeps
+		// the records appended after it aligned.
+	{
+		uint32_t torn = size % rec_size;
+		uint8_t zeros[rec_size];
+		memset(zeros, 0, rec_size);
+
+		File file = SD.open(filename.c_str(), "r+");
+		bool ok = file &&
+			file.seek(size - torn) &&
+			file.write(zeros, rec_size) == rec_size;
+		if (file)
+			file.close();
+
+		LOGW("%s torn record(%d bytes) at %d %s",
+			filename.c_str(), torn, size - torn,
+			ok ? "replaced with a tombstone" : "could not be repaired");
+		return ok;
+	}
+
+
+	bool myIOTDataLog::appendToFile(const String &filename, const uint8_t *recs, int num_recs, uint32_t *size)
+		// returns the size of the file before the append in *size
+	{
 		File file = SD.open(filename, FILE_APPEND);
 		if (!file)
 		{
@@ -219,36 +814,191 @@ void myIOTDataLog::dbg_rec(const logRecord_t rec)
 			return false;
 		}
 
-		uint32_t size = file.size();
+		*size = file.size();
+		if (*size % m_rec_size)
+		{
+			// the sidecars are checked again against the repaired file
+
+			file.close();
+			m_idx_valid = false;
+			m_crc_valid = false;
+			if (!repairTornRecord(filename, *size, m_rec_size))
+				return false;
+
+			file = SD.open(filename, FILE_APPEND);
+			if (!file)
+			{
+				LOGE("myIOTDataLog::addRecord() could not open %s for appending",filename.c_str());
+				return false;
+			}
+			*size = file.size();
+		}
 	#if DEBUG_ADD
-		int num_recs = size / m_rec_size;
-		LOGD("myIOTDataLog::addRecord() rec_size(%d) rec_num(%d)=file_size(%d) dt=%s",
+		int num_file_recs = *size / m_rec_size;
+		LOGD("myIOTDataLog::addRecord() rec_size(%d) rec_num(%d)=file_size(%d) num_recs(%d)",
 			 m_rec_size,
-			 num_recs + 1,
-			 size,
-			 timeToString(tm).c_str());
+			 num_file_recs + 1,
+			 *size,
+			 num_recs);
 		#if DEBUG_ADD > 1
-			dbg_rec(rec);
+			if (num_recs == 1)
+				dbg_rec((const logRecord_t) recs);
 		#endif
 	#endif
 
 		bool retval = true;
-		int bytes = file.write((uint8_t *)rec,m_rec_size);
-		if (bytes != m_rec_size)
+		int len = num_recs * m_rec_size;
+		int bytes = file.write(recs,len);
+		if (bytes != len)
 		{
-			LOGE("myIOTDataLog::addRecord() Error appending(%d/%d) bytes at %d in %s",bytes,m_rec_size,size,filename.c_str());
+			LOGE("myIOTDataLog::addRecord() Error appending(%d/%d) bytes at %d in %s",bytes,len,*size,filename.c_str());
 			retval = false;
 		}
 
 		file.close();
 		return retval;
 	}
-#endif 	// WITH_SD
 
 
+	//---------------------------------
+	// write-behind buffer
+	//---------------------------------
 
-//-----------------------------------------
-// getChartHeader()
+	void myIOTDataLog::setWriteBehind(int buf_bytes, uint32_t flush_ms)
+	{
+		flush();
+		if (m_wb_buf)
+			delete[] m_wb_buf;
+		m_wb_buf = NULL;
+		m_wb_max = 0;
+		m_wb_flush_ms = flush_ms;
+
+		if (buf_bytes > 0)
+		{
+			m_wb_max = buf_bytes / m_rec_size;
+			if (m_wb_max < 1)
+				m_wb_max = 1;
+			m_wb_buf = new uint8_t[m_wb_max * m_rec_size];
+			LOGI("myIOTDataLog(%s) write-behind %d records flush_ms(%d)",m_name,m_wb_max,flush_ms);
+		}
+	}
+
+
+	void myIOTDataLog::setChartBuffer(int buf_bytes, bool read_ahead)
+	{
+		if (m_chart_buf)
+			delete[] m_chart_buf;
+		if (m_chart_ahead_buf)
+			delete[] m_chart_ahead_buf;
+		m_chart_buf = NULL;
+		m_chart_ahead_buf = NULL;
+		m_chart_buf_size = 0;
+
+		if (buf_bytes > 0)
+		{
+			// at least the default, which holds a rollup record of DATA_COLS_MAX
+
+			#define MIN_CHART_BUF	1024
+			if (buf_bytes < MIN_CHART_BUF)
+				buf_bytes = MIN_CHART_BUF;
+			m_chart_buf_size = buf_bytes;
+			m_chart_buf = new uint8_t[buf_bytes];
+			if (read_ahead)
+				m_chart_ahead_buf = new uint8_t[buf_bytes];
+			LOGI("myIOTDataLog(%s) chart buffer %d bytes read_ahead(%d)",m_name,buf_bytes,read_ahead);
+		}
+	}
+
+
+	bool myIOTDataLog::flush()
+		// Buffered records are discarded if the write fails,
+		// as a single unbuffered record would have been.
+		// Pending records are written after them, unless
+		// maintenance is still going on.  With a queue, the
+		// records in the ring are written first.
+	{
+		logJobLock lock(this);
+		if (m_q_buf)
+			drainQueue();
+
+		bool ok = true;
+		if (m_wb_count)
+		{
+			int num_recs = m_wb_count;
+			m_wb_count = 0;
+			ok = appendRecords(m_wb_buf, num_recs);
+		}
+		if (m_pend_count && !maintaining())
+		{
+			int num_recs = m_pend_count;
+			m_pend_count = 0;
+			LOGI("myIOTDataLog(%s) appending %d records from maintenance, %d dropped",
+				m_name,num_recs,m_pend_dropped);
+			if (!appendRecords(m_pend_buf, num_recs))
+				ok = false;
+		}
+		return ok;
+	}
+
+
+	void myIOTDataLog::loop()
+	{
+		loopJob();
+		if (m_q_buf)
+			loopQueue();		// the writer task does the rest
+		else if (m_pend_count && !maintaining())
+			flush();
+		else if (m_wb_count &&
+			m_wb_flush_ms &&
+			millis() - m_wb_start_ms >= m_wb_flush_ms)
+			flush();
+	}
+
+
+	//---------------------------------
+	// pending records
+	//---------------------------------
+
+	void myIOTDataLog::setPendingSize(int num_recs)
+	{
+		flush();
+		if (m_pend_buf)
+			delete[] m_pend_buf;
+		m_pend_buf = NULL;
+		m_pend_count = 0;
+		m_pend_max = num_recs > 0 ? num_recs : 0;
+	}
+
+
+	bool myIOTDataLog::addPending(const uint8_t *rec)
+		// Keep a record that arrived during maintenance.  When the
+		// queue is full the newest records are dropped and counted.
+	{
+		if (!m_pend_buf && m_pend_max)
+			m_pend_buf = new uint8_t[m_pend_max * m_rec_size];
+
+		if (m_pend_count >= m_pend_max)
+		{
+			m_pend_dropped++;
+			LOGW("myIOTDataLog(%s) dropped record during maintenance (%d total)",m_name,m_pend_dropped);
+			return false;
+		}
+
+		memcpy(&m_pend_buf[m_pend_count * m_rec_size], rec, m_rec_size);
+		m_pend_count++;
+
+		#if DEBUG_ADD
+			LOGD("myIOTDataLog::addRecord() pending(%d/%d) during maintenance",m_pend_count,m_pend_max);
+		#endif
+		return true;
+	}
+
+#endif 	// WITH_SD
+
+
+
+//-----------------------------------------
+// getChartHeader()
 //-----------------------------------------
 // returns json chart_header string as used by iotChart.js
 
@@ -265,13 +1015,33 @@ void addJsonVal(String &rslt, const char *field, String val, bool quoted, bool c
 }
 
 
-String myIOTDataLog::getChartHeader(int period, int with_degrees, const String *series_colors /*=NULL*/)
+String myIOTDataLog::getChartHeader(int period, int with_degrees, const String *series_colors /*=NULL*/, uint32_t cols /*=0*/, int range_secs /*=-1*/)
 {
 	String rslt = "{\n";
 
+	// the ranges of the columns, if known, so that the
+	// client can lay out the axes before the data arrives
+
+	if (range_secs < 0)
+		range_secs = period;
+	uint32_t now = time(NULL);
+	logAccum_t acc;
+	bool ranges = colRanges(&acc,
+		range_secs && (uint32_t) range_secs < now ? now - range_secs : 0);
+
+	cols = projectCols(cols);
+	int num_cols = 0;
+	for (int i=0; i<m_num_cols; i++)
+	{
+		if (!cols || (cols & (1UL << i)))
+			num_cols++;
+	}
+
 	addJsonVal(rslt,"name",m_name,true,true,true);
-	addJsonVal(rslt,"rec_size",String(m_rec_size),false,true,true);
-	addJsonVal(rslt,"num_cols",String(m_num_cols),false,true,true);
+	addJsonVal(rslt,"rec_size",String(projectRecSize(cols)),false,true,true);
+	addJsonVal(rslt,"num_cols",String(num_cols),false,true,true);
+	if (cols)
+		addJsonVal(rslt,"cols",String(cols),false,true,true);
 	addJsonVal(rslt,"default_period",String(period),false,true,true);
 	#if WITH_SD
 	addJsonVal(rslt,"has_file","true",false,true,true);
@@ -287,12 +1057,21 @@ String myIOTDataLog::getChartHeader(int period, int with_degrees, const String *
 
 	if (series_colors)
 		addJsonVal(rslt,"series_colors",*series_colors,false,true,true);
+	if (ranges)
+	{
+		addJsonVal(rslt,"range_secs",String(range_secs),false,true,true);
+		addJsonVal(rslt,"range_count",String(acc.count),false,true,true);
+	}
 	
 	rslt += "\"col\":[\n";
 
+	bool first = true;
 	for (int i=0; i<m_num_cols; i++)
 	{
-		if (i) rslt += ",";
+		if (cols && !(cols & (1UL << i)))
+			continue;
+		if (!first) rslt += ",";
+		first = false;
 		rslt += "{";
 
 		const logColumn_t *col = &m_col[i];
@@ -311,7 +1090,17 @@ String myIOTDataLog::getChartHeader(int period, int with_degrees, const String *
 			"uint32_t";
 		addJsonVal(rslt,"name",col->name,							true,true,false);
 		addJsonVal(rslt,"type",str,									true,true,false);
-		addJsonVal(rslt,"tick_interval",String(col->tick_interval),	false,false,true);
+		addJsonVal(rslt,"tick_interval",String(col->tick_interval),	false,ranges,!ranges);
+		if (ranges && colIsFloat(col->type))
+		{
+			addJsonVal(rslt,"min",String(acc.min[i].f,3),			false,true,false);
+			addJsonVal(rslt,"max",String(acc.max[i].f,3),			false,false,true);
+		}
+		else if (ranges)
+		{
+			addJsonVal(rslt,"min",String((long) acc.min[i].i),		false,true,false);
+			addJsonVal(rslt,"max",String((long) acc.max[i].i),		false,false,true);
+		}
 		rslt += "}\n";
 	}
 	rslt += "]\n";
@@ -334,18 +1123,179 @@ String myIOTDataLog::getChartHeader(int period, int with_degrees, const String *
 
 #if WITH_SD
 
-	bool startSDBackwards(SDBackwards_t *iter)
+	//-----------------------------------------
+	// read-ahead
+	//-----------------------------------------
+	// Given a second buffer, getSDBackwards() has a reader task on the
+	// other core read the next (earlier) buffer while the client sends
+	// the current one, so that SD and WiFi latency overlap instead of
+	// adding up.  There is only one reader, so only one read is ever
+	// in flight; if it is busy the iterator just reads synchronously.
+
+	#define READ_AHEAD_STACK	4096
+
+	typedef struct {
+		File *file;
+		int pos;
+		int len;
+		uint8_t *buf;
+		bool ok;
+	} readAheadReq_t;
+
+	static readAheadReq_t s_ra_req;
+	static QueueHandle_t s_ra_queue = NULL;
+	static SemaphoreHandle_t s_ra_done = NULL;
+	static SemaphoreHandle_t s_ra_busy = NULL;
+
+
+	static void readAheadTask(void *param)
+	{
+		while (1)
+		{
+			readAheadReq_t *req;
+			if (xQueueReceive(s_ra_queue, &req, portMAX_DELAY) == pdTRUE)
+			{
+				req->ok =
+					req->file->seek(req->pos) &&
+					req->file->read(req->buf, req->len) == req->len;
+				xSemaphoreGive(s_ra_done);
+			}
+		}
+	}
+
+
+	static bool initReadAhead()
+	{
+		if (s_ra_queue)
+			return true;
+
+		s_ra_done = xSemaphoreCreateBinary();
+		s_ra_busy = xSemaphoreCreateMutex();
+		s_ra_queue = xQueueCreate(1, sizeof(readAheadReq_t *));
+		if (!s_ra_done || !s_ra_busy || !s_ra_queue)
+		{
+			LOGE("initReadAhead() could not create queue");
+			s_ra_queue = NULL;
+			return false;
+		}
+
+		LOGI("starting sdReadAhead task pinned to core %d",ESP32_CORE_OTHER);
+		xTaskCreatePinnedToCore(
+			readAheadTask,
+			"sdReadAhead",
+			READ_AHEAD_STACK,
+			NULL,
+			1,		// priority
+			NULL,	// handle
+			ESP32_CORE_OTHER);
+		return true;
+	}
+
+
+	static int nextReadBytes(SDBackwards_t *iter)
+		// moves read_pos back by a buffer (or to start_pos)
+		// and returns the number of bytes to read there,
+		// or back by one block of a file of blocks
+	{
+		if (iter->block_size)
+		{
+			int pos = ((iter->read_pos - 1) / iter->block_size) * iter->block_size;
+			if (pos < iter->start_pos)
+				pos = iter->start_pos;
+			int read_bytes = iter->read_pos - pos;
+			iter->read_pos = pos;
+			return read_bytes;
+		}
+
+		int read_bytes = iter->buf_size;
+		if (iter->read_pos - iter->start_pos < read_bytes)
+		{
+			read_bytes = iter->read_pos - iter->start_pos;
+			iter->read_pos = iter->start_pos;
+		}
+		else
+			iter->read_pos -= read_bytes;
+		return read_bytes;
+	}
+
+
+	static uint8_t *readDest(SDBackwards_t *iter, uint8_t *buf)
+		// blocks are read into the end of the buffer and
+		// decoded into records at the start of it
+	{
+		return iter->block_size ?
+			buf + iter->buf_size - iter->block_size :
+			buf;
+	}
+
+
+	static void issueReadAhead(SDBackwards_t *iter)
+	{
+		if (xSemaphoreTake(s_ra_busy, 0) != pdTRUE)
+			return;		// another iteration is reading ahead
+
+		iter->ahead_bytes = nextReadBytes(iter);
+		iter->ahead_pending = true;
+
+		s_ra_req.file = &iter->file;
+		s_ra_req.pos = iter->read_pos;
+		s_ra_req.len = iter->ahead_bytes;
+		s_ra_req.buf = readDest(iter, iter->ahead_buf);
+		s_ra_req.ok = false;
+
+		#if DEBUG_ITER > 1
+			LOGD("    reading ahead %d bytes at file_offset(%d)",iter->ahead_bytes,iter->read_pos);
+		#endif
+
+		readAheadReq_t *req = &s_ra_req;
+		xQueueSend(s_ra_queue, &req, portMAX_DELAY);
+	}
+
+
+	static bool waitReadAhead(SDBackwards_t *iter)
+		// waits for the pending read, if any, and returns its result
+	{
+		if (!iter->ahead_pending)
+			return true;
+		xSemaphoreTake(s_ra_done, portMAX_DELAY);
+		iter->ahead_pending = false;
+		bool ok = s_ra_req.ok;
+		xSemaphoreGive(s_ra_busy);
+		return ok;
+	}
+
+
+	void endSDBackwards(SDBackwards_t *iter)
+	{
+		waitReadAhead(iter);
+		iter->done = 1;
+		if (iter->file)
+			iter->file.close();
+	}
+
+
+	//-----------------------------------------
+	// startSDBackwards()
+	//-----------------------------------------
+
+	static bool startIteration(SDBackwards_t *iter, uint32_t start_pos, uint8_t *ahead_buf, int end_pos)
 	{
 		iter->done = true;
+		iter->stopped = false;
+		iter->error = false;
 		iter->read_pos = 0;
 		iter->buf_idx = -1;
+		iter->start_pos = start_pos;
+		iter->ahead_buf = ahead_buf && initReadAhead() ? ahead_buf : NULL;
+		iter->ahead_pending = false;
+		iter->ahead_bytes = 0;
 
 		#if DEBUG_ITER
-			LOGD("startSDBackwards(%s) rec_size(%d) buf_size(%d)",
-				 iter->filename, iter->rec_size, iter->buf_size);
+			LOGD("startSDBackwards(%s) rec_size(%d) buf_size(%d) block_size(%d)",
+				 iter->filename, iter->rec_size, iter->buf_size, iter->block_size);
 		#endif
 		
-		int num_file_recs = 0;
+		int file_bytes = 0;
 		if (!SD.exists(iter->filename))
 		{
 			LOGW("missing %s",iter->filename);
@@ -363,24 +1313,29 @@ String myIOTDataLog::getChartHeader(int period, int with_degrees, const String *
 			{
 				LOGW("empty %s",iter->filename);
 			}
-			else if (size % iter->rec_size)
+			else if (!iter->block_size && size % iter->rec_size)
 			{
-				LOGE("%s size(%d) is not a multiple of rec_size(%d)",iter->filename,size,iter->rec_size);
-				iter->file.close();
-				return false;
+				// a torn record from a power loss during an append
+				// (in a file of blocks, the decoder stops at it)
+				LOGW("%s ignoring %d bytes after the last whole record",iter->filename,size % iter->rec_size);
 			}
-			num_file_recs = size / iter->rec_size;
+			file_bytes = iter->block_size ? size : (size / iter->rec_size) * iter->rec_size;
 			#if DEBUG_ITER
-				LOGD("file size=%d  num_file_recs=%d",size,num_file_recs);
+				LOGD("file size=%d  file_bytes=%d",size,file_bytes);
 			#endif
 		}
 
-		if (num_file_recs > 0)
+		if (end_pos < 0 || end_pos > file_bytes)
+			end_pos = file_bytes;
+		if (iter->start_pos > end_pos)
+			iter->start_pos = end_pos;
+
+		if (file_bytes > 0 && iter->start_pos < end_pos)
 		{
 			iter->done = false;
-			iter->read_pos = iter->file.size();	// Initial read position
+			iter->read_pos = end_pos;	// Initial read position
 			#if DEBUG_ITER
-				LOGD("initial read_pos=%d",iter->read_pos,num_file_recs);
+				LOGD("initial read_pos=%d",iter->read_pos);
 			#endif
 		}
 
@@ -392,7 +1347,25 @@ String myIOTDataLog::getChartHeader(int period, int with_degrees, const String *
 		
 		return true;
 
-	}   // startSDBackwards()
+	}   // startIteration()
+
+
+	bool startSDBackwards(SDBackwards_t *iter, uint32_t start_pos /*=0*/, uint8_t *ahead_buf /*=NULL*/, int end_pos /*=-1*/)
+	{
+		iter->block_size = 0;
+		iter->decode_fxn = NULL;
+		iter->decode_data = NULL;
+		return startIteration(iter, start_pos, ahead_buf, end_pos);
+	}
+
+
+	bool startSDBlocksBackwards(SDBackwards_t *iter, uint32_t block_size, SDDecodeCB decode_fxn, void *decode_data, uint8_t *ahead_buf /*=NULL*/, int end_pos /*=-1*/)
+	{
+		iter->block_size = block_size;
+		iter->decode_fxn = decode_fxn;
+		iter->decode_data = decode_data;
+		return startIteration(iter, 0, ahead_buf, end_pos);
+	}
 
 
 
@@ -411,48 +1384,69 @@ String myIOTDataLog::getChartHeader(int period, int with_degrees, const String *
 
 		if (iter->buf_idx < 0)  // buffer exhausted
 		{
-			if (iter->read_pos == 0)
+			int read_bytes;
+			if (iter->ahead_pending)
 			{
-				#if DEBUG_ITER
-					LOGD("           END OF FILE");
-				#endif
-				iter->done = 1;
-				return NULL;
-			}
+				read_bytes = iter->ahead_bytes;
+				if (!waitReadAhead(iter))
+				{
+					LOGE("Error reading ahead %d bytes at read_pos=%d", read_bytes, iter->read_pos);
+					iter->error = true;
+					endSDBackwards(iter);
+					return NULL;
+				}
 
-			int read_bytes = iter->buf_size;
-			if (iter->read_pos < read_bytes)
-			{
-				read_bytes = iter->read_pos;
-				iter->read_pos = 0;
+				// the buffer the client just finished with gets the next read
+
+				uint8_t *buf = iter->buffer;
+				iter->buffer = iter->ahead_buf;
+				iter->ahead_buf = buf;
 			}
 			else
-				iter->read_pos -= read_bytes;
+			{
+				if (iter->read_pos <= iter->start_pos)
+				{
+					#if DEBUG_ITER
+						LOGD("           END OF FILE at %d",iter->start_pos);
+					#endif
+					endSDBackwards(iter);
+					return NULL;
+				}
 
-			#if DEBUG_ITER > 1
-				LOGD("seeking to file_offset(%d)",iter->read_pos);
-			#endif
+				read_bytes = nextReadBytes(iter);
 
-			if (!iter->file.seek(iter->read_pos))
-			{
-				LOGE("Could not seek to byte %d", iter->read_pos);
-				iter->file.close();
-				return NULL;
-			}
+				#if DEBUG_ITER > 1
+					LOGD("seeking to file_offset(%d)",iter->read_pos);
+				#endif
 
-			#if DEBUG_ITER > 1
-				LOGD("    reading %d bytes at file_offset(%d)",read_bytes,iter->read_pos);
-			#endif
+				if (!iter->file.seek(iter->read_pos))
+				{
+					LOGE("Could not seek to byte %d", iter->read_pos);
+					iter->error = true;
+					endSDBackwards(iter);
+					return NULL;
+				}
 
-			uint32_t bytes = iter->file.read(iter->buffer, read_bytes);
-			if (bytes != read_bytes)
-			{
-				LOGE("Error reading (%d/%d) at read_pos=%d", bytes,read_bytes,iter->read_pos);
-				iter->file.close();
-				return NULL;
+				#if DEBUG_ITER > 1
+					LOGD("    reading %d bytes at file_offset(%d)",read_bytes,iter->read_pos);
+				#endif
+
+				uint32_t bytes = iter->file.read(readDest(iter, iter->buffer), read_bytes);
+				if (bytes != read_bytes)
+				{
+					LOGE("Error reading (%d/%d) at read_pos=%d", bytes,read_bytes,iter->read_pos);
+					iter->error = true;
+					endSDBackwards(iter);
+					return NULL;
+				}
 			}
 
-			iter->num_buf_recs = read_bytes / iter->rec_size;
+			if (iter->ahead_buf && iter->read_pos > iter->start_pos)
+				issueReadAhead(iter);
+
+			iter->num_buf_recs = iter->block_size ?
+				iter->decode_fxn(iter->decode_data, readDest(iter, iter->buffer), read_bytes, iter->buffer) :
+				read_bytes / iter->rec_size;
 			iter->buf_idx = iter->num_buf_recs - 1;
 
 			#if DEBUG_ITER > 1
@@ -480,8 +1474,8 @@ String myIOTDataLog::getChartHeader(int period, int with_degrees, const String *
 					#if DEBUG_ITER
 						LOGD("iteration ended by STOP at buf_idx(%d)",iter->buf_idx);
 					#endif
-					iter->done = 1;
-					iter->file.close();
+					iter->stopped = 1;
+					endSDBackwards(iter);
 				}
 				else	// ITER_SKIP (tombstone)
 				{
@@ -510,8 +1504,8 @@ String myIOTDataLog::getChartHeader(int period, int with_degrees, const String *
 				}
 				if (state == ITER_STOP)
 				{
-					iter->done = 1;
-					iter->file.close();
+					iter->stopped = 1;
+					endSDBackwards(iter);
 					return NULL;
 				}
 				// ITER_SKIP: continue loop
@@ -522,232 +1516,672 @@ String myIOTDataLog::getChartHeader(int period, int with_degrees, const String *
 	}
 
 
+#endif	// WITH_SD
+
+
 	//-----------------------------------------
-	// sendChartData()
+	// chartDecimator
 	//-----------------------------------------
-	// Usually single instance, debugging of static method
-	// uses global for multiple instances
+	// Collapses the records of a chart query, which arrive newest first,
+	// into min/avg/max triples of records, one triple per time bucket.
+	// The triples, projected to cols if given, are written to the web
+	// server in out_buf sized batches.
 
-	SDIterState_t chartDataCondition(uint32_t cutoff, uint8_t *rec)
+	class chartDecimator
 	{
-		uint32_t ts = *((uint32_t *) rec);
-		if (ts == 0)
-			return ITER_SKIP;		// tombstoned record
-		if (ts >= cutoff)
-			return ITER_INCLUDE;
-
-		#if DEBUG_SEND_DATA>2
+	public:
+
+		chartDecimator(const myIOTDataLog *log, uint32_t bucket_secs, uint8_t *out_buf, int out_size, uint32_t cols=0) :
+			m_log(log),
+			m_rec_size(log->getRecSize()),
+			m_cols(log->projectCols(cols)),
+			m_bucket_secs(bucket_secs),
+			m_bucket_dt(0),
+			m_num_buckets(0),
+			m_out_buf(out_buf),
+			m_out_size(out_size),
+			m_out_fill(0)
 		{
-			String dt1 = timeToString(ts);
-			String dt2 = timeToString(cutoff);
-			LOGD("    chartDataCondition(STOP) at %s < %s",dt1.c_str(),dt2.c_str());
+			m_acc.count = 0;
 		}
-		#endif
-		return ITER_STOP;
-	}
-
-
-	String myIOTDataLog::sendChartData(uint32_t secs_or_dt,bool since/*=false*/)
-	{
-		#define BASE_BUF_SIZE	1024
 
-		String filename = dataFilename();
-		uint32_t cutoff = secs_or_dt ?
-			since ? secs_or_dt : time(NULL) - secs_or_dt : 0;
-
-		// pick bufsize > 512 that will hold even number of records
-
-		int buf_size = ((BASE_BUF_SIZE + m_rec_size-1) / m_rec_size) * m_rec_size;
-		uint8_t stack_buffer[buf_size];
-
-		#if DEBUG_SEND_DATA
+		bool add(const uint8_t *rec)
 		{
-			String dbg_tm = timeToString(cutoff);
-			LOGI("sendChartData rec_size(%d) secs/dt(%d) since_bool(%d) since(%s) from %s",
-				 m_rec_size,
-				 secs_or_dt,
-				 since,
-				 secs_or_dt?dbg_tm.c_str():"forever",
-				 filename.c_str());
-			LOGD("    buf_size(%d) cutoff=(%d)",buf_size,cutoff);
+			uint32_t dt;
+			memcpy(&dt,rec,4);
+			if (!startBucket(dt))
+				return false;
+			m_log->accumRecord(&m_acc,rec);
+			return true;
 		}
-		#endif
-
-		// initialize iterator struct
-
-		SDBackwards_t iter;
-		iter.chunked        = 1;
-		iter.client_data    = cutoff;
-		iter.filename       = filename.c_str();
-		iter.rec_size       = m_rec_size;
-		iter.record_fxn     = chartDataCondition;
-		iter.buffer         = stack_buffer;                 // an even multiple of rec_size
-		iter.buf_size       = buf_size;
-
-		if (!startSDBackwards(&iter))
-			return "";
-
-		if (!myiot_web_server->startBinaryResponse("application/octet-stream", CONTENT_LENGTH_UNKNOWN))
-			return "";
-
-		int sent = 0;
-		int num_file_recs = iter.file ? iter.file.size() / m_rec_size : 0;
-
-		int num_recs;
-		uint8_t *rec_buf = getSDBackwards(&iter,&num_recs);
-		while (num_recs)
+		bool addRollup(const uint8_t *rollup_rec)
 		{
-			sent += num_recs;
-
-			#if DEBUG_SEND_DATA > 1
-				int offset = 0;
-				for (int i=0; i<num_recs; i++)
-				{
-					dbg_rec(&rec_buf[i*m_rec_size]);
-				}
-			#endif
+			uint32_t dt;
+			memcpy(&dt,rollup_rec,4);
+			if (!startBucket(dt))
+				return false;
+			m_log->accumRollup(&m_acc,rollup_rec);
+			return true;
+		}
+		bool addAccum(uint32_t dt, const logAccum_t *acc)
+		{
+			if (!startBucket(dt))
+				return false;
+			m_log->accumMerge(&m_acc,acc);
+			return true;
+		}
 
-			if (!myiot_web_server->writeBinaryData((const char*)rec_buf, num_recs * m_rec_size))
-			{
-				if (iter.file)
-					iter.file.close();
-				return "";
-			}
+		bool finish();
+		int numBuckets() const { return m_num_buckets; }
 
-			rec_buf = getSDBackwards(&iter,&num_recs);
-		}
+	private:
 
-		#if DEBUG_SEND_DATA
-			LOGD("    sendChartData() sent %d/%d records",sent,num_file_recs);
-		#endif
+		const myIOTDataLog *m_log;
+		int m_rec_size;
+		uint32_t m_cols;			// 0 = all columns
+		uint32_t m_bucket_secs;
+		uint32_t m_bucket_dt;
+		int m_num_buckets;
+		logAccum_t m_acc;
 
-		return RESPONSE_HANDLED;
-	}
+		uint8_t *m_out_buf;
+		int m_out_size;
+		int m_out_fill;
 
+		bool startBucket(uint32_t dt);
+		bool emitBucket();
+	};
 
-	//-----------------------------------------
-	// scanFile()
-	//-----------------------------------------
 
-	String myIOTDataLog::scanFile()
+	bool chartDecimator::startBucket(uint32_t dt)
+		// emit the current bucket if dt is in a different one
 	{
-		String filename = dataFilename();
-		File file = SD.open(filename.c_str(), FILE_READ);
-		if (!file)
+		uint32_t bucket_dt = dt - (dt % m_bucket_secs);
+		if (m_acc.count && bucket_dt != m_bucket_dt)
 		{
-			LOGE("scanFile() could not open %s", filename.c_str());
-			return "";
+			if (!emitBucket())
+				return false;
 		}
+		m_bucket_dt = bucket_dt;
+		return true;
+	}
+
 
-		uint32_t size = file.size();
-		if (!size)
+	bool chartDecimator::emitBucket()
+	{
+		if (m_out_fill + 3 * m_rec_size > m_out_size)
 		{
-			file.close();
-			return "{\"num_recs\":0,\"first_dt\":0,\"last_dt\":0,\"tombstones\":0,\"spikes\":[],\"needs_compact\":false}";
+			if (!myiot_web_server->writeBinaryData((const char *)m_out_buf, m_out_fill))
+				return false;
+			m_out_fill = 0;
 		}
 
-		// Chunked forward read — one SD read per chunk instead of one seek
-		// per record.  Only the backward spike-walk uses individual seeks.
-		#define SCAN_BASE_BUF  1024
-		int      buf_size = ((SCAN_BASE_BUF + m_rec_size - 1) / m_rec_size) * m_rec_size;
-		uint8_t  stack_buffer[buf_size];
+		uint8_t *min_rec = &m_out_buf[m_out_fill];
+		m_log->accumToRecords(&m_acc, m_bucket_dt,
+			min_rec,
+			min_rec + m_rec_size,
+			min_rec + 2 * m_rec_size);
+		m_out_fill += m_cols ?
+			m_log->projectRecords(min_rec, min_rec, 3, m_cols) :
+			3 * m_rec_size;
+
+		m_acc.count = 0;
+		m_num_buckets++;
+		return true;
+	}
 
-		uint32_t num_recs    = size / m_rec_size;
-		uint32_t tombstones  = 0;
-		uint32_t first_dt    = 0;
-		uint32_t last_dt     = 0;
-		uint32_t prev_dt     = 0;
-		String   spikes_json = "[";
-		bool     first_spike = true;
 
-		// How far back to walk when characterising a spike (individual seeks).
-		#define MAX_SPIKE_LOOK 100
+	bool chartDecimator::finish()
+	{
+		if (m_acc.count && !emitBucket())
+			return false;
+		if (m_out_fill && !myiot_web_server->writeBinaryData((const char *)m_out_buf, m_out_fill))
+			return false;
+		m_out_fill = 0;
+		return true;
+	}
 
-		uint32_t file_offset = 0;
-		uint32_t rec_idx     = 0;
 
-		while (file_offset < size)
+	bool myIOTDataLog::sendProjected(const uint8_t *recs, int num_recs, uint32_t cols, uint8_t *out_buf, int out_size)
+		// project records that must not be changed in out_buf sized batches
+	{
+		int batch = out_size / m_rec_size;
+		while (num_recs > 0)
+		{
+			int n = num_recs < batch ? num_recs : batch;
+			int bytes = projectRecords(out_buf, recs, n, cols);
+			if (!myiot_web_server->writeBinaryData((const char *)out_buf, bytes))
+				return false;
+			recs += n * m_rec_size;
+			num_recs -= n;
+		}
+		return true;
+	}
+
+
+//-----------------------------------------
+// getColStats()
+//-----------------------------------------
+
+String myIOTDataLog::colStatsJson(uint32_t from_dt, uint32_t to_dt, uint32_t cols, const logAccum_t *acc, const String &extra)
+	// values are in stored units, i.e. a CENTIGRADE8 column is offset by 40
+{
+	String result = "{";
+	result += "\"from\":"  + String(from_dt)    + ",";
+	result += "\"to\":"    + String(to_dt)      + ",";
+	result += "\"count\":" + String(acc->count) + ",";
+	result += "\"cols\":[";
+
+	bool first = true;
+	for (int i=0; i<m_num_cols; i++)
+	{
+		if (cols && !(cols & (1UL << i)))
+			continue;
+		if (!first)
+			result += ",";
+		first = false;
+
+		result += "{\"name\":\"";
+		result += m_col[i].name;
+		result += "\"";
+		if (!acc->count)
+			result += ",\"min\":null,\"max\":null,\"avg\":null";
+		else if (colIsFloat(m_col[i].type))
+		{
+			result += ",\"min\":" + String(acc->min[i].f,3);
+			result += ",\"max\":" + String(acc->max[i].f,3);
+			result += ",\"avg\":" + String(acc->sum[i].d / acc->count,3);
+		}
+		else
+		{
+			result += ",\"min\":" + String((long) acc->min[i].i);
+			result += ",\"max\":" + String((long) acc->max[i].i);
+			result += ",\"avg\":" + String((double) acc->sum[i].i / acc->count,3);
+		}
+		result += "}";
+	}
+
+	result += "]";
+	result += extra;
+	result += "}";
+	return result;
+}
+
+
+#if WITH_SD
+
+	void myIOTDataLog::accumFiles(logAccum_t *acc, uint32_t from_dt, uint32_t until, uint32_t cols, uint32_t *counts)
+		// Accumulates the records from_dt..until of all of the data files.
+		// A columnar datalog skips or summarizes most blocks from their
+		// headers, and returns the numbers of blocks skipped, summarized,
+		// and read in counts[3].  Otherwise all of the records are read,
+		// forwards, as for scanFile().
+	{
+		#define STATS_BASE_BUF	1024
+
+		if (m_c_recs)
 		{
-			int to_read = (int)min((uint32_t)buf_size, size - file_offset);
-			to_read = (to_read / m_rec_size) * m_rec_size;
-			if (to_read == 0) break;
+			if (!m_c_valid)
+				recoverColumnar();
+			accumColumnar(acc, from_dt, until, cols, counts);
+			return;
+		}
 
-			if (!file.seek(file_offset)) break;
-			int got = file.read(stack_buffer, to_read);
-			if (got <= 0) break;
+		int buf_size = m_z_block ? blockBufSize() :
+			((STATS_BASE_BUF + m_rec_size - 1) / m_rec_size) * m_rec_size;
+		uint8_t buf[buf_size];
+
+		int num_files = numDataFiles();
+		for (int file_num=0; file_num<num_files; file_num++)
+		{
+			String filename = dataFilename(file_num);
+			File file = SD.open(filename.c_str(), FILE_READ);
+			if (!file)
+				continue;
 
-			int recs_in_chunk = got / m_rec_size;
-			for (int r = 0; r < recs_in_chunk; r++, rec_idx++)
+			int num;
+			while (1)
 			{
-				uint32_t dt;
-				memcpy(&dt, stack_buffer + r * m_rec_size, 4);
+				if (m_z_block)
+					num = readBlock(file, buf);
+				else
+				{
+					int got = file.read(buf, buf_size);
+					num = got > 0 ? got / m_rec_size : -1;
+				}
+				if (num < 0)
+					break;
+
+				for (int r=0; r<num; r++)
+				{
+					const uint8_t *rec = buf + r * m_rec_size;
+					uint32_t dt;
+					memcpy(&dt, rec, 4);
+					if (dt && dt >= from_dt && dt <= until)
+						accumRecord(acc, rec);
+				}
+			}
+			file.close();
+		}
+	}
+
+
+	String myIOTDataLog::getColStats(uint32_t from_dt, uint32_t to_dt/*=0*/, uint32_t cols/*=0*/)
+	{
+		logJobLock lock(this);
+		flush();
+		uint32_t start_ms = millis();
+		cols = projectCols(cols);
+		uint32_t until = to_dt ? to_dt : 0xffffffff;
+
+		logAccum_t acc;
+		accumClear(&acc);
+		uint32_t counts[3] = {0,0,0};
+		accumFiles(&acc, from_dt, until, cols, counts);
+
+		String extra;
+		if (m_c_recs)
+		{
+			extra += ",\"blocks_skipped\":"    + String(counts[0]);
+			extra += ",\"blocks_summarized\":" + String(counts[1]);
+			extra += ",\"blocks_read\":"       + String(counts[2]);
+		}
+		extra += ",\"ms\":" + String(millis() - start_ms);
+		return colStatsJson(from_dt, to_dt, cols, &acc, extra);
+	}
+
+
+	//-----------------------------------------
+	// sendChartData()
+	//-----------------------------------------
+	// The cutoff and to_dt of the query are passed to the condition
+	// in a chartCondition_t on the stack of sendChartData(), so that
+	// queries of several datalogs do not share any state.  Its address
+	// is the client_data, as "this" is for other clients, since a
+	// pointer is 32 bits on the ESP32.
+
+	typedef struct {
+		uint32_t cutoff;
+		uint32_t to_dt;				// the end of the window, 0 = none
+	} chartCondition_t;
+
+	SDIterState_t chartDataCondition(uint32_t client_data, uint8_t *rec)
+	{
+		const chartCondition_t *cond = (const chartCondition_t *) (uintptr_t) client_data;
+		uint32_t cutoff = cond->cutoff;
+		uint32_t ts = *((uint32_t *) rec);
+		if (ts == 0)
+			return ITER_SKIP;		// tombstoned record
+		if (cond->to_dt && ts > cond->to_dt)
+			return ITER_SKIP;		// after the window
+		if (ts >= cutoff)
+			return ITER_INCLUDE;
+
+		#if DEBUG_SEND_DATA>2
+		{
+			String dt1 = timeToString(ts);
+			String dt2 = timeToString(cutoff);
+			LOGD("    chartDataCondition(STOP) at %s < %s",dt1.c_str(),dt2.c_str());
+		}
+		#endif
+		return ITER_STOP;
+	}
+
+
+	String myIOTDataLog::sendChartData(uint32_t secs_or_dt, bool since/*=false*/, int points/*=0*/, uint32_t period/*=0*/, uint32_t to_dt/*=0*/, uint32_t cols/*=0*/)
+	{
+		#define BASE_BUF_SIZE	1024
+
+		logJobLock lock(this);
+		String filename = dataFilename();
+		cols = projectCols(cols);
+		uint32_t now = time(NULL);
+		uint32_t cutoff = secs_or_dt ?
+			since ? secs_or_dt : now - secs_or_dt : 0;
+		uint32_t until = to_dt ? to_dt : now;
+
+		#if DEBUG_SEND_DATA
+			uint32_t start_ms = millis();
+		#endif
+
+		// determine the bucket size if decimating, where a "forever"
+		// query uses the dt of the first record in the datalog.
+
+		uint32_t bucket_secs = 0;
+		if (points > 0)
+		{
+			uint32_t span = period ? period : cutoff ? until - cutoff : 0;
+			if (!span && numDataFiles())
+			{
+				// a columnar datalog may only have open records
+
+				uint32_t first_dt = 0;
+				String first_name = dataFilename(0);
+				for (int pass=0; !first_dt && pass<(m_c_recs?2:1); pass++)
+				{
+					if (pass)
+						first_name = colOpenFilename();
+					File file = SD.open(first_name.c_str(), FILE_READ);
+					if (!file)
+						continue;
+					if (!pass && (m_z_block || m_c_recs))
+						first_dt = blockFirstDt(file, 0);
+					else if (file.read((uint8_t *)&first_dt,4) != 4)
+						first_dt = 0;
+					file.close();
+				}
+				if (first_dt && first_dt < until)
+					span = until - first_dt;
+			}
+			bucket_secs = (span + points - 1) / points;
+			if (bucket_secs < 2)
+				bucket_secs = 0;	// no point in decimating
+		}
+
+		// use the coarsest rollup, if any, whose buckets fit in the
+		// requested ones instead of the raw records, rounding the bucket
+		// size up to a whole number of rollup buckets (fewer points),
+		// unless a job may be rebuilding them.
+
+		int level = bucket_secs && !m_job_busy ? pickRollup(bucket_secs) : -1;
+		if (level >= 0 && !recoverRollups(level))
+			level = -1;
+		if (level >= 0)
+		{
+			uint32_t secs = m_rollup[level].secs;
+			bucket_secs = ((bucket_secs + secs - 1) / secs) * secs;
+		}
+
+		bool blocks = level < 0 && (m_z_block || m_c_recs);
+		int rec_size = m_rec_size;
+		uint32_t iter_cutoff = cutoff;
+		uint32_t floor_rec = 0;
+		if (level >= 0)
+		{
+			// include the rollup bucket that contains the cutoff
+
+			filename = rollupFilename(level);
+			rec_size = getRollupRecSize();
+			uint32_t secs = m_rollup[level].secs;
+			iter_cutoff = cutoff > secs ? cutoff - secs + 1 : 0;
+		}
+		else if (cutoff)
+		{
+			// the time index, if any, gives a floor below which
+			// all records are known to be before the cutoff
+
+			floor_rec = indexFloor(cutoff);
+		}
+
+		// a segmented datalog is iterated from its newest segment backwards,
+		// or the newest one that starts at or before to_dt, unless a clock
+		// spike started a later one that the records after it went to
+
+		int file_num = level >= 0 ? 0 : numDataFiles() - 1;
+		if (level < 0 && m_seg_type && to_dt && file_num >= 0)
+		{
+			int last_file = file_num;
+			file_num = findSegment(to_dt + 1) - 1;
+			if (file_num < 0)
+				file_num = 0;	// all after to_dt, so its ceil_rec is 0
+			if (file_num < last_file &&
+				findCeiling(dataFilename(file_num + 1).c_str(), rec_size, to_dt, false))
+				file_num = last_file;
+		}
+		if (level < 0 && m_seg_type && file_num >= 0)
+			filename = dataFilename(file_num);
+
+		// the open records of a columnar datalog are newer than its
+		// blocks, so are iterated first, as whole records
+
+		bool col_rows = false;
+		if (blocks && m_c_recs)
+		{
+			if (!m_c_valid)
+				recoverColumnar();
+			String open_name = colOpenFilename();
+			col_rows = SD.exists(open_name.c_str());
+			if (col_rows)
+				filename = open_name;
+		}
+
+		// and starts at the first record after to_dt, found by binary search
+		// (in a compressed datalog, the first block that starts after it)
+
+		uint32_t ceil_rec = 0;
+		if (to_dt && col_rows)
+			ceil_rec = findCeiling(filename.c_str(), rec_size, to_dt, false);
+		else if (to_dt && blocks)
+			ceil_rec = findBlock(to_dt);
+		else if (to_dt && file_num >= 0)
+			ceil_rec = findCeiling(filename.c_str(), rec_size, to_dt, level < 0 && !m_seg_type);
+
+		// pick bufsize > 512 that will hold even number of records,
+		// or as many as fit in the buffer from setChartBuffer(),
+		// which blocks only use if it can hold one, and the open records
+		// of a columnar datalog need whole records of.
+
+		int min_size = blocks ? blockBufSize() : rec_size;
+		if (m_c_recs && blocks)
+			min_size = ((min_size + rec_size - 1) / rec_size) * rec_size;
+		uint8_t *buffer = m_chart_buf_size >= min_size ? m_chart_buf : NULL;
+		uint8_t *ahead_buf = buffer ? m_chart_ahead_buf : NULL;
+		int buf_size =
+			m_c_recs && blocks ? (buffer ? (m_chart_buf_size / rec_size) * rec_size : min_size) :
+			blocks ? (buffer ? m_chart_buf_size : min_size) :
+			buffer ? (m_chart_buf_size / rec_size) * rec_size :
+			((BASE_BUF_SIZE + rec_size-1) / rec_size) * rec_size;
+		uint8_t stack_buffer[buffer ? 1 : buf_size];
+		if (!buffer)
+			buffer = stack_buffer;
+
+		#if DEBUG_SEND_DATA
+		{
+			String dbg_tm = timeToString(cutoff);
+			LOGI("sendChartData rec_size(%d) secs/dt(%d) since_bool(%d) since(%s) points(%d) cols(0x%x) from %s",
+				 rec_size,
+				 secs_or_dt,
+				 since,
+				 secs_or_dt?dbg_tm.c_str():"forever",
+				 points,
+				 cols,
+				 filename.c_str());
+			LOGD("    buf_size(%d) cutoff=(%d) to(%d) ceil_rec(%d)",buf_size,cutoff,to_dt,ceil_rec);
+		}
+		#endif
+
+		// initialize iterator struct
+
+		chartCondition_t iter_cond = { iter_cutoff, to_dt };
+		chartCondition_t buf_cond = { cutoff, to_dt };
+
+		SDBackwards_t iter;
+		iter.chunked        = 1;
+		iter.client_data    = (uint32_t) (uintptr_t) &iter_cond;
+		iter.filename       = filename.c_str();
+		iter.rec_size       = rec_size;
+		iter.record_fxn     = chartDataCondition;
+		iter.buffer         = buffer;                 		// an even multiple of rec_size
+		iter.buf_size       = buf_size;
+
+		if (blocks && !col_rows ?
+				!startSDBlocksBackwards(&iter, blockBytes(), decodeBlockCB, this, ahead_buf,
+					to_dt ? ceil_rec * blockBytes() : -1) :
+				!startSDBackwards(&iter, floor_rec * rec_size, ahead_buf,
+					to_dt ? ceil_rec * rec_size : -1))
+			return "";
+
+		// out_buf also holds projected write-behind records
+
+		int out_size = bucket_secs || cols ?
+			max(1, BASE_BUF_SIZE / (3 * m_rec_size)) * 3 * m_rec_size : 0;
+		uint8_t out_buf[out_size + 1];
+		chartDecimator decimator(this, bucket_secs, out_buf, out_size, cols);
+
+		if (!myiot_web_server->startBinaryResponse("application/octet-stream", CONTENT_LENGTH_UNKNOWN))
+		{
+			endSDBackwards(&iter);
+			return "";
+		}
+
+		// records in the write-behind buffer are newer than any in the file
+
+		int last_buffered = m_wb_count;
+		while (to_dt && last_buffered > 0 &&
+			   chartDataCondition((uint32_t) (uintptr_t) &buf_cond, &m_wb_buf[(last_buffered-1) * m_rec_size]) == ITER_SKIP)
+			last_buffered--;
+		int first_buffered = last_buffered;
+		while (first_buffered > 0 &&
+			   chartDataCondition((uint32_t) (uintptr_t) &buf_cond, &m_wb_buf[(first_buffered-1) * m_rec_size]) == ITER_INCLUDE)
+			first_buffered--;
+		int num_buffered = last_buffered - first_buffered;
+		if (first_buffered)
+		{
+			iter.done = true;	// the cutoff is in the buffer
+			iter.stopped = true;
+			endSDBackwards(&iter);
+		}
+
+		if (num_buffered)
+		{
+			bool ok = true;
+			if (bucket_secs)
+			{
+				for (int i=last_buffered-1; ok && i>=first_buffered; i--)
+					ok = decimator.add(&m_wb_buf[i*m_rec_size]);
+			}
+			else if (cols)
+				ok = sendProjected(&m_wb_buf[first_buffered*m_rec_size], num_buffered, cols, out_buf, out_size);
+			else
+				ok = myiot_web_server->writeBinaryData((const char*)&m_wb_buf[first_buffered*m_rec_size], num_buffered * m_rec_size);
+
+			if (!ok)
+			{
+				endSDBackwards(&iter);
+				return "";
+			}
+		}
 
-				if (dt == 0) { tombstones++; continue; }
-				if (!first_dt) first_dt = dt;
-				last_dt = dt;
+		// the open buckets of the level and those below it, newest
+		// first, hold the records since the end of the rollup file
 
-				if (prev_dt && dt < prev_dt)
+		for (int l=0; l<=level && !first_buffered; l++)
+		{
+			logRollup_t *rollup = &m_rollup[l];
+			if (rollup->acc.count &&
+				rollup->bucket_dt >= iter_cutoff &&
+				(!to_dt || rollup->bucket_dt <= to_dt) &&
+				!decimator.addAccum(rollup->bucket_dt, &rollup->acc))
+			{
+				endSDBackwards(&iter);
+				return "";
+			}
+		}
+
+		int sent = num_buffered;
+		int num_file_recs = iter.file ? iter.file.size() / rec_size : 0;
+
+		while (1)
+		{
+			int num_recs;
+			uint8_t *rec_buf = getSDBackwards(&iter,&num_recs);
+			if (!num_recs)
+			{
+				if (!iter.done)
+					continue;		// a buffer of tombstones
+				if (iter.error)
+				{
+					LOGE("sendChartData(%s) failed after %d records",m_name,sent);
+					return "";
+				}
+				if (iter.stopped)
+					break;
+
+				// continue from the open records into the blocks
+
+				if (col_rows)
+				{
+					col_rows = false;
+					filename = dataFilename();
+					iter.filename = filename.c_str();
+					if (!startSDBlocksBackwards(&iter, blockBytes(), decodeBlockCB, this, iter.ahead_buf,
+							to_dt ? findBlock(to_dt) * blockBytes() : -1))
+						return "";
+					num_file_recs += iter.file ? iter.file.size() / rec_size : 0;
+					continue;
+				}
+				if (file_num <= 0)
+					break;
+
+				// continue into the previous segment
+
+				filename = dataFilename(--file_num);
+				iter.filename = filename.c_str();
+				if (!startSDBackwards(&iter, 0, iter.ahead_buf))
+					return "";
+				num_file_recs += iter.file ? iter.file.size() / rec_size : 0;
+				continue;
+			}
+
+			sent += num_recs;
+
+			#if DEBUG_SEND_DATA > 1
+				if (level < 0)
 				{
-					// Drop-back: walk backward (individual seeks) to find spike extent.
-					uint32_t resume_dt       = dt;
-					uint32_t spike_end_idx   = rec_idx - 1;
-					uint32_t spike_start_idx = rec_idx - 1;
-					uint32_t spike_first_dt  = prev_dt;
-					uint32_t spike_last_dt   = prev_dt;
-					uint32_t before_spike_dt = 0;
-
-					int32_t j    = (int32_t)rec_idx - 1;
-					int     look = 0;
-					while (j >= 0 && look < MAX_SPIKE_LOOK)
+					for (int i=0; i<num_recs; i++)
 					{
-						file.seek((uint32_t)j * m_rec_size);
-						uint32_t jdt;
-						if (file.read((uint8_t *)&jdt, 4) != 4) break;
-						if (jdt == 0) { j--; look++; continue; }
-						if (jdt <= resume_dt)
-						{
-							before_spike_dt = jdt;
-							spike_start_idx = (uint32_t)(j + 1);
-							break;
-						}
-						spike_first_dt  = jdt;
-						spike_start_idx = (uint32_t)j;
-						j--;
-						look++;
+						dbg_rec(&rec_buf[i*m_rec_size]);
 					}
-
-					uint32_t spike_count = spike_end_idx - spike_start_idx + 1;
-					if (!first_spike) spikes_json += ",";
-					spikes_json += "{";
-					spikes_json += "\"start_idx\":"  + String(spike_start_idx) + ",";
-					spikes_json += "\"end_idx\":"    + String(spike_end_idx)   + ",";
-					spikes_json += "\"count\":"      + String(spike_count)     + ",";
-					spikes_json += "\"first_dt\":"   + String(spike_first_dt)  + ",";
-					spikes_json += "\"last_dt\":"    + String(spike_last_dt)   + ",";
-					spikes_json += "\"prev_dt\":"    + String(before_spike_dt) + ",";
-					spikes_json += "\"next_dt\":"    + String(resume_dt);
-					spikes_json += "}";
-					first_spike = false;
 				}
+			#endif
+
+			bool ok = true;
+			if (level >= 0)
+			{
+				for (int i=num_recs-1; ok && i>=0; i--)
+					ok = decimator.addRollup(&rec_buf[i*rec_size]);
+			}
+			else if (bucket_secs)
+			{
+				// chunks are in file order, but go backwards through the file
 
-				prev_dt = dt;
+				for (int i=num_recs-1; ok && i>=0; i--)
+					ok = decimator.add(&rec_buf[i*m_rec_size]);
 			}
+			else if (cols)
+			{
+				// the iterator is done with the records, so they are packed in place
 
-			file_offset += got;
+				int bytes = projectRecords(rec_buf, rec_buf, num_recs, cols);
+				ok = myiot_web_server->writeBinaryData((const char*)rec_buf, bytes);
+			}
+			else
+				ok = myiot_web_server->writeBinaryData((const char*)rec_buf, num_recs * m_rec_size);
+
+			if (!ok)
+			{
+				endSDBackwards(&iter);
+				return "";
+			}
 		}
 
-		file.close();
-		spikes_json += "]";
+		if (bucket_secs && !decimator.finish())
+			return "";
 
-		String result = "{";
-		result += "\"num_recs\":"      + String(num_recs)   + ",";
-		result += "\"first_dt\":"      + String(first_dt)   + ",";
-		result += "\"last_dt\":"       + String(last_dt)    + ",";
-		result += "\"tombstones\":"    + String(tombstones) + ",";
-		result += "\"spikes\":"        + spikes_json        + ",";
-		result += "\"needs_compact\":" + String(tombstones > 0 ? "true" : "false");
-		result += "}";
-		return result;
+		#if DEBUG_SEND_DATA
+		{
+			// throughput of the records read, to compare buffer sizes and read-ahead
+
+			uint32_t ms = millis() - start_ms;
+			uint32_t kb_per_sec = ms ? (uint32_t)(((uint64_t) sent * rec_size) / ms) : 0;
+			LOGD("    sendChartData() sent %d/%d %s records as %d buckets of %d secs from floor(%d) in %d ms (%d KB/s buf(%d) read_ahead(%d))",
+				sent,num_file_recs,level<0?"raw":level?"daily":"hourly",
+				decimator.numBuckets(),bucket_secs,floor_rec,ms,
+				kb_per_sec,buf_size,m_chart_ahead_buf != NULL);
+		}
+		#endif
+
+		return RESPONSE_HANDLED;
 	}
 
 
@@ -757,11 +2191,13 @@ String myIOTDataLog::getChartHeader(int period, int with_degrees, const String *
 
 	bool myIOTDataLog::tombstoneByDt(uint32_t dt)
 	{
-		String filename = dataFilename();
-		File file = SD.open(filename.c_str(), "r+");
-		if (!file)
+		if (jobRefused("tombstoneByDt"))
+			return false;
+		logJobLock lock(this);
+		flush();
+		if (m_z_block || m_c_recs)
 		{
-			LOGE("tombstoneByDt() could not open %s", filename.c_str());
+			LOGE("myIOTDataLog(%s) %s records can not be tombstoned",m_name,m_z_block?"compressed":"columnar");
 			return false;
 		}
 
@@ -771,72 +2207,270 @@ String myIOTDataLog::getChartHeader(int period, int with_degrees, const String *
 		int     buf_size = ((TOMB_BASE_BUF + m_rec_size - 1) / m_rec_size) * m_rec_size;
 		uint8_t stack_buffer[buf_size];
 
-		uint32_t size       = file.size();
-		uint32_t file_offset = 0;
-		uint32_t rec_idx    = 0;
 		bool     found      = false;
 		const uint32_t zero = 0;
+		uint32_t first_idx  = 0;		// range of tombstoned records for the checksums
+		uint32_t last_idx   = 0;
 
-		while (file_offset < size)
+		int num_files = numDataFiles();
+		for (int file_num = 0; file_num < num_files; file_num++)
 		{
-			int to_read = (int)min((uint32_t)buf_size, size - file_offset);
-			to_read = (to_read / m_rec_size) * m_rec_size;
-			if (to_read == 0) break;
+			String filename = dataFilename(file_num);
+			File file = SD.open(filename.c_str(), "r+");
+			if (!file)
+			{
+				LOGE("tombstoneByDt() could not open %s", filename.c_str());
+				return false;
+			}
 
-			if (!file.seek(file_offset)) break;
-			int got = file.read(stack_buffer, to_read);
-			if (got <= 0) break;
+			uint32_t size        = file.size();
+			uint32_t file_offset = 0;
 
-			int recs_in_chunk = got / m_rec_size;
-			for (int r = 0; r < recs_in_chunk; r++, rec_idx++)
+			while (file_offset < size)
 			{
-				uint32_t rec_dt;
-				memcpy(&rec_dt, stack_buffer + r * m_rec_size, 4);
-				if (rec_dt == dt)
+				int to_read = (int)min((uint32_t)buf_size, size - file_offset);
+				to_read = (to_read / m_rec_size) * m_rec_size;
+				if (to_read == 0) break;
+
+				if (!file.seek(file_offset)) break;
+				int got = file.read(stack_buffer, to_read);
+				if (got <= 0) break;
+
+				int recs_in_chunk = got / m_rec_size;
+				for (int r = 0; r < recs_in_chunk; r++)
 				{
-					uint32_t write_pos = file_offset + r * m_rec_size;
-					file.seek(write_pos);
-					file.write((uint8_t *)&zero, 4);
-					found = true;
+					uint32_t rec_dt;
+					memcpy(&rec_dt, stack_buffer + r * m_rec_size, 4);
+					if (rec_dt == dt)
+					{
+						uint32_t write_pos = file_offset + r * m_rec_size;
+						file.seek(write_pos);
+						file.write((uint8_t *)&zero, 4);
+						if (!found)
+							first_idx = write_pos / m_rec_size;
+						last_idx = write_pos / m_rec_size;
+						found = true;
+					}
 				}
+
+				file_offset += got;
+				jobYield("tombstone", file_offset, size);
 			}
 
-			file_offset += got;
+			file.close();
 		}
 
-		file.close();
+		if (found)
+			invalidateScan();
+		if (found)
+			invalidateStats();
+		if (found && m_crc_every)
+			updateChecksums(first_idx, last_idx);
+		if (found && m_rollup)
+			rebuildRollups();
 		LOGI("tombstoneByDt(%u) found=%d", dt, found);
 		return found;
 	}
 
 
 	//-----------------------------------------
-	// tombstoneByIndex()
+	// tombstoneByIndex() / Range() / Indices()
 	//-----------------------------------------
+	// Indexes are into the concatenation of the segments, if any.
+	// Each data file is opened once and the records are tombstoned a
+	// buffer at a time: the span from the first to the last record in
+	// the buffer is read, their dt's are zeroed, and it is written back
+	// with a single write, so each touched sector is only written once.
+
+	static bool tombstoneWindow(File &file, int rec_size, uint32_t first, uint32_t last,
+		const uint32_t *indices, int num_indices, uint32_t base, uint8_t *buf)
+		// Zero the dt of the records in indices[] (which are offset by base),
+		// or of all of records first..last if indices is NULL.
+	{
+		int len = (last - first + 1) * rec_size;
+		if (!file.seek(first * rec_size) ||
+			file.read(buf, len) != len)
+			return false;
+
+		if (indices)
+		{
+			for (int i = 0; i < num_indices; i++)
+				memset(buf + (indices[i] - base - first) * rec_size, 0, 4);
+		}
+		else
+		{
+			for (uint32_t r = 0; r <= last - first; r++)
+				memset(buf + r * rec_size, 0, 4);
+		}
+
+		return file.seek(first * rec_size) &&
+			   file.write(buf, len) == len;
+	}
+
+
+	static int compareIndex(const void *a, const void *b)
+	{
+		uint32_t ia = *((const uint32_t *) a);
+		uint32_t ib = *((const uint32_t *) b);
+		return ia < ib ? -1 : ia > ib ? 1 : 0;
+	}
+
 
 	bool myIOTDataLog::tombstoneByIndex(uint32_t idx)
 	{
-		String filename = dataFilename();
-		File file = SD.open(filename.c_str(), "r+");
-		if (!file)
+		return tombstoneRange(idx, idx);
+	}
+
+
+	bool myIOTDataLog::tombstoneRange(uint32_t start_idx, uint32_t end_idx)
+	{
+		if (end_idx < start_idx)
+			return false;
+		return tombstoneRuns(NULL, 0, start_idx, end_idx);
+	}
+
+
+	bool myIOTDataLog::tombstoneIndices(uint32_t *indices, int num_indices)
+	{
+		if (num_indices <= 0)
+			return false;
+		for (int i = 1; i < num_indices; i++)
 		{
-			LOGE("tombstoneByIndex() could not open %s", filename.c_str());
+			if (indices[i] < indices[i-1])
+			{
+				qsort(indices, num_indices, sizeof(uint32_t), compareIndex);
+				break;
+			}
+		}
+
+		// and duplicates are removed
+
+		int num = 1;
+		for (int i = 1; i < num_indices; i++)
+		{
+			if (indices[i] != indices[num-1])
+				indices[num++] = indices[i];
+		}
+		return tombstoneRuns(indices, num, indices[0], indices[num-1]);
+	}
+
+
+	bool myIOTDataLog::tombstoneRuns(const uint32_t *indices, int num_indices, uint32_t start_idx, uint32_t end_idx)
+		// Tombstone the sorted indices, or start_idx..end_idx if indices is NULL
+	{
+		if (jobRefused("tombstoneRuns"))
+			return false;
+		logJobLock lock(this);
+		flush();
+		if (m_z_block || m_c_recs)
+		{
+			LOGE("myIOTDataLog(%s) %s records can not be tombstoned",m_name,m_z_block?"compressed":"columnar");
 			return false;
 		}
 
-		uint32_t num_recs = file.size() / m_rec_size;
-		if (idx >= num_recs)
+		// everything is checked before any file is opened for writing,
+		// so that a bad index does not leave the records partly tombstoned
+
+		uint32_t num_recs = 0;
+		int num_files = numDataFiles();
+		for (int file_num = 0; file_num < num_files; file_num++)
 		{
-			LOGE("tombstoneByIndex(%u) out of range (%u recs)", idx, num_recs);
+			String filename = dataFilename(file_num);
+			File file = SD.open(filename.c_str(), FILE_READ);
+			if (!file)
+			{
+				LOGE("tombstoneRuns() could not open %s", filename.c_str());
+				return false;
+			}
+			num_recs += file.size() / m_rec_size;
 			file.close();
+		}
+		if (end_idx < start_idx || end_idx >= num_recs)
+		{
+			LOGE("tombstoneRuns(%u..%u) out of range (%u recs)", start_idx, end_idx, num_recs);
 			return false;
 		}
+		for (int i = 1; indices && i < num_indices; i++)
+		{
+			if (indices[i] <= indices[i-1])
+			{
+				LOGE("tombstoneRuns() indices not sorted and unique at %d", i);
+				return false;
+			}
+		}
 
-		const uint32_t zero = 0;
-		bool ok = file.seek(idx * m_rec_size) &&
-				  (file.write((uint8_t *)&zero, 4) == 4);
-		file.close();
-		LOGI("tombstoneByIndex(%u) ok=%d", idx, ok);
+		#define TOMB_WIN_BUF  1024
+		int win_recs = TOMB_WIN_BUF / m_rec_size;
+		if (win_recs < 1)
+			win_recs = 1;
+		uint8_t buf[win_recs * m_rec_size];
+
+		bool ok = true;
+		int next = 0;			// next entry in indices
+		int count = 0;			// records tombstoned
+		int total = indices ? num_indices : end_idx - start_idx + 1;
+		int writes = 0;
+		uint32_t base = 0;		// index of the first record in the file
+
+		for (int file_num = 0; ok && file_num < num_files && base <= end_idx; file_num++)
+		{
+			String filename = dataFilename(file_num);
+			File file = SD.open(filename.c_str(), "r+");
+			if (!file)
+			{
+				LOGE("tombstoneRuns() could not open %s", filename.c_str());
+				return false;
+			}
+
+			uint32_t top = base + file.size() / m_rec_size;		// exclusive
+
+			if (indices)
+			{
+				while (ok && next < num_indices && indices[next] < top)
+				{
+					int k = next + 1;
+					uint32_t first = indices[next] - base;
+					while (k < num_indices &&
+						   indices[k] < top &&
+						   indices[k] - base < first + win_recs)
+						k++;
+
+					uint32_t last = indices[k-1] - base;
+					ok = tombstoneWindow(file, m_rec_size, first, last, &indices[next], k - next, base, buf);
+					count += k - next;
+					writes++;
+					next = k;
+					jobYield("tombstone", count, total);
+				}
+			}
+			else if (start_idx < top)
+			{
+				uint32_t first = start_idx > base ? start_idx - base : 0;
+				uint32_t end = (end_idx < top ? end_idx + 1 : top) - base;	// exclusive
+				while (ok && first < end)
+				{
+					uint32_t last = first + win_recs < end ? first + win_recs - 1 : end - 1;
+					ok = tombstoneWindow(file, m_rec_size, first, last, NULL, 0, 0, buf);
+					count += last - first + 1;
+					writes++;
+					first = last + 1;
+					jobYield("tombstone", count, total);
+				}
+			}
+
+			file.close();
+			base = top;
+		}
+
+		if (count)
+			invalidateScan();
+		if (count)
+			invalidateStats();
+		if (count && m_crc_every)
+			updateChecksums(start_idx, end_idx);
+		if (count && m_rollup)
+			rebuildRollups();
+		LOGI("tombstoneRuns(%u..%u) %d records in %d writes ok=%d", start_idx, end_idx, count, writes, ok);
 		return ok;
 	}
 
@@ -845,15 +2479,47 @@ String myIOTDataLog::getChartHeader(int period, int with_degrees, const String *
 	// compactFile() / trimBefore()
 	//-----------------------------------------
 
-	static bool rewriteFile(myIOTDataLog *log, uint32_t cutoff_dt)
-		// Rewrite the datalog keeping records where dt!=0 && dt>=cutoff_dt.
+	static bool needsRewrite(const String &filename, int rec_size, uint32_t cutoff_dt)
+		// returns true if rewriteFile() would drop any records from the file
+	{
+		File file = SD.open(filename.c_str(), FILE_READ);
+		if (!file)
+			return false;
+
+		#define NR_BASE_BUF 1024
+		int buf_size = ((NR_BASE_BUF + rec_size - 1) / rec_size) * rec_size;
+		uint8_t read_buf[buf_size];
+
+		bool found = false;
+		int got;
+		while (!found && (got = file.read(read_buf, buf_size)) > 0)
+		{
+			int recs = (got / rec_size) * rec_size;
+			for (int off = 0; off < recs; off += rec_size)
+			{
+				uint32_t dt;
+				memcpy(&dt, read_buf + off, 4);
+				if (dt == 0 || (cutoff_dt != 0 && dt < cutoff_dt))
+				{
+					found = true;
+					break;
+				}
+			}
+		}
+
+		file.close();
+		return found;
+	}
+
+
+	static bool rewriteFile(myIOTDataLog *log, const String &filename, uint32_t cutoff_dt)
+		// Rewrite a datalog file keeping records where dt!=0 && dt>=cutoff_dt.
 		// cutoff_dt==0 means compact only (keep all non-tombstone records).
 		//
 		// Uses two chunked buffers: read a chunk from src, filter into a write
 		// buffer, flush the write buffer when full or at end.  ~1075 SD reads
 		// and proportionally fewer writes instead of one seek per record.
 	{
-		String filename = log->dataFilename();
 		String tmpname = "/" + String(log->getName()) + ".tmp";
 
 		File src = SD.open(filename.c_str(), FILE_READ);
@@ -904,6 +2570,7 @@ String myIOTDataLog::getChartHeader(int period, int with_degrees, const String *
 					write_fill = 0;
 				}
 			}
+			log->jobYield("rewrite", src.position(), src.size());
 		}
 
 		if (write_fill > 0)
@@ -919,21 +2586,383 @@ String myIOTDataLog::getChartHeader(int period, int with_degrees, const String *
 			return false;
 		}
 
-		LOGI("rewriteFile(%s cutoff=%u) wrote %d records", log->getName(), cutoff_dt, written);
+		LOGI("rewriteFile(%s cutoff=%u) wrote %d records", filename.c_str(), cutoff_dt, written);
 		return true;
 	}
 
 
 	bool myIOTDataLog::compactFile()
 	{
-		return rewriteFile(this, 0);
+		if (jobRefused("compactFile"))
+			return false;
+		logJobLock lock(this);
+		flush();
+
+		bool ok = true;
+		if (m_seg_type)
+		{
+			// only the segments that have tombstones are rewritten
+
+			int num_files = numDataFiles();
+			for (int file_num = 0; file_num < num_files; file_num++)
+			{
+				String filename = dataFilename(file_num);
+				if (needsRewrite(filename, m_rec_size, 0) &&
+					!rewriteFile(this, filename, 0))
+					ok = false;
+			}
+		}
+		else if (m_z_block)
+			ok = rewriteCompressed(0);
+		else if (m_c_recs)
+			ok = rewriteColumnar(0);
+		else
+			ok = rewriteFile(this, dataFilename(), 0);
+
+		invalidateScan();
+		invalidateIndex();
+		invalidateChecksums();
+		if (m_rollup)
+			rebuildRollups();
+		return ok;
 	}
 
 	bool myIOTDataLog::trimBefore(uint32_t cutoff_dt)
 	{
-		return rewriteFile(this, cutoff_dt);
+		if (jobRefused("trimBefore"))
+			return false;
+		logJobLock lock(this);
+		flush();
+		invalidateScan();
+		invalidateStats();
+
+		if (m_seg_type)
+		{
+			// Delete the segments that end before the cutoff and rewrite
+			// the first remaining one if it has records before it.
+
+			int num_old = 0;
+			int num_files = numDataFiles();
+			while (num_old < num_files - 1 &&
+				   segmentKey(num_old + 1) <= cutoff_dt)
+				num_old++;
+
+			bool ok = removeSegments(num_old);
+			if (ok && numDataFiles())
+			{
+				String filename = dataFilename(0);
+				if (needsRewrite(filename, m_rec_size, cutoff_dt))
+					ok = rewriteFile(this, filename, cutoff_dt);
+			}
+			if (m_rollup)
+				rebuildRollups();
+			return ok;
+		}
+
+		bool ok = m_z_block ? rewriteCompressed(cutoff_dt) :
+			m_c_recs ? rewriteColumnar(cutoff_dt) :
+			rewriteFile(this, dataFilename(), cutoff_dt);
+		invalidateIndex();
+		invalidateChecksums();
+		if (m_rollup)
+			rebuildRollups();
+		return ok;
 	}
 
 
 #endif	// WITH_SD
 
+
+
+
+//================================================
+// RAM ring buffer (WITH_SD=0)
+//================================================
+// Without an SD card the datalog is a fixed number of records
+// in a ring buffer allocated once by setRamBuffer(), in PSRAM
+// if requested and available. When it is full the oldest record
+// is overwritten.  The records are lost on a reboot.
+
+#if !WITH_SD
+
+	bool myIOTDataLog::setRamBuffer(int num_recs, bool use_psram /*=false*/)
+	{
+		if (m_ram_buf)
+		{
+			LOGE("myIOTDataLog(%s) setRamBuffer() called twice",m_name);
+			return false;
+		}
+		if (num_recs <= 0)
+			return false;
+
+		int bytes = num_recs * m_rec_size;
+		if (use_psram)
+			m_ram_buf = (uint8_t *) ps_malloc(bytes);
+		if (!m_ram_buf)
+			m_ram_buf = (uint8_t *) malloc(bytes);
+		if (!m_ram_buf)
+		{
+			LOGE("myIOTDataLog(%s) could not allocate %d bytes",m_name,bytes);
+			return false;
+		}
+
+		m_ram_max = num_recs;
+		LOGI("myIOTDataLog(%s) ram buffer of %d records (%d bytes)",m_name,num_recs,bytes);
+		return true;
+	}
+
+
+	uint8_t *myIOTDataLog::ramRecord(uint32_t n) const
+		// returns the nth record, where 0 is the oldest
+	{
+		uint32_t first = m_ram_head + m_ram_max - m_ram_count;
+		return &m_ram_buf[((first + n) % m_ram_max) * m_rec_size];
+	}
+
+
+	bool myIOTDataLog::addRecord(const logRecord_t rec, uint32_t dt/*=0*/)
+	{
+		uint32_t tm = dt ? dt : time(NULL);
+		if (tm < ILLEGAL_DT)
+		{
+			String stime = timeToString(tm);
+			LOGE("attempt to call myIOTDataLog::addRecord(%d) at bad time(%s)",tm,stime.c_str());
+			return false;
+		}
+		*((uint32_t *)rec) = tm;
+
+		if (!m_ram_buf)
+		{
+			LOGE("myIOTDataLog(%s) addRecord() without setRamBuffer()",m_name);
+			return false;
+		}
+
+		#if DEBUG_ADD
+			dbg_rec(rec);
+		#endif
+
+		#if WITH_WS
+			my_iot_device->wsDataLogRecord(this, rec);
+		#endif
+
+		memcpy(&m_ram_buf[m_ram_head * m_rec_size], rec, m_rec_size);
+		m_ram_head = (m_ram_head + 1) % m_ram_max;
+		if (m_ram_count < m_ram_max)
+			m_ram_count++;
+		else
+			m_ram_overwritten++;
+		return true;
+	}
+
+
+	String myIOTDataLog::sendChartData(uint32_t secs_or_dt, bool since/*=false*/, int points/*=0*/, uint32_t period/*=0*/, uint32_t to_dt/*=0*/, uint32_t cols/*=0*/)
+		// Same window, decimation, and projection as the SD version,
+		// and decimated buckets are built newest first like it, but raw
+		// records are sent in time order, oldest first, with at most two
+		// writes (the ring may wrap), rather than a buffer at a time from
+		// the end.
+	{
+		#define BASE_BUF_SIZE	1024
+
+		cols = projectCols(cols);
+
+		uint32_t now = time(NULL);
+		uint32_t cutoff = secs_or_dt ?
+			since ? secs_or_dt : now - secs_or_dt : 0;
+		uint32_t until = to_dt ? to_dt : now;
+
+		uint32_t bucket_secs = 0;
+		if (points > 0)
+		{
+			uint32_t span = period ? period : cutoff ? until - cutoff : 0;
+			if (!span && m_ram_count)
+			{
+				uint32_t first_dt;
+				memcpy(&first_dt,ramRecord(0),4);
+				if (first_dt && first_dt < until)
+					span = until - first_dt;
+			}
+			bucket_secs = (span + points - 1) / points;
+			if (bucket_secs < 2)
+				bucket_secs = 0;
+		}
+
+		// binary search for the first record after to_dt, or all of them
+		// if a clock spike sent the search left of records that are at or
+		// before it.  Like the SD chart condition, the records after to_dt
+		// that are before the end (clock spikes) are skipped.
+
+		uint32_t end = m_ram_count;
+		if (to_dt)
+		{
+			uint32_t lo = 0;
+			while (lo < end)
+			{
+				uint32_t mid = (lo + end) / 2;
+				uint32_t dt;
+				memcpy(&dt,ramRecord(mid),4);
+				if (dt > to_dt)
+					end = mid;
+				else
+					lo = mid + 1;
+			}
+			for (uint32_t i = end; i < m_ram_count; i++)
+			{
+				uint32_t dt;
+				memcpy(&dt,ramRecord(i),4);
+				if (dt && dt <= to_dt)
+				{
+					end = m_ram_count;
+					break;
+				}
+			}
+		}
+
+		// the newest record with a dt before the cutoff stops
+		// the query, just like the backwards SD iteration
+
+		uint32_t first = end;
+		while (first > 0)
+		{
+			uint32_t dt;
+			memcpy(&dt,ramRecord(first-1),4);
+			if (dt && dt < cutoff)
+				break;
+			first--;
+		}
+		uint32_t num = end - first;
+
+		#if DEBUG_SEND_DATA
+			LOGI("sendChartData(%s) ram secs/dt(%d) since_bool(%d) to(%d) points(%d) cols(0x%x) sending %d/%d records",
+				m_name,secs_or_dt,since,to_dt,points,cols,num,m_ram_count);
+		#endif
+
+		if (!myiot_web_server->startBinaryResponse("application/octet-stream", CONTENT_LENGTH_UNKNOWN))
+			return "";
+
+		int out_size = bucket_secs || cols ?
+			max(1, BASE_BUF_SIZE / (3 * m_rec_size)) * 3 * m_rec_size : 0;
+		uint8_t out_buf[out_size + 1];
+
+		if (bucket_secs)
+		{
+			chartDecimator decimator(this, bucket_secs, out_buf, out_size, cols);
+
+			for (uint32_t n = end; n > first; n--)
+			{
+				uint32_t dt;
+				memcpy(&dt,ramRecord(n-1),4);
+				if (to_dt && dt > to_dt)
+					continue;
+				if (!decimator.add(ramRecord(n-1)))
+					return "";
+			}
+			if (!decimator.finish())
+				return "";
+		}
+		else if (num && to_dt)
+		{
+			// the runs of records up to to_dt, split at the wrap
+
+			uint32_t run = first;
+			for (uint32_t n = first; n <= end; n++)
+			{
+				bool in = false;
+				bool contig = true;
+				if (n < end)
+				{
+					uint32_t dt;
+					memcpy(&dt,ramRecord(n),4);
+					in = dt <= to_dt;
+					contig = n == run || ramRecord(n) == ramRecord(n-1) + m_rec_size;
+				}
+				if (n > run && (!in || !contig))
+				{
+					if (cols ?
+						!sendProjected(ramRecord(run), n - run, cols, out_buf, out_size) :
+						!myiot_web_server->writeBinaryData((const char *)ramRecord(run), (n - run) * m_rec_size))
+						return "";
+					run = n;
+				}
+				if (!in)
+					run = n + 1;
+			}
+		}
+		else if (num)
+		{
+			// send the part before the wrap, then the part after it
+
+			uint8_t *start = ramRecord(first);
+			uint32_t to_end = m_ram_max - (start - m_ram_buf) / m_rec_size;
+			uint32_t num1 = num < to_end ? num : to_end;
+			if (cols)
+			{
+				if (!sendProjected(start, num1, cols, out_buf, out_size) ||
+					(num > num1 && !sendProjected(m_ram_buf, num - num1, cols, out_buf, out_size)))
+					return "";
+			}
+			else
+			{
+				if (!myiot_web_server->writeBinaryData((const char *)start, num1 * m_rec_size))
+					return "";
+				if (num > num1 &&
+					!myiot_web_server->writeBinaryData((const char *)m_ram_buf, (num - num1) * m_rec_size))
+					return "";
+			}
+		}
+
+		return RESPONSE_HANDLED;
+	}
+
+
+	String myIOTDataLog::scanFile()
+	{
+		uint32_t first_dt = 0;
+		uint32_t last_dt = 0;
+		uint32_t prev_dt = 0;
+		uint32_t drops = 0;
+		for (uint32_t n = 0; n < m_ram_count; n++)
+		{
+			uint32_t dt;
+			memcpy(&dt,ramRecord(n),4);
+			if (!first_dt) first_dt = dt;
+			if (prev_dt && dt < prev_dt)
+				drops++;
+			last_dt = dt;
+			prev_dt = dt;
+		}
+
+		String result = "{";
+		result += "\"num_recs\":"      + String(m_ram_count)       + ",";
+		result += "\"first_dt\":"      + String(first_dt)          + ",";
+		result += "\"last_dt\":"       + String(last_dt)           + ",";
+		result += "\"tombstones\":0,";
+		result += "\"spikes\":[],";
+		result += "\"out_of_order\":"  + String(drops)             + ",";
+		result += "\"capacity\":"      + String(m_ram_max)         + ",";
+		result += "\"overwritten\":"   + String(m_ram_overwritten) + ",";
+		result += "\"needs_compact\":false";
+		result += "}";
+		return result;
+	}
+
+
+	String myIOTDataLog::getColStats(uint32_t from_dt, uint32_t to_dt/*=0*/, uint32_t cols/*=0*/)
+	{
+		cols = projectCols(cols);
+		uint32_t until = to_dt ? to_dt : 0xffffffff;
+
+		logAccum_t acc;
+		accumClear(&acc);
+		for (uint32_t n = 0; n < m_ram_count; n++)
+		{
+			const uint8_t *rec = ramRecord(n);
+			uint32_t dt;
+			memcpy(&dt,rec,4);
+			if (dt >= from_dt && dt <= until)
+				accumRecord(&acc,rec);
+		}
+		return colStatsJson(from_dt, to_dt, cols, &acc, "");
+	}
+
+#endif	// !WITH_SD
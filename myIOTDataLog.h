@@ -1,12 +1,14 @@
 //-----------------------------------------------
 // myIOTDataLog.h - data logging object
 //-----------------------------------------------
-// can be compiled for in-memory usage if WITH_SD=0,
-// in which case client must implement chart data handling
+// If WITH_SD=0 the datalog is kept in a RAM ring buffer
+// (see setRamBuffer()) that supports addRecord(), sendChartData()
+// and scanFile(), but none of the file maintenance methods.
 
 #pragma once
 
 #include <myIOTTypes.h>
+#include "myIOTDataLogColumns.h"
 
 #if WITH_SD
 	#include <SD.h>
@@ -14,41 +16,67 @@
 
 
 
-#define DATA_COLS_MAX			20
-
-	// an arbitrary upper limit
-#define LOG_COL_TYPE_UINT32			0x00000001	// full unsigned 32 bit
-#define LOG_COL_TYPE_UINT16			0x00000002
-#define LOG_COL_TYPE_UINT8			0x00000004
-#define LOG_COL_TYPE_UINT8x10		0x00000008	// 0..2550 stored as 0..255
-
-#define LOG_COL_TYPE_INT32			0x00000010	// signed 32 bit
-#define LOG_COL_TYPE_INT16			0x00000020	// signed 16 bit
-#define LOG_COL_TYPE_INT8			0x00000040	// signed 8 bit
-
-#define LOG_COL_TYPE_FLOAT32		0x00000100	// full 32 bit float (unused)
-
-// For the following the user can use the DEGREE_TYPE to show Centigrade vs Farenheit
-
-#define LOG_COL_TYPE_CENTIGRADE32	0x00001000	// full 32 bit float in Centigrade
-#define LOG_COL_TYPE_CENTIGRADE_RAW	0x00002000	// int16_t 16 bit Centigrade/128 (raw DS18B20 reading)
-#define LOG_COL_TYPE_CENTIGRADE8	0x00004000	// integer Centigrade bias 40; i.e. 40=0C; min=-40C; max=215C,
+typedef uint8_t *logRecord_t;
 
-#define LOG_COL_TYPE_INT16_10	    0x00008000	// -327.6..327.6 stored as x10 int16 integer (used for volts)
 
+// Accumulated min/max/sum of a set of records, used for decimation
+// and rollups.  Values are kept in the column's stored units.
 
+typedef union {
+	int64_t i;		// integer column types
+	float f;		// float column types
+} logVal_t;
 
-// the tick_intervals are used to determine the
-// min/max and num_ticks in the javascript.
+typedef union {
+	int64_t i;		// integer column types
+	double d;		// float column types
+} logSum_t;
 
 typedef struct {
-	const char *name;			// provided by caller
-	uint32_t type;				// provided by caller
-	float tick_interval;		// provided by caller
-} logColumn_t;
-
-
-typedef uint8_t *logRecord_t;
+	uint32_t count;
+	logVal_t min[DATA_COLS_MAX];
+	logVal_t max[DATA_COLS_MAX];
+	logSum_t sum[DATA_COLS_MAX];
+} logAccum_t;
+
+
+// Rollups are companion datalogs named "name.1h.datalog" and
+// "name.1d.datalog", or "name.<secs>s.datalog" for each level of a
+// pyramid (see setRollupPyramid()), with one record per closed bucket:
+//
+//		uint32_t dt				bucket start
+//		uint32_t count			number of records in the bucket
+//		for each column:
+//			min					in the column's type
+//			max					in the column's type
+//			sum					int64_t, or double for float columns
+
+#define LOG_DEFAULT_PENDING	32		// records kept during maintenance
+
+#define ILLEGAL_DT		1726764664		// 2024-09-19  11:51:04a Panama Local Time
+	// addRecord() refuses earlier times, i.e. before the clock is set
+
+#define LOG_JOB_COMPACT		1		// startJob() types
+#define LOG_JOB_TRIM		2
+#define LOG_JOB_TOMBSTONE	3
+#define LOG_JOB_TOMBSTONE_RANGE		4
+#define LOG_JOB_TOMBSTONE_INDICES	5
+#define LOG_JOB_ROLLUPS		6
+#define LOG_JOB_SLICE_MS	50		// longest a job keeps the datalog from its readers
+
+#define LOG_EXPORT_CSV		0		// exportData() formats
+#define LOG_EXPORT_NDJSON	1
+
+struct logExport_t;		// exportData() state
+
+#define LOG_SEGMENT_NONE	0
+#define LOG_SEGMENT_DAY		1
+#define LOG_SEGMENT_WEEK	2
+#define LOG_SEGMENT_MONTH	3
+
+#define LOG_ROLLUP_HOUR		0
+#define LOG_ROLLUP_DAY		1
+#define LOG_MAX_ROLLUPS		16		// levels in a pyramid
 
 class myIOTDataLog
 {
@@ -61,35 +89,308 @@ public:
 
 	const char *getName() const { return m_name; }
 	int getRecSize() const { return m_rec_size; }
+	int getNumCols() const { return m_num_cols; }
+	const logColumn_t *getCol(int i) const { return &m_col[i]; }
+	int getColSize(int i) const;
+		// bytes of column i in a record
 
 	#if WITH_SD
 		String dataFilename();
 			// returns "name.datalog"
-		bool addRecord(const logRecord_t rec);
-			// Will assign the dt field to the record
-			// Writes the record to the SD card.
+		int numDataFiles();
+			// 1, or the number of segments in a segmented datalog
+		String dataFilename(int n);
+			// returns the nth file of the datalog, in time order
+
+		void setSegments(int seg_type);
+			// Call before first use to store the datalog as one file per
+			// LOG_SEGMENT_DAY, WEEK, or MONTH named "name.YYYYMMDD.datalog",
+			// listed in a "name.segs" manifest, so that trimBefore() deletes
+			// whole segments.  An existing "name.datalog" becomes the first
+			// segment.  The time index is not used with segments.
+		bool addRecord(const logRecord_t rec, uint32_t dt=0);
+			// Will assign the dt field to the record, the
+			// current time, or dt if given (i.e. myIOTDataLogSampler)
+			// Writes the record to the SD card, or to the
+			// write-behind buffer if one has been set, or
+			// only queues it if setQueue() has been called.
+
+		void setWriteBehind(int buf_bytes, uint32_t flush_ms);
+			// Collects records in a RAM buffer of buf_bytes (i.e. 512)
+			// and appends them to the datalog with a single write when it
+			// fills, when the oldest one is flush_ms old, or before any
+			// maintenance operation, so a crash loses at most flush_ms
+			// worth of records.  Buffered records are included by
+			// sendChartData().  Zero buf_bytes (the default) disables it.
+		bool hasWriteBehind() const { return m_wb_buf != NULL; }
+		bool flush();
+			// writes any buffered records to the datalog, and then
+			// any pending ones if maintenance has finished
+
+		void setPendingSize(int num_recs);
+			// Records added during maintenance, while
+			// myIOTDevice::m_suppress_log is set or a job from startJob()
+			// is running, are kept in a queue of up to num_recs records
+			// (LOG_DEFAULT_PENDING) and appended by the next addRecord(),
+			// flush(), or loop() after it is done.  Records that do not
+			// fit are dropped and counted.  Zero drops them all.
+		void loop();
+			// flushes the buffer if flush_ms has elapsed, or with a
+			// queue, sets the values from setQueueValues().  Called from
+			// myIOTDevice::loop() for datalogs registered with addDataLog().
+
+		void setIndexInterval(int every_n_recs);
+			// Enables the optional "name.dtidx" sidecar that holds one
+			// (dt, record index) entry every N records, so that
+			// chart queries can binary search to the cutoff instead of
+			// walking backwards until chartDataCondition() says STOP.
+			// Zero (the default) disables the index.
+		String indexFilename();
+			// returns "name.dtidx"
+		void setChecksums(int every_n_recs);
+			// Enables the optional "name.crc" sidecar that holds the CRC32
+			// of every block of N records, so that verifyFile() can find
+			// records that have been corrupted on the card.  Zero (the
+			// default) disables it.  Checksums are not used with segments.
+		String crcFilename();
+			// returns "name.crc"
+		void setCompression(int block_bytes);
+			// Call before first use to store the datalog in blocks of
+			// block_bytes (i.e. 512, at most 1024), each starting with a
+			// whole record, followed by records encoded as varint deltas
+			// from the one before (see myIOTDataLogCompress.cpp).  Zero
+			// (the default) keeps fixed size records.  A compressed datalog
+			// can not be tombstoned, and segments, the time index, and
+			// checksums are not used with it.
+		void setColumnar(int recs_per_block);
+			// Call before first use to store the datalog in blocks of
+			// recs_per_block records (i.e. 64, rounded up to a multiple of 4),
+			// each with a header holding the dt range and the min, max, and
+			// sum of each column, followed by the dts, and then the values
+			// of each column, stored contiguously, so that getColStats() can
+			// skip or summarize whole blocks from their headers and only read
+			// the columns it needs (see myIOTDataLogColumnar.cpp).  The records
+			// of the open block are kept in "name.open.datalog".  Zero (the
+			// default) keeps whole records.  As with compression, records
+			// can not be tombstoned, and segments, the time index, and
+			// checksums are not used.
+
+		void setRollups(bool enable);
+			// Enables the hourly and daily rollup datalogs, which are then
+			// kept current by addRecord() and used by sendChartData() when
+			// decimating to buckets at least as large as the rollup.
+		void setRollupPyramid(uint32_t min_secs, int num_levels);
+			// Instead of the hourly and daily rollups, keeps num_levels (up to
+			// LOG_MAX_ROLLUPS) of them with buckets ("tiles") of min_secs,
+			// rounded down to a power of two, then twice that, and so on.
+			// A decimated chart query then reads at most about 2 * points
+			// tiles, from the level whose tiles fit in its buckets, however
+			// long the datalog is.  Each level costs sizeof(logAccum_t) of RAM.
+		String rollupFilename(int level);
+			// returns "name.1h.datalog", "name.1d.datalog", or "name.<secs>s.datalog"
+		bool rebuildRollups();
+			// Rebuilds the rollups from the datalog. Called automatically
+			// by compactFile() and trimBefore(). Use to create the rollups
+			// for an existing datalog, or to apply tombstones to them.
+
+		void setRunningStats(bool enable);
+			// Keeps the count, min, max, and sum of each column over the
+			// whole datalog in RAM and in a "name.stats" sidecar, updated by
+			// each append (see myIOTDataLogStats.cpp), so that getChartHeader()
+			// can include the range of each column without reading the records.
+			// Costs sizeof(logAccum_t) of RAM.
+		String statsFilename();
+			// returns "name.stats"
+
+		void setChartBuffer(int buf_bytes, bool read_ahead);
+			// Allocates the buffer sendChartData() reads the datalog
+			// into, instead of 1K on the stack, and with read_ahead, a
+			// second one that is filled by a task on the other core
+			// while the first is being sent.
+
+		bool setQueue(int num_recs, int batch_recs=0, uint32_t flush_ms=1000);
+			// Call once from setup() to put a ring of num_recs records,
+			// rounded up to a power of two, in front of the datalog, so that
+			// addRecord() only copies the record into it, and a writer task
+			// on the other core appends them, batch_recs (default a quarter
+			// of the ring) or flush_ms worth at a time, and does the flushes
+			// of loop() (see myIOTDataLogQueue.cpp).  The ring has a single
+			// producer: only one task may call addRecord() for the datalog.
+			// When it is full, addRecord() drops the record, counts an
+			// overrun, and returns false.
+		bool hasQueue() const { return m_q_buf != NULL; }
+		uint32_t getQueueDepth() const;
+			// records in the ring
+		uint32_t getQueueHigh() const { return m_q_high; }
+			// the most records that have been in the ring since boot
+		uint32_t getQueueOverruns() const { return m_q_overruns; }
+			// records that did not fit since boot
+		void setQueueValues(valueIdType overruns_id, valueIdType high_id);
+			// INT values of the device, either of which may be NULL, that
+			// loop() sets to getQueueOverruns() and getQueueHigh() when
+			// they change, so that they are shown and published like any
+			// other value.
+		String queueStatus();
+			// Returns JSON: name, size, batch, depth, high, overruns,
+			// written, batches, max_batch, and max_write_ms
+	#else
+		bool setRamBuffer(int num_recs, bool use_psram=false);
+			// Call once from setup() to allocate the ring buffer of
+			// num_recs records, in PSRAM if use_psram and it is available.
+			// There are no further allocations.  When it is full, each
+			// addRecord() overwrites the oldest record.
+		bool addRecord(const logRecord_t rec, uint32_t dt=0);
+			// Will assign the dt field to the record,
+			// the current time, or dt if given
+		void setRunningStats(bool enable);
+			// getChartHeader() includes the range of each column,
+			// from a pass over the ring buffer
 	#endif
 
+	// accumulator helpers
+
+	int getRollupRecSize() const;
+	void accumClear(logAccum_t *acc) const;
+	void accumRecord(logAccum_t *acc, const uint8_t *rec) const;
+	void accumColumn(logAccum_t *acc, int col, const void *vals, const uint8_t *keep, int num_recs) const;
+		// adds the values of one column (e.g. from a columnar block) to
+		// min, max, and sum, where keep[], without changing the count
+	void accumRollup(logAccum_t *acc, const uint8_t *rollup_rec) const;
+	void accumMerge(logAccum_t *acc, const logAccum_t *other) const;
+	void accumToRecords(const logAccum_t *acc, uint32_t dt, uint8_t *min_rec, uint8_t *avg_rec, uint8_t *max_rec) const;
+	void accumToRollup(const logAccum_t *acc, uint32_t dt, uint8_t *rollup_rec) const;
+
 
 	//----------------------------------------
 	// chart support
 	//----------------------------------------
 
-	String getChartHeader(int period, int with_degrees, const String *series_colors=NULL);
+	String getChartHeader(int period, int with_degrees, const String *series_colors=NULL, uint32_t cols=0, int range_secs=-1);
+		// cols is the same bitmask as for sendChartData(), and the header
+		// then describes the projected records: rec_size, num_cols, and
+		// col[] only include the selected columns, and "cols" is the mask.
+		// series_colors are passed through as given.
+		// With setRunningStats(), the header also has range_secs and
+		// range_count, and each col[] has the min and max, in stored units,
+		// of the records in the last range_secs (-1 = period, 0 = all of
+		// them), so that the client can lay out the axes before the data
+		// arrives.  With rollups they come from the buckets that overlap
+		// the range, and otherwise from the whole datalog, so they may be
+		// wider, but never narrower, than the data sendChartData() sends.
+
+	// column projection
+
+	uint32_t projectCols(uint32_t cols) const;
+		// returns the bitmask limited to the columns, or 0 if it selects all of them
+	int projectRecSize(uint32_t cols) const;
+	int projectRecords(uint8_t *dst, const uint8_t *src, int num_recs, uint32_t cols) const;
+		// Copies the dt and the columns in the cols bitmask (bit 0 is
+		// the first column) of each record to dst, which may be src,
+		// and returns the number of bytes.
+
+	String getColStats(uint32_t from_dt, uint32_t to_dt=0, uint32_t cols=0);
+		// Returns JSON: from, to, count, and cols[] with the name, min, max,
+		// and avg, in stored units, of each column in the cols bitmask (0 is
+		// all of them) over the records with from_dt <= dt <= to_dt (0 = no
+		// limit), and for a columnar datalog, the number of blocks that were
+		// skipped, summarized from their headers, or read.
+
+	String exportData(uint32_t from_dt, uint32_t to_dt=0, int format=LOG_EXPORT_CSV, uint32_t cols=0, bool fahrenheit=false);
+		// Streams the records with from_dt <= dt <= to_dt (0 = no limit)
+		// as text (myIOTDataLogExport.cpp), oldest first, one line per
+		// record: CSV with a header line, or NDJSON objects.  Each line has
+		// the dt, the local time, and the columns in the cols bitmask,
+		// decoded to display units, with temperatures in Farenheit if
+		// fahrenheit.  Uses a fixed buffer, whatever the number of records.
 
 	#if WITH_SD
-		String sendChartData(uint32_t secs_or_dt,bool since=false);
+		String sendChartData(uint32_t secs_or_dt, bool since=false, int points=0, uint32_t period=0, uint32_t to_dt=0, uint32_t cols=0);
+			// Streams the records in the requested time window as binary.
+			// If to_dt is non-zero, the window ends at to_dt instead of now,
+			// and the iteration starts at the first record after it, found
+			// by binary search, so that zooming into an old window does not
+			// read everything since then.
+			// If points is non-zero the window is divided into that many
+			// time buckets of (period + points - 1) / points seconds, aligned
+			// to multiples of that, where period defaults to the window size,
+			// and each non-empty bucket is sent as three records, the min,
+			// average, and max of each column, with the bucket start as dt.
+			// If rollups are enabled and the buckets are at least an hour
+			// (or the smallest tile of a pyramid), the bucket size is rounded
+			// up to whole rollup buckets and the results are built from the
+			// coarsest rollup datalog that fits instead.
+			// If cols is non-zero, only the dt and the columns in that
+			// bitmask are sent, as described by getChartHeader(cols).
+			// Raw records are not sent in time order: the ones in the
+			// write-behind buffer come first, then the file a buffer at a
+			// time from the end, each buffer oldest first, so the client
+			// sorts them by dt.
 
 		String scanFile();
-			// Returns JSON: num_recs, first_dt, last_dt, tombstones, out_of_order[], needs_compact
+			// Returns JSON: num_recs, first_dt, last_dt, tombstones, out_of_order[],
+			// pending, pending_dropped (since boot), needs_compact
+			// Saves its results in "name.scan" and only reads the records
+			// appended since then the next time.
 		bool tombstoneByDt(uint32_t dt);
 			// Writes dt=0 to all records matching dt (delete by timestamp)
 		bool tombstoneByIndex(uint32_t idx);
 			// Writes dt=0 to the record at file index idx (delete by position)
+		bool tombstoneRange(uint32_t start_idx, uint32_t end_idx);
+			// Writes dt=0 to the records at file indexes start_idx..end_idx inclusive
+		bool tombstoneIndices(uint32_t *indices, int num_indices);
+			// Writes dt=0 to the records at the given file indexes,
+			// which are sorted in place if they are not in order.
+			// Nothing is written if an index is out of range.  With
+			// rollups, each of these rebuilds them, so batch the deletes.
 		bool compactFile();
 			// Rewrites file stripping all dt==0 tombstone records
 		bool trimBefore(uint32_t cutoff_dt);
 			// Rewrites file keeping only records with dt >= cutoff_dt (also strips tombstones)
+			// For a segmented datalog, deletes the segments that end before cutoff_dt,
+			// and rewrites the first remaining one if needed.
+		String verifyFile();
+			// Returns JSON: ok, num_recs, tombstones, torn[] (partial records
+			// left at the end of a file by a power loss), block_recs, blocks
+			// checked, bad_blocks[] (the first 32), num_bad, and
+			// unchecked records, in one pass over the datalog and "name.crc".
+
+		// background maintenance (myIOTDataLogJob.cpp)
+
+		bool startJob(int job_type, uint32_t dt=0);
+			// Runs compactFile(), trimBefore(dt), tombstoneByDt(dt), or
+			// rebuildRollups() (LOG_JOB_COMPACT, TRIM, TOMBSTONE, or
+			// ROLLUPS) on a task on the other core, which lets
+			// sendChartData() and the other readers get to the datalog at
+			// least every LOG_JOB_SLICE_MS.  Records added in the meantime
+			// are kept as pending records (see setPendingSize()), and with
+			// a queue, in its ring (see setQueue()), so size them for the
+			// longest job.  They are appended by the next addRecord(),
+			// flush(), or loop() when the job is done, whether or not the
+			// datalog was registered with myIOTDevice::addDataLog().
+			// loop() also broadcasts jobStatus() as {"datalog_job":...}
+			// over the WebSocket.
+			// Returns false if a job is already running, for any datalog.
+		bool startJob(int job_type, const uint32_t *indices, int num_indices);
+			// The same for tombstoneRange(indices[0], indices[1])
+			// (LOG_JOB_TOMBSTONE_RANGE) or tombstoneIndices()
+			// (LOG_JOB_TOMBSTONE_INDICES), with a copy of the indices.
+		bool jobBusy() const  { return m_job_busy; }
+		static String jobStatus();
+			// Returns JSON for the current or last job: job (a sequence
+			// number), name, type, dt, state (idle, queued, running, done,
+			// or failed), phase, progress (percent), slices, max_slice_ms,
+			// pending records, records dropped since it started, and ms.
+		void jobYield(const char *phase, uint32_t done, uint32_t total);
+			// Called by the maintenance loops with their progress.  On the
+			// job task, gives the datalog to its readers for a moment once
+			// the slice has run for LOG_JOB_SLICE_MS.  Does nothing otherwise.
+	#else
+		String sendChartData(uint32_t secs_or_dt, bool since=false, int points=0, uint32_t period=0, uint32_t to_dt=0, uint32_t cols=0);
+			// Same as the SD version, from the ring buffer, except that
+			// raw records are sent in time order, oldest first.
+		String scanFile();
+			// Returns JSON: num_recs, first_dt, last_dt, out_of_order,
+			// capacity, and overwritten (since boot)
 	#endif
 
 private:
@@ -101,9 +402,264 @@ private:
 	int m_rec_size;
 
 	void dbg_rec(const logRecord_t rec);
+	String colStatsJson(uint32_t from_dt, uint32_t to_dt, uint32_t cols, const logAccum_t *acc, const String &extra);
+	bool colRanges(logAccum_t *acc, uint32_t from_dt);
+		// the ranges for getChartHeader(), false if there are none
+	bool sendProjected(const uint8_t *recs, int num_recs, uint32_t cols, uint8_t *out_buf, int out_size);
+
+	// export (myIOTDataLogExport.cpp)
+
+	int exportValue(char *out, int col, const uint8_t *val, int format, bool fahrenheit) const;
+	bool exportRecords(logExport_t *exp, const uint8_t *recs, int num_recs);
+	#if WITH_SD
+		bool exportFile(logExport_t *exp, const String &filename, uint32_t from_rec, uint32_t to_rec);
+		bool exportBlocks(logExport_t *exp);
+	#endif
+
+	#if WITH_SD
+		// time index sidecar (myIOTDataLogIndex.cpp)
+
+		int m_idx_every;			// 0 = no index
+		bool m_idx_valid;			// index verified against the datalog since boot
+		uint32_t m_idx_count;		// number of entries in the index
+
+		bool validateIndex(uint32_t num_recs);
+		bool rebuildIndex();
+		void indexRecords(uint32_t first_idx, const uint8_t *recs, int num_recs);
+		void invalidateIndex();
+		uint32_t indexFloor(uint32_t cutoff);
+			// returns a record number below which a backwards iteration
+			// to the cutoff need not read, or 0 if there is no index.
+		uint32_t findFloor(uint32_t cutoff);
+			// Same as indexFloor(), but if there is no index, scans the
+			// datalog backwards for the newest record with 0 < dt < cutoff.
+		uint32_t findCeiling(const char *filename, int rec_size, uint32_t to_dt, bool use_index);
+			// returns the record number in the file at which a backwards
+			// iteration for records up to to_dt can start, by binary
+			// searching the time index, if use_index, and then the file,
+			// or the end of the file if it has out of order records.
+
+		// block checksum sidecar (myIOTDataLogVerify.cpp)
+
+		int m_crc_every;			// 0 = no checksums
+		bool m_crc_valid;			// checksums verified against the datalog since boot
+		uint32_t m_crc_count;		// number of blocks in the sidecar
+		uint32_t m_crc_run;			// CRC of the records in the partial block
+
+		bool validateChecksums(uint32_t num_recs);
+		void crcRecords(uint32_t first_idx, const uint8_t *recs, int num_recs);
+		void updateChecksums(uint32_t first_idx, uint32_t last_idx);
+		void invalidateChecksums();
+
+		// compressed blocks (myIOTDataLogCompress.cpp)
+
+		int m_z_block;				// 0 = fixed size records
+		bool m_z_valid;				// encoder state recovered since boot
+		int m_z_fill;				// bytes used in the newest block
+		uint32_t m_z_delta;			// dt delta of the newest record
+		uint8_t *m_z_prev;			// the newest record
+
+		int encodeRecord(const uint8_t *rec, uint8_t *prev, uint32_t *delta, int *fill, uint8_t *out) const;
+		int decodeBlock(const uint8_t *in, int len, uint8_t *out, int *used, uint32_t *delta) const;
+		bool recoverCompressed();
+		bool appendCompressed(const uint8_t *recs, int num_recs);
+		bool rewriteCompressed(uint32_t cutoff_dt);
+
+		// blocks of compressed or columnar records
+
+		int blockBytes() const;
+		int blockMaxRecs() const;
+		int blockBufSize() const;
+		uint32_t blockFirstDt(File &file, uint32_t block);
+		static int decodeBlockCB(void *log, const uint8_t *block, int len, uint8_t *recs);
+		int readBlock(File &file, uint8_t *buf);
+		uint32_t findBlock(uint32_t dt);
+			// returns the number of blocks that start at or before dt
+		bool feedRollupBlocks(File &file, File *out, bool cascade);
+		String scanBlocks();
+
+		// columnar blocks (myIOTDataLogColumnar.cpp)
+
+		int m_c_recs;				// records per block, 0 = whole records
+		bool m_c_valid;				// open block recovered since boot
+		uint32_t m_c_open;			// records in the open block
+
+		String colOpenFilename();
+		int colHeaderBytes() const;
+		int colBlockBytes() const;
+		void encodeColBlock(const uint8_t *recs, uint8_t *block) const;
+		int decodeColBlock(const uint8_t *block, int len, uint8_t *recs) const;
+		uint32_t colBlockFirstDt(File &file, uint32_t block);
+		bool recoverColumnar();
+		bool closeColBlock(bool check_dup);
+		bool appendColumnar(const uint8_t *recs, int num_recs);
+		bool rewriteColumnar(uint32_t cutoff_dt);
+		void accumColumnar(logAccum_t *acc, uint32_t from_dt, uint32_t to_dt, uint32_t cols, uint32_t *counts);
+		void accumFiles(logAccum_t *acc, uint32_t from_dt, uint32_t until, uint32_t cols, uint32_t *counts);
+
+		// running stats (myIOTDataLogStats.cpp)
+
+		logAccum_t *m_stats;		// NULL = no running stats
+		int m_stats_state;			// STATS_UNKNOWN until the sidecar is read
+		uint32_t m_stats_last;		// dt of the newest record in the stats
+
+		uint32_t newestDt();
+		bool loadStats();
+		bool saveStats();
+		bool recoverStats();
+		void statsRecords(const uint8_t *recs, int num_recs);
+		void invalidateStats();
+		bool rollupRanges(logAccum_t *acc, uint32_t from_dt);
+
+		// rollups (myIOTDataLogRollup.cpp)
+
+		typedef struct {
+			uint32_t secs;				// 3600 or 86400, or a power of two
+			bool recovered;				// state re-established since boot
+			uint32_t rolled_until;		// end of the last bucket in the rollup file
+			uint32_t bucket_dt;			// start of the open bucket
+			logAccum_t acc;				// the open bucket
+		} logRollup_t;
+
+		logRollup_t *m_rollup;			// NULL = no rollups
+		int m_num_rollups;
+
+		void initRollups(const uint32_t *secs, int num_levels);
+		void rollupRecords(const uint8_t *recs, int num_recs);
+		void feedRollup(int level, const uint8_t *rec, File *out=NULL, bool cascade=true);
+		bool recoverRollup(int level);
+		bool recoverRollups(int level);
+		bool feedRollupsFrom(int file_num, uint32_t rec_idx, bool cascade);
+		bool feedRollupFromBelow(int level, uint32_t from_dt, bool cascade);
+		int pickRollup(uint32_t bucket_secs);
+
+		// write-behind buffer
+
+		uint8_t *m_wb_buf;			// NULL = unbuffered
+		int m_wb_max;				// capacity in records
+		int m_wb_count;				// number of buffered records
+		uint32_t m_wb_flush_ms;		// 0 = only when full or flushed
+		uint32_t m_wb_start_ms;		// millis() when the oldest was buffered
+
+		bool appendRecords(const uint8_t *recs, int num_recs);
+		bool appendToFile(const String &filename, const uint8_t *recs, int num_recs, uint32_t *size);
+
+		// records added during maintenance
+
+		uint8_t *m_pend_buf;		// allocated on first use
+		int m_pend_max;				// capacity in records
+		int m_pend_count;			// number of pending records
+		uint32_t m_pend_dropped;	// records dropped since boot
+
+		bool addPending(const uint8_t *rec);
+		bool writeRecords(const uint8_t *recs, int num_recs);
+			// the records from addRecord() or the ring
+
+		// sample queue (myIOTDataLogQueue.cpp)
+
+		uint8_t *m_q_buf;				// NULL = no queue
+		uint32_t m_q_max;				// capacity in records, a power of two
+		uint32_t m_q_head;				// records queued since boot, by the producer
+		uint32_t m_q_tail;				// records taken since boot, by the writer
+		uint32_t m_q_batch;				// depth at which the writer is woken
+		uint32_t m_q_flush_ms;			// or how long since it last drained the ring
+		uint32_t m_q_drain_ms;			// millis() when it did
+		bool m_q_draining;				// in drainQueue()
+		volatile uint32_t m_q_high;		// the most records in the ring since boot
+		volatile uint32_t m_q_overruns;	// records that did not fit since boot
+		uint32_t m_q_batches;			// writes from the ring since boot
+		uint32_t m_q_max_batch;			// the most records in one of them
+		uint32_t m_q_max_write_ms;		// and the longest one
+		valueIdType m_q_overruns_id;	// setQueueValues()
+		valueIdType m_q_high_id;
+		uint32_t m_q_shown_overruns;	// as last set by loopQueue()
+		uint32_t m_q_shown_high;
+		uint32_t m_q_shown_ms;			// millis() when it did
+
+		bool queueRecord(const uint8_t *rec);
+		void drainQueue();
+		void loopWriter();
+		void loopQueue();
+		static void writerTask(void *param);
+
+		// background maintenance (myIOTDataLogJob.cpp)
+
+		volatile bool m_job_busy;	// from startJob() until the job task finishes it
+
+		static bool initJobLock();
+		static bool initJobTask();
+		bool queueJob(int job_type, uint32_t dt, uint32_t *indices, int num_indices);
+		static void jobTask(void *param);
+		static uint32_t jobDropped();
+		bool maintaining() const;
+		bool jobRefused(const char *what);
+		void loopJob();
+
+		bool tombstoneRuns(const uint32_t *indices, int num_indices, uint32_t start_idx, uint32_t end_idx);
+
+		// scan checkpoint (myIOTDataLogScan.cpp)
+
+		String scanFilename();
+		void invalidateScan();
+		bool scanFoundSpikes();
+			// the checkpoint reports out of order records
+
+		// sendChartData() buffers
+
+		uint8_t *m_chart_buf;		// NULL = 1K on the stack
+		uint8_t *m_chart_ahead_buf;	// NULL = no read-ahead
+		int m_chart_buf_size;
+
+		// segments (myIOTDataLogSegment.cpp)
+
+		int m_seg_type;				// LOG_SEGMENT_NONE = single datalog
+		int m_seg_count;			// -1 until the manifest has been read
+		uint32_t m_seg_last;		// period start of the newest segment
+
+		String segmentsFilename();
+		String segmentFilename(uint32_t key);
+		uint32_t segmentStart(uint32_t dt);
+		bool loadSegments();
+		bool newSegment(uint32_t key);
+		uint32_t segmentKey(int n);
+		int findSegment(uint32_t key);
+		bool removeSegments(int num);
+		bool appendSegments(const uint8_t *recs, int num_recs);
+	#else
+		// RAM ring buffer
+
+		uint8_t *m_ram_buf;				// NULL until setRamBuffer()
+		uint32_t m_ram_max;				// capacity in records
+		uint32_t m_ram_head;			// where the next record goes
+		uint32_t m_ram_count;			// number of records
+		uint32_t m_ram_overwritten;		// records overwritten since boot
+		bool m_ram_stats;				// setRunningStats()
+
+		uint8_t *ramRecord(uint32_t n) const;
+	#endif
 };
 
 
+#if WITH_SD
+
+	class logJobLock
+		// Held by the readers of a datalog while a job is running on it,
+		// and by the job task except between its slices, so that they
+		// do not see its files while they are being replaced.  With a
+		// queue, it is always held by the readers, the maintenance
+		// methods, and the writer task, which then have the datalog
+		// to themselves.  It may be nested.
+	{
+	public:
+		logJobLock(const myIOTDataLog *log);
+		~logJobLock();
+	private:
+		bool m_locked;
+	};
+
+#endif
+
+
 //----------------------------------------------------
 // backwards fixed size record SD file iterator
 //----------------------------------------------------
@@ -119,6 +675,8 @@ private:
 	} SDIterState_t;
 
 	typedef SDIterState_t (*SDBackardsCB)(uint32_t client_data, uint8_t *rec);
+	typedef int (*SDDecodeCB)(void *decode_data, const uint8_t *block, int len, uint8_t *recs);
+		// decodes len bytes of a block into records, returning how many
 
 	typedef struct {
 
@@ -131,27 +689,60 @@ private:
 		SDBackardsCB record_fxn;	// client callback funtion
 		uint8_t *buffer;            // the buffer
 		uint32_t buf_size;			// MUST be an even multiple of rec_size
+			// with read-ahead, buffer and ahead_buf are swapped as
+			// the iteration proceeds, so either may hold the records
 
 		// membets maintained through an iteration
 
 		File file;
 		bool done;					// iteration has finished
+		bool stopped;				// finished because the callback returned ITER_STOP
+		bool error;					// finished because of a seek or read error
 		int num_buf_recs;			// nuumber of records in the current buffer
 		int read_pos;         		// starts as file.size()
 		int buf_idx;        		// which record in the buffer are we at
+		int start_pos;				// lowest byte offset that will be read
+		uint8_t *ahead_buf;			// second buf_size buffer, NULL = no read-ahead
+		bool ahead_pending;			// the reader task is filling ahead_buf
+		int ahead_bytes;			// size of that read
+
+		// set by startSDBlocksBackwards()
+
+		uint32_t block_size;		// 0 = a file of fixed size records
+		SDDecodeCB decode_fxn;		// decodes a block into records
+		void *decode_data;			// passed to decode_fxn
 
 	} SDBackwards_t;
 
 
-	extern bool startSDBackwards(SDBackwards_t *iter);
+	extern bool startSDBackwards(SDBackwards_t *iter, uint32_t start_pos=0, uint8_t *ahead_buf=NULL, int end_pos=-1);
 		// reports returns false on error
 		// returns true if no errors
 		// iter->done set to true if missing or empty file
 		// file will possibly be open if returns true
+		// start_pos, if given, is a byte offset (multiple of rec_size)
+		// below which the iteration will not go, i.e. from a time index.
+		// end_pos, if given, is a byte offset (multiple of rec_size) at
+		// which the iteration starts instead of the end of the file.
+		// ahead_buf, if given, is a second buffer of buf_size that a
+		// reader task fills with the next records while the client
+		// is processing the current ones.
+	extern bool startSDBlocksBackwards(SDBackwards_t *iter, uint32_t block_size, SDDecodeCB decode_fxn, void *decode_data, uint8_t *ahead_buf=NULL, int end_pos=-1);
+		// Same, for a file of block_size blocks of variable size records,
+		// i.e. a compressed datalog.  Each block is read into the last
+		// block_size bytes of the buffer, and decode_fxn decodes it into
+		// records at the start, so buf_size must also hold the most records
+		// a block can decode to.  end_pos, if given, is a multiple of block_size.
 	extern uint8_t *getSDBackwards(SDBackwards_t *iter, int *num_recs);
 		// returns record(s), but only as many as the client
 		// callback has verified that it wanted
-		// file will be closed if returns NULL
+		// file will be closed if returns NULL and iter->done,
+		// chunked iterations may return NULL for a buffer of tombstones
+		// without being done.  iter->error tells a seek or read error
+		// from the start of the file.
+	extern void endSDBackwards(SDBackwards_t *iter);
+		// Waits for any read-ahead and closes the file. Must be
+		// called by clients that stop before getSDBackwards() is done.
 
 #endif	// WITH_SD
 
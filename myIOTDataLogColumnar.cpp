@@ -0,0 +1,649 @@
+//-----------------------------------------------
+// myIOTDataLogColumnar.cpp - column oriented datalog blocks
+//-----------------------------------------------
+// setColumnar() stores the datalog as a sequence of fixed size blocks
+// of recs_per_block (N) records, each laid out by column:
+//
+//		uint32_t num_recs		N, or 0 for a block left by a torn append
+//		uint32_t max_dt			the newest dt in the block
+//		rollup record			dt = the oldest dt, count, and the min, max,
+//								and sum of each column (see myIOTDataLog.h)
+//		padding					to a multiple of 4 bytes
+//		uint32_t dt[N]
+//		column 0 values[N]		in the column's type
+//		...
+//		column n-1 values[N]
+//
+// N is a multiple of 4, so each array is 4 byte aligned in the block,
+// and, read into a uint32_t buffer, can be looped over as its type.
+// The header covers the records whose dt is not 0.
+//
+// Only whole blocks are written. The records of the open block are
+// appended, as whole records, to "name.open.datalog", and when there
+// are N of them they are written to the datalog as a block and the
+// open file is removed, or replaced with any records after them.
+// A power loss between those two steps leaves the open file with the
+// N records that are already in the last block, which the recovery
+// at boot notices by comparing them.  A torn block is padded to an
+// empty one (its records are still in the open file).
+//
+// getColStats() skips the blocks whose dt range is outside the query
+// and uses the header of those entirely inside it, so a query over
+// a month only reads the dts and the selected columns of the two
+// blocks at the ends.  sendChartData() and the rollups read the open
+// records, and then the blocks, transposed back into whole records by
+// decodeColBlock() with the iterator from startSDBlocksBackwards().
+
+#include "myIOTDataLog.h"
+#include "myIOTLog.h"
+
+#if WITH_SD
+
+#define DEBUG_COLUMNAR	0
+
+#define COL_MIN_RECS	8
+#define COL_BLOCK_MAX	1024		// bytes, for the stack buffers
+
+#define COL_HDR_MAX_DT	4			// header offsets
+#define COL_HDR_ROLLUP	8
+
+
+
+String myIOTDataLog::colOpenFilename()
+{
+	String filename = "/";
+	filename += m_name;
+	filename += ".open.datalog";
+	return filename;
+}
+
+
+void myIOTDataLog::setColumnar(int recs_per_block)
+{
+	if (m_seg_type && recs_per_block > 0)
+	{
+		LOGW("myIOTDataLog(%s) columnar blocks not used with segments",m_name);
+		recs_per_block = 0;
+	}
+	if (m_z_block && recs_per_block > 0)
+	{
+		LOGW("myIOTDataLog(%s) columnar blocks not used with compression",m_name);
+		recs_per_block = 0;
+	}
+
+	m_c_recs = 0;
+	m_c_valid = false;
+	m_c_open = 0;
+
+	if (recs_per_block > 0)
+	{
+		if (recs_per_block < COL_MIN_RECS)
+			recs_per_block = COL_MIN_RECS;
+		m_c_recs = (recs_per_block + 3) & ~3;
+		while (m_c_recs > COL_MIN_RECS && colBlockBytes() > COL_BLOCK_MAX)
+			m_c_recs -= 4;
+
+		if (m_idx_every)
+		{
+			LOGW("myIOTDataLog(%s) time index disabled for columnar datalog",m_name);
+			setIndexInterval(0);
+		}
+		if (m_crc_every)
+		{
+			LOGW("myIOTDataLog(%s) checksums disabled for columnar datalog",m_name);
+			setChecksums(0);
+		}
+		LOGI("myIOTDataLog(%s) columnar blocks of %d records (%d bytes)",m_name,m_c_recs,colBlockBytes());
+	}
+}
+
+
+int myIOTDataLog::colHeaderBytes() const
+{
+	return (COL_HDR_ROLLUP + getRollupRecSize() + 3) & ~3;
+}
+
+
+int myIOTDataLog::colBlockBytes() const
+{
+	return colHeaderBytes() + m_c_recs * m_rec_size;
+}
+
+
+
+//------------------------------------
+// encode and decode
+//------------------------------------
+
+void myIOTDataLog::encodeColBlock(const uint8_t *recs, uint8_t *block) const
+	// transposes m_c_recs records into a block
+{
+	uint32_t num = m_c_recs;
+	int hdr_bytes = colHeaderBytes();
+	memset(block, 0, hdr_bytes);
+
+	logAccum_t acc;
+	accumClear(&acc);
+	uint32_t min_dt = 0;
+	uint32_t max_dt = 0;
+
+	uint8_t *dts = block + hdr_bytes;
+	for (uint32_t r=0; r<num; r++)
+	{
+		const uint8_t *rec = recs + r * m_rec_size;
+		uint32_t dt;
+		memcpy(&dt, rec, 4);
+		memcpy(dts + r * 4, &dt, 4);
+		if (dt)
+		{
+			accumRecord(&acc, rec);
+			if (!min_dt || dt < min_dt) min_dt = dt;
+			if (dt > max_dt) max_dt = dt;
+		}
+	}
+
+	uint8_t *vals = dts + num * 4;
+	int offset = 4;
+	for (int i=0; i<m_num_cols; i++)
+	{
+		int size = getColSize(i);
+		for (uint32_t r=0; r<num; r++)
+			memcpy(vals + r * size, recs + r * m_rec_size + offset, size);
+		vals += num * size;
+		offset += size;
+	}
+
+	memcpy(block, &num, 4);
+	memcpy(block + COL_HDR_MAX_DT, &max_dt, 4);
+	if (acc.count)
+		accumToRollup(&acc, min_dt, block + COL_HDR_ROLLUP);
+}
+
+
+int myIOTDataLog::decodeColBlock(const uint8_t *block, int len, uint8_t *recs) const
+	// Transposes a block back into records, returning how many,
+	// which is 0 for an empty or partial one.
+{
+	uint32_t num;
+	memcpy(&num, block, 4);
+	if (len < colBlockBytes() || num != (uint32_t) m_c_recs)
+		return 0;
+
+	const uint8_t *dts = block + colHeaderBytes();
+	for (uint32_t r=0; r<num; r++)
+		memcpy(recs + r * m_rec_size, dts + r * 4, 4);
+
+	const uint8_t *vals = dts + num * 4;
+	int offset = 4;
+	for (int i=0; i<m_num_cols; i++)
+	{
+		int size = getColSize(i);
+		for (uint32_t r=0; r<num; r++)
+			memcpy(recs + r * m_rec_size + offset, vals + r * size, size);
+		vals += num * size;
+		offset += size;
+	}
+	return num;
+}
+
+
+uint32_t myIOTDataLog::colBlockFirstDt(File &file, uint32_t block)
+	// the oldest dt in the block, from its header
+{
+	uint32_t hdr[3];
+	if (file.seek(block * colBlockBytes()) &&
+		file.read((uint8_t *) hdr, sizeof(hdr)) == sizeof(hdr) &&
+		hdr[0] == (uint32_t) m_c_recs)
+		return hdr[COL_HDR_ROLLUP / 4];
+	return 0;
+}
+
+
+
+//------------------------------------
+// append
+//------------------------------------
+
+bool myIOTDataLog::recoverColumnar()
+	// Counts the open records, pads a torn block, and closes
+	// the block left open by a power loss, if any.
+{
+	String filename = dataFilename();
+	String open_name = colOpenFilename();
+	String tmp_name = open_name + ".tmp";
+	int block_bytes = colBlockBytes();
+
+	// the open records after a block, if it was interrupted while replacing them
+
+	if (!SD.exists(open_name.c_str()) && SD.exists(tmp_name.c_str()))
+	{
+		LOGW("recoverColumnar(%s) restoring %s",m_name,tmp_name.c_str());
+		SD.rename(tmp_name.c_str(), open_name.c_str());
+	}
+
+	File file = SD.open(filename.c_str(), FILE_READ);
+	uint32_t size = file ? file.size() : 0;
+	if (file)
+		file.close();
+	int torn = size % block_bytes;
+	if (torn)
+	{
+		int pad = block_bytes - torn;
+		uint8_t zeros[pad];
+		memset(zeros, 0, pad);
+
+		// padding the torn header with zeros would leave num_recs
+		// partly written, so the whole block is made empty
+
+		uint8_t empty[torn];
+		memset(empty, 0, torn);
+
+		file = SD.open(filename.c_str(), "r+");
+		bool ok = file &&
+			file.seek(size - torn) &&
+			file.write(empty, torn) == torn &&
+			file.write(zeros, pad) == pad;
+		if (file)
+			file.close();
+
+		LOGW("%s torn block(%d bytes) at %d %s",
+			filename.c_str(), torn, size - torn,
+			ok ? "made empty" : "could not be repaired");
+		if (!ok)
+			return false;
+	}
+
+	file = SD.open(open_name.c_str(), FILE_READ);
+	m_c_open = file ? file.size() / m_rec_size : 0;
+	if (file)
+		file.close();
+
+	bool check_dup = true;
+	while (m_c_open >= (uint32_t) m_c_recs)
+	{
+		if (!closeColBlock(check_dup))
+			return false;
+		check_dup = false;
+	}
+
+	#if DEBUG_COLUMNAR
+		LOGD("recoverColumnar(%s) %d open records",m_name,m_c_open);
+	#endif
+
+	m_c_valid = true;
+	return true;
+}
+
+
+bool myIOTDataLog::closeColBlock(bool check_dup)
+	// Writes the first m_c_recs open records to the datalog as a block,
+	// unless check_dup and they are already the last block, and then
+	// removes them from the open file.
+{
+	String filename = dataFilename();
+	String open_name = colOpenFilename();
+	String tmp_name = open_name + ".tmp";
+	int block_bytes = colBlockBytes();
+	int rows_bytes = m_c_recs * m_rec_size;
+
+	uint32_t block_buf[block_bytes / 4];
+	uint32_t rows_buf[(rows_bytes + 3) / 4];
+	uint8_t *block = (uint8_t *) block_buf;
+	uint8_t *rows = (uint8_t *) rows_buf;
+
+	File open_file = SD.open(open_name.c_str(), FILE_READ);
+	if (!open_file ||
+		open_file.read(rows, rows_bytes) != rows_bytes)
+	{
+		LOGE("closeColBlock() could not read %s",open_name.c_str());
+		if (open_file)
+			open_file.close();
+		return false;
+	}
+	open_file.close();
+
+	encodeColBlock(rows, block);
+
+	bool dup = false;
+	if (check_dup)
+	{
+		// compared a piece at a time, through the rows buffer
+
+		File file = SD.open(filename.c_str(), FILE_READ);
+		uint32_t size = file ? file.size() : 0;
+		if (size >= (uint32_t) block_bytes && file.seek(size - block_bytes))
+		{
+			dup = true;
+			for (int off=0; dup && off<block_bytes; off+=rows_bytes)
+			{
+				int len = block_bytes - off < rows_bytes ? block_bytes - off : rows_bytes;
+				dup = file.read(rows, len) == len &&
+					!memcmp(rows, block + off, len);
+			}
+		}
+		if (file)
+			file.close();
+		if (dup)
+			LOGW("closeColBlock(%s) open records are already the last block",m_name);
+	}
+
+	if (!dup)
+	{
+		File file = SD.open(filename.c_str(), FILE_APPEND);
+		bool ok = file && file.write(block, block_bytes) == block_bytes;
+		if (file)
+			file.close();
+		if (!ok)
+		{
+			LOGE("closeColBlock() could not append a block to %s",filename.c_str());
+			return false;
+		}
+	}
+
+	// keep any records after the block
+
+	m_c_open -= m_c_recs;
+	if (m_c_open)
+	{
+		open_file = SD.open(open_name.c_str(), FILE_READ);
+		File tmp = SD.open(tmp_name.c_str(), FILE_WRITE);
+		bool ok = open_file && tmp && open_file.seek(rows_bytes);
+		uint32_t left = m_c_open * m_rec_size;
+		while (ok && left)
+		{
+			int len = left < (uint32_t) rows_bytes ? left : rows_bytes;
+			ok = open_file.read(rows, len) == len &&
+				tmp.write(rows, len) == len;
+			left -= len;
+		}
+		if (open_file)
+			open_file.close();
+		if (tmp)
+			tmp.close();
+		if (!ok)
+		{
+			LOGE("closeColBlock() could not copy the open records to %s",tmp_name.c_str());
+			SD.remove(tmp_name.c_str());
+			m_c_open += m_c_recs;
+			return false;
+		}
+		SD.remove(open_name.c_str());
+		SD.rename(tmp_name.c_str(), open_name.c_str());
+	}
+	else
+		SD.remove(open_name.c_str());
+
+	#if DEBUG_COLUMNAR
+		LOGD("closeColBlock(%s) %s, %d open records",m_name,dup?"dup":"appended",m_c_open);
+	#endif
+
+	return true;
+}
+
+
+bool myIOTDataLog::appendColumnar(const uint8_t *recs, int num_recs)
+	// Appends the records to the open file, and closes the block
+	// when it is full.  If that fails the records are still in the
+	// open file, and it is tried again by the next append.
+{
+	if (!m_c_valid && !recoverColumnar())
+		return false;
+
+	uint32_t size;
+	if (!appendToFile(colOpenFilename(), recs, num_recs, &size))
+		return false;
+
+	m_c_open = size / m_rec_size + num_recs;
+	while (m_c_open >= (uint32_t) m_c_recs)
+	{
+		if (!closeColBlock(false))
+		{
+			m_c_valid = false;
+			break;
+		}
+	}
+	return true;
+}
+
+
+
+//------------------------------------
+// maintenance
+//------------------------------------
+
+bool myIOTDataLog::rewriteColumnar(uint32_t cutoff_dt)
+	// Rewrites the blocks and open records keeping the records
+	// with dt != 0 and dt >= cutoff_dt, in new blocks and open records.
+{
+	String filename = dataFilename();
+	String open_name = colOpenFilename();
+	String tmp_name = "/" + String(m_name) + ".tmp";
+	String tmp_open = open_name + ".tmp";
+	int block_bytes = colBlockBytes();
+	int rows_bytes = m_c_recs * m_rec_size;
+
+	if (SD.exists(tmp_name.c_str()))
+		SD.remove(tmp_name.c_str());
+	if (SD.exists(tmp_open.c_str()))
+		SD.remove(tmp_open.c_str());
+
+	File dst = SD.open(tmp_name.c_str(), FILE_WRITE);
+	if (!dst)
+	{
+		LOGE("rewriteColumnar() could not create %s", tmp_name.c_str());
+		return false;
+	}
+
+	uint32_t read_buf[(blockBufSize() + 3) / 4];
+	uint32_t rows_buf[(rows_bytes + 3) / 4];
+	uint32_t block_buf[block_bytes / 4];
+	uint8_t *rows = (uint8_t *) rows_buf;
+	uint8_t *block = (uint8_t *) block_buf;
+	int num_rows = 0;
+	int written = 0;
+	bool ok = true;
+
+	// the blocks, and then the open records
+
+	for (int pass=0; ok && pass<2; pass++)
+	{
+		String src_name = pass ? open_name : filename;
+		File src = SD.open(src_name.c_str(), FILE_READ);
+		if (!src)
+			continue;
+
+		while (ok)
+		{
+			// readBlock() returns 0 for an empty block, and -1 at the end
+
+			int num;
+			if (pass)
+			{
+				int got = src.read((uint8_t *) read_buf, rows_bytes);
+				num = got > 0 ? got / m_rec_size : -1;
+			}
+			else
+				num = readBlock(src, (uint8_t *) read_buf);
+			if (num < 0)
+				break;
+
+			for (int r=0; ok && r<num; r++)
+			{
+				const uint8_t *rec = (uint8_t *) read_buf + r * m_rec_size;
+				uint32_t dt;
+				memcpy(&dt, rec, 4);
+				if (dt == 0 || dt < cutoff_dt)
+					continue;
+
+				memcpy(rows + num_rows * m_rec_size, rec, m_rec_size);
+				written++;
+				if (++num_rows == m_c_recs)
+				{
+					encodeColBlock(rows, block);
+					ok = dst.write(block, block_bytes) == block_bytes;
+					num_rows = 0;
+				}
+			}
+			jobYield("rewrite", src.position(), src.size());
+		}
+		src.close();
+	}
+	dst.close();
+
+	if (ok && num_rows)
+	{
+		File open_dst = SD.open(tmp_open.c_str(), FILE_WRITE);
+		ok = open_dst && open_dst.write(rows, num_rows * m_rec_size) == num_rows * m_rec_size;
+		if (open_dst)
+			open_dst.close();
+	}
+
+	m_c_valid = false;
+	if (!ok)
+	{
+		LOGE("rewriteColumnar() could not write %s", tmp_name.c_str());
+		SD.remove(tmp_name.c_str());
+		SD.remove(tmp_open.c_str());
+		return false;
+	}
+
+	SD.remove(filename.c_str());
+	if (!SD.rename(tmp_name.c_str(), filename.c_str()))
+	{
+		LOGE("rewriteColumnar() rename failed");
+		return false;
+	}
+	SD.remove(open_name.c_str());
+	if (num_rows)
+		SD.rename(tmp_open.c_str(), open_name.c_str());
+
+	LOGI("rewriteColumnar(%s cutoff=%u) wrote %d records", filename.c_str(), cutoff_dt, written);
+	return true;
+}
+
+
+
+//------------------------------------
+// getColStats()
+//------------------------------------
+
+void myIOTDataLog::accumColumnar(logAccum_t *acc, uint32_t from_dt, uint32_t to_dt, uint32_t cols, uint32_t *counts)
+	// Accumulates the records from_dt..to_dt into acc, and counts the
+	// blocks skipped, summarized from their header, and read into
+	// counts[0..2].  Only the columns in cols are read from the blocks
+	// that are partly in the window, so the others are not valid in acc.
+	// Like sendChartData(), this assumes the blocks are in time order,
+	// starting at the block found by findBlock() and stopping at the
+	// first one after the window, without reading the headers of the
+	// blocks outside of it.
+{
+	int hdr_bytes = colHeaderBytes();
+	int block_bytes = colBlockBytes();
+	uint32_t num = m_c_recs;
+
+	String filename = dataFilename();
+	File file = SD.open(filename.c_str(), FILE_READ);
+	uint32_t num_blocks = file ? file.size() / block_bytes : 0;
+	uint32_t start = from_dt ? findBlock(from_dt) : 0;
+	if (start)
+		start--;
+	if (start > num_blocks)
+		start = num_blocks;
+	counts[0] += start;
+
+	uint32_t hdr_buf[hdr_bytes / 4];
+	uint32_t dts[num];
+	uint32_t vals[num];
+	uint8_t keep[num];
+
+	for (uint32_t b=start; b<num_blocks; b++)
+	{
+		uint32_t pos = b * block_bytes;
+		if (!file.seek(pos) ||
+			file.read((uint8_t *) hdr_buf, hdr_bytes) != hdr_bytes)
+			break;
+
+		const uint8_t *rollup = (uint8_t *) hdr_buf + COL_HDR_ROLLUP;
+		uint32_t max_dt = hdr_buf[COL_HDR_MAX_DT / 4];
+		uint32_t min_dt;
+		uint32_t count;
+		memcpy(&min_dt, rollup, 4);
+		memcpy(&count, rollup + 4, 4);
+
+		if (hdr_buf[0] == num && count && min_dt > to_dt)
+		{
+			counts[0] += num_blocks - b;
+			break;
+		}
+		if (hdr_buf[0] != num || !count || max_dt < from_dt)
+		{
+			counts[0]++;
+			continue;
+		}
+		if (min_dt >= from_dt && max_dt <= to_dt)
+		{
+			accumRollup(acc, rollup);
+			counts[1]++;
+			continue;
+		}
+
+		// read the dts, and then only the selected columns
+
+		counts[2]++;
+		if (file.read((uint8_t *) dts, num * 4) != (int)(num * 4))
+			break;
+
+		logAccum_t slice;
+		memset(&slice, 0, sizeof(slice));
+		for (uint32_t r=0; r<num; r++)
+		{
+			keep[r] = dts[r] && dts[r] >= from_dt && dts[r] <= to_dt;
+			slice.count += keep[r];
+		}
+		if (!slice.count)
+			continue;
+
+		uint32_t offset = hdr_bytes + num * 4;
+		for (int i=0; i<m_num_cols; i++)
+		{
+			int size = getColSize(i);
+			if (!cols || (cols & (1UL << i)))
+			{
+				if (!file.seek(pos + offset) ||
+					file.read((uint8_t *) vals, num * size) != (int)(num * size))
+					break;
+				accumColumn(&slice, i, vals, keep, num);
+			}
+			offset += num * size;
+		}
+		accumMerge(acc, &slice);
+	}
+	if (file)
+		file.close();
+
+	// the open records
+
+	String open_name = colOpenFilename();
+	file = SD.open(open_name.c_str(), FILE_READ);
+	if (file)
+	{
+		uint32_t rows_buf[(num * m_rec_size + 3) / 4];
+		uint8_t *rows = (uint8_t *) rows_buf;
+		int got;
+		while ((got = file.read(rows, num * m_rec_size)) > 0)
+		{
+			for (int r=0; r<got / m_rec_size; r++)
+			{
+				const uint8_t *rec = rows + r * m_rec_size;
+				uint32_t dt;
+				memcpy(&dt, rec, 4);
+				if (dt && dt >= from_dt && dt <= to_dt)
+					accumRecord(acc, rec);
+			}
+		}
+		file.close();
+	}
+}
+
+
+#endif	// WITH_SD
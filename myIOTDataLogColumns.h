@@ -0,0 +1,44 @@
+//-----------------------------------------------
+// myIOTDataLogColumns.h - datalog column types
+//-----------------------------------------------
+// Split out of myIOTDataLog.h, without any Arduino dependencies,
+// so that host tools (see extras/logtool) decode records from the
+// same definitions as the device.
+
+#pragma once
+
+#include <stdint.h>
+
+
+#define DATA_COLS_MAX			20
+
+	// an arbitrary upper limit
+#define LOG_COL_TYPE_UINT32			0x00000001	// full unsigned 32 bit
+#define LOG_COL_TYPE_UINT16			0x00000002
+#define LOG_COL_TYPE_UINT8			0x00000004
+#define LOG_COL_TYPE_UINT8x10		0x00000008	// 0..2550 stored as 0..255
+
+#define LOG_COL_TYPE_INT32			0x00000010	// signed 32 bit
+#define LOG_COL_TYPE_INT16			0x00000020	// signed 16 bit
+#define LOG_COL_TYPE_INT8			0x00000040	// signed 8 bit
+
+#define LOG_COL_TYPE_FLOAT32		0x00000100	// full 32 bit float (unused)
+
+// For the following the user can use the DEGREE_TYPE to show Centigrade vs Farenheit
+
+#define LOG_COL_TYPE_CENTIGRADE32	0x00001000	// full 32 bit float in Centigrade
+#define LOG_COL_TYPE_CENTIGRADE_RAW	0x00002000	// int16_t 16 bit Centigrade/128 (raw DS18B20 reading)
+#define LOG_COL_TYPE_CENTIGRADE8	0x00004000	// integer Centigrade bias 40; i.e. 40=0C; min=-40C; max=215C,
+
+#define LOG_COL_TYPE_INT16_10	    0x00008000	// -327.6..327.6 stored as x10 int16 integer (used for volts)
+
+
+
+// the tick_intervals are used to determine the
+// min/max and num_ticks in the javascript.
+
+typedef struct {
+	const char *name;			// provided by caller
+	uint32_t type;				// provided by caller
+	float tick_interval;		// provided by caller
+} logColumn_t;
@@ -0,0 +1,724 @@
+//-----------------------------------------------
+// myIOTDataLogCompress.cpp - delta/varint compressed datalogs
+//-----------------------------------------------
+// setCompression() stores the datalog as a sequence of fixed size
+// blocks, so that a backwards iteration can still find the start of
+// each one by seeking.  Each block starts with a keyframe, the whole
+// record, followed by as many records as fit, each encoded relative
+// to the one before it:
+//
+//		tag			varint: 0 = padding to the end of the block
+//							1 = keyframe, the rec_size record follows
+//							2+ = zigzag(dt delta - previous dt delta) + 2
+//		columns		one zigzag varint per column of the difference from
+//					the previous record, modulo the size of the column
+//
+// Records are usually added at a fixed interval, so the dt is a second
+// difference, normally zero, and slowly changing sensor values are small
+// differences, so a typical record takes a byte per column plus one.
+// Column differences are done on the stored bits, which is exact for all
+// the types, but for floats only helps when the value does not change.
+// A record whose deltas would be no smaller than a keyframe is written
+// as one, and resets the dt delta.
+//
+// A record that does not fit in the newest block pads it with zeros and
+// starts the next one, which the append writes in the same single write.
+// The encoder state (the newest record, its dt delta, and the bytes used
+// in the newest block) is recovered from the last block once per boot.
+// A torn append leaves a partial record at the end of the last block,
+// which the decoder stops at, and the recovery pads the block closed.
+//
+// The blocks are decoded into records in the iterator's buffer (see
+// startSDBlocksBackwards()), so sendChartData(), decimation, projection,
+// and the rollups work on records as before. A to_dt ceiling is found
+// by binary searching the keyframes.  Records can not be tombstoned, and
+// the time index, checksums, and segments are not used.  compactFile()
+// and trimBefore() re-encode the datalog into new blocks.
+
+#include "myIOTDataLog.h"
+#include "myIOTLog.h"
+
+#if WITH_SD
+
+#define DEBUG_COMPRESS	0
+
+#define ZBLOCK_MIN		64
+#define ZBLOCK_MAX		1024
+
+#define ZTAG_PAD		0
+#define ZTAG_KEY		1
+#define ZTAG_DELTA		2		// bias of the dt delta tags
+
+#define VARINT_MAX		5		// bytes for a uint32_t
+
+
+
+//------------------------------------
+// varints
+//------------------------------------
+
+static uint32_t zigzag(int32_t v)
+{
+	return ((uint32_t) v << 1) ^ (uint32_t)(v >> 31);
+}
+
+static int32_t unzigzag(uint32_t v)
+{
+	return (int32_t)(v >> 1) ^ -(int32_t)(v & 1);
+}
+
+static int putVarint(uint8_t *out, uint32_t v)
+{
+	int n = 0;
+	while (v >= 0x80)
+	{
+		out[n++] = (uint8_t) v | 0x80;
+		v >>= 7;
+	}
+	out[n++] = (uint8_t) v;
+	return n;
+}
+
+static int getVarint(const uint8_t *in, int len, uint32_t *v)
+	// returns the number of bytes used, or 0 if it runs past len
+{
+	uint32_t val = 0;
+	for (int n=0; n<len && n<VARINT_MAX; n++)
+	{
+		val |= (uint32_t)(in[n] & 0x7f) << (7 * n);
+		if (!(in[n] & 0x80))
+		{
+			*v = val;
+			return n + 1;
+		}
+	}
+	return 0;
+}
+
+static uint32_t getRaw(const uint8_t *p, int size)
+{
+	uint32_t v = 0;
+	memcpy(&v, p, size);	// little endian
+	return v;
+}
+
+static int32_t signExtend(uint32_t v, int size)
+	// the difference of two size byte values as a signed value
+{
+	int shift = 32 - 8 * size;
+	return (int32_t)(v << shift) >> shift;
+}
+
+
+
+//------------------------------------
+// setup
+//------------------------------------
+
+void myIOTDataLog::setCompression(int block_bytes)
+{
+	if (m_seg_type && block_bytes > 0)
+	{
+		LOGW("myIOTDataLog(%s) compression not used with segments",m_name);
+		block_bytes = 0;
+	}
+	if (m_c_recs && block_bytes > 0)
+	{
+		LOGW("myIOTDataLog(%s) compression not used with columnar blocks",m_name);
+		block_bytes = 0;
+	}
+	if (block_bytes > 0)
+	{
+		// at least two keyframes, so that any record fits after one
+
+		int min_bytes = 2 * (1 + m_rec_size);
+		if (min_bytes < ZBLOCK_MIN)
+			min_bytes = ZBLOCK_MIN;
+		if (block_bytes < min_bytes)
+			block_bytes = min_bytes;
+		if (block_bytes > ZBLOCK_MAX)
+			block_bytes = ZBLOCK_MAX;
+		if (m_idx_every)
+		{
+			LOGW("myIOTDataLog(%s) time index disabled for compressed datalog",m_name);
+			setIndexInterval(0);
+		}
+		if (m_crc_every)
+		{
+			LOGW("myIOTDataLog(%s) checksums disabled for compressed datalog",m_name);
+			setChecksums(0);
+		}
+	}
+
+	if (m_z_prev)
+		delete[] m_z_prev;
+	m_z_prev = NULL;
+	m_z_block = block_bytes > 0 ? block_bytes : 0;
+	m_z_valid = false;
+	m_z_fill = 0;
+	m_z_delta = 0;
+
+	if (m_z_block)
+	{
+		m_z_prev = new uint8_t[m_rec_size];
+		memset(m_z_prev, 0, m_rec_size);
+		LOGI("myIOTDataLog(%s) compressed blocks of %d bytes",m_name,m_z_block);
+	}
+}
+
+
+int myIOTDataLog::blockBytes() const
+{
+	return m_c_recs ? colBlockBytes() : m_z_block;
+}
+
+
+int myIOTDataLog::blockMaxRecs() const
+	// the most records a block can hold, all compressed
+	// to a tag and one byte per column
+{
+	return m_c_recs ? m_c_recs : m_z_block / (1 + m_num_cols);
+}
+
+
+int myIOTDataLog::blockBufSize() const
+	// a buffer for a block and the records it decodes to
+{
+	return blockMaxRecs() * m_rec_size + blockBytes();
+}
+
+
+
+//------------------------------------
+// encode and decode
+//------------------------------------
+
+int myIOTDataLog::encodeRecord(const uint8_t *rec, uint8_t *prev, uint32_t *delta, int *fill, uint8_t *out) const
+	// Encodes rec after prev, the newest record, into out, preceded by
+	// the padding that closes the block if it does not fit in it, and
+	// updates the encoder state.  Returns the number of bytes in out,
+	// at most m_z_block + m_rec_size.
+{
+	uint32_t dt = getRaw(rec, 4);
+	uint32_t new_delta = dt - getRaw(prev, 4);
+
+	// a dt delta change too large for a tag makes a keyframe
+
+	uint8_t enc[VARINT_MAX * (1 + DATA_COLS_MAX)];
+	uint32_t dd = zigzag((int32_t)(new_delta - *delta));
+	int len = 0;
+	if (*fill && dd <= 0xffffffff - ZTAG_DELTA)
+	{
+		len = putVarint(enc, dd + ZTAG_DELTA);
+		int offset = 4;
+		for (int i=0; i<m_num_cols; i++)
+		{
+			int size = getColSize(i);
+			uint32_t diff = getRaw(rec + offset, size) - getRaw(prev + offset, size);
+			len += putVarint(enc + len, zigzag(signExtend(diff, size)));
+			offset += size;
+		}
+	}
+
+	bool key = !len || len >= 1 + m_rec_size;
+	if (key)
+		len = 1 + m_rec_size;
+
+	int pad = 0;
+	if (*fill + len > m_z_block)
+	{
+		pad = m_z_block - *fill;
+		memset(out, ZTAG_PAD, pad);
+		*fill = 0;
+		key = true;
+		len = 1 + m_rec_size;
+	}
+
+	if (key)
+	{
+		out[pad] = ZTAG_KEY;
+		memcpy(out + pad + 1, rec, m_rec_size);
+		*delta = 0;
+	}
+	else
+	{
+		memcpy(out + pad, enc, len);
+		*delta = new_delta;
+	}
+
+	*fill += len;
+	memcpy(prev, rec, m_rec_size);
+	return pad + len;
+}
+
+
+int myIOTDataLog::decodeBlock(const uint8_t *in, int len, uint8_t *out, int *used, uint32_t *delta) const
+	// Decodes the records in the first len bytes of a block into out,
+	// stopping at the padding, or at a torn record at the end of the
+	// last block.  Returns the number of records, and if given, the
+	// number of bytes they used, and the dt delta of the last one.
+{
+	int max_recs = blockMaxRecs();
+	int pos = 0;
+	int num = 0;
+	uint32_t d = 0;
+	const uint8_t *prev = NULL;
+
+	while (pos < len && in[pos] != ZTAG_PAD && num < max_recs)
+	{
+		uint8_t *rec = out + num * m_rec_size;
+		uint32_t tag;
+		int n = getVarint(in + pos, len - pos, &tag);
+		if (!n)
+			break;
+
+		if (tag == ZTAG_KEY)
+		{
+			if (pos + n + m_rec_size > len)
+				break;
+			memcpy(rec, in + pos + n, m_rec_size);
+			n += m_rec_size;
+			d = 0;
+		}
+		else
+		{
+			if (!prev)
+				break;	// a block always starts with a keyframe
+
+			uint32_t new_d = d + (uint32_t) unzigzag(tag - ZTAG_DELTA);
+			uint32_t dt = getRaw(prev, 4) + new_d;
+			memcpy(rec, &dt, 4);
+
+			int offset = 4;
+			int i = 0;
+			for (; i<m_num_cols; i++)
+			{
+				uint32_t z;
+				int k = getVarint(in + pos + n, len - pos - n, &z);
+				if (!k)
+					break;
+				n += k;
+				int size = getColSize(i);
+				uint32_t val = getRaw(prev + offset, size) + (uint32_t) unzigzag(z);
+				memcpy(rec + offset, &val, size);
+				offset += size;
+			}
+			if (i < m_num_cols)
+				break;
+			d = new_d;
+		}
+
+		pos += n;
+		prev = rec;
+		num++;
+	}
+
+	if (used)
+		*used = pos;
+	if (delta)
+		*delta = d;
+	return num;
+}
+
+
+//------------------------------------
+// append
+//------------------------------------
+
+bool myIOTDataLog::recoverCompressed()
+	// Re-establishes the encoder state from the newest block,
+	// and pads it closed if the last append to it was torn.
+{
+	m_z_fill = 0;
+	m_z_delta = 0;
+
+	String filename = dataFilename();
+	File file = SD.open(filename.c_str(), FILE_READ);
+	uint32_t size = file ? file.size() : 0;
+	if (!size)
+	{
+		if (file)
+			file.close();
+		m_z_valid = true;
+		return true;
+	}
+
+	uint32_t start = ((size - 1) / m_z_block) * m_z_block;
+	int len = size - start;
+	int buf_size = blockBufSize();
+	uint8_t buf[buf_size];
+	uint8_t *raw = buf + buf_size - m_z_block;
+
+	bool ok = file.seek(start) && file.read(raw, len) == len;
+	file.close();
+	if (!ok)
+	{
+		LOGE("recoverCompressed(%s) could not read the last block",filename.c_str());
+		return false;
+	}
+
+	int used;
+	int num = decodeBlock(raw, len, buf, &used, &m_z_delta);
+	if (num)
+		memcpy(m_z_prev, buf + (num - 1) * m_rec_size, m_rec_size);
+	m_z_fill = num ? len : m_z_block;
+
+	// a complete block can only end with a whole record or padding
+
+	if (used < len && len < m_z_block)
+	{
+		int pad = m_z_block - used;
+		uint8_t zeros[pad];
+		memset(zeros, ZTAG_PAD, pad);
+
+		file = SD.open(filename.c_str(), "r+");
+		ok = file &&
+			file.seek(start + used) &&
+			file.write(zeros, pad) == pad;
+		if (file)
+			file.close();
+
+		LOGW("%s torn record(%d bytes) at %d %s",
+			filename.c_str(), len - used, start + used,
+			ok ? "padded to the end of the block" : "could not be repaired");
+		if (!ok)
+			return false;
+		m_z_fill = m_z_block;
+	}
+
+	#if DEBUG_COMPRESS
+		LOGD("recoverCompressed(%s) block %d has %d records in %d bytes",
+			filename.c_str(), start / m_z_block, num, m_z_fill);
+	#endif
+
+	m_z_valid = true;
+	return true;
+}
+
+
+bool myIOTDataLog::appendCompressed(const uint8_t *recs, int num_recs)
+	// Encodes the records and appends them with a single write,
+	// unless they do not fit in the stack buffer.
+{
+	if (!m_z_valid && !recoverCompressed())
+		return false;
+
+	String filename = dataFilename();
+	File file = SD.open(filename.c_str(), FILE_APPEND);
+	if (!file)
+	{
+		LOGE("Could not open %s for appending",filename.c_str());
+		return false;
+	}
+
+	int max_enc = m_z_block + m_rec_size;
+	int out_size = m_z_block + max_enc;
+	uint8_t out[out_size];
+	int out_fill = 0;
+
+	bool ok = true;
+	for (int i=0; ok && i<num_recs; i++)
+	{
+		if (out_fill + max_enc > out_size)
+		{
+			ok = file.write(out, out_fill) == out_fill;
+			out_fill = 0;
+		}
+		out_fill += encodeRecord(recs + i * m_rec_size, m_z_prev, &m_z_delta, &m_z_fill, out + out_fill);
+	}
+	if (ok && out_fill)
+		ok = file.write(out, out_fill) == out_fill;
+	file.close();
+
+	if (!ok)
+	{
+		// the encoder state is re-established from what was written
+
+		LOGE("Error appending %d records to %s",num_recs,filename.c_str());
+		m_z_valid = false;
+	}
+	return ok;
+}
+
+
+
+//------------------------------------
+// maintenance
+//------------------------------------
+
+bool myIOTDataLog::rewriteCompressed(uint32_t cutoff_dt)
+	// Re-encodes the records with dt >= cutoff_dt into new blocks,
+	// also closing up the blocks padded after torn appends.
+{
+	String filename = dataFilename();
+	String tmpname = "/" + String(m_name) + ".tmp";
+
+	File src = SD.open(filename.c_str(), FILE_READ);
+	if (!src)
+	{
+		LOGE("rewriteCompressed() could not open %s", filename.c_str());
+		return false;
+	}
+
+	if (SD.exists(tmpname.c_str()))
+		SD.remove(tmpname.c_str());
+
+	File dst = SD.open(tmpname.c_str(), FILE_WRITE);
+	if (!dst)
+	{
+		LOGE("rewriteCompressed() could not create %s", tmpname.c_str());
+		src.close();
+		return false;
+	}
+
+	uint8_t read_buf[blockBufSize()];
+	int max_enc = m_z_block + m_rec_size;
+	int out_size = m_z_block + max_enc;
+	uint8_t out[out_size];
+	int out_fill = 0;
+
+	uint8_t prev[m_rec_size];
+	uint32_t delta = 0;
+	int fill = 0;
+	int written = 0;
+	bool ok = true;
+
+	int num;
+	while (ok && (num = readBlock(src, read_buf)) >= 0)
+	{
+		for (int r=0; ok && r<num; r++)
+		{
+			const uint8_t *rec = read_buf + r * m_rec_size;
+			if (getRaw(rec, 4) < cutoff_dt)
+				continue;
+
+			if (out_fill + max_enc > out_size)
+			{
+				ok = dst.write(out, out_fill) == out_fill;
+				out_fill = 0;
+			}
+			out_fill += encodeRecord(rec, prev, &delta, &fill, out + out_fill);
+			written++;
+		}
+		jobYield("rewrite", src.position(), src.size());
+	}
+	if (ok && out_fill)
+		ok = dst.write(out, out_fill) == out_fill;
+
+	src.close();
+	dst.close();
+	m_z_valid = false;
+
+	if (!ok)
+	{
+		LOGE("rewriteCompressed() could not write %s", tmpname.c_str());
+		SD.remove(tmpname.c_str());
+		return false;
+	}
+
+	SD.remove(filename.c_str());
+	if (!SD.rename(tmpname.c_str(), filename.c_str()))
+	{
+		LOGE("rewriteCompressed() rename failed");
+		return false;
+	}
+
+	LOGI("rewriteCompressed(%s cutoff=%u) wrote %d records", filename.c_str(), cutoff_dt, written);
+	return true;
+}
+
+
+//------------------------------------
+// blocks
+//------------------------------------
+// The rest is shared with the columnar layout (myIOTDataLogColumnar.cpp),
+// which stores fixed size blocks of records in the same datalog file.
+
+uint32_t myIOTDataLog::blockFirstDt(File &file, uint32_t block)
+	// returns the dt of the keyframe of a block, or 0 if it
+	// is empty, i.e. a block whose keyframe was torn off
+{
+	if (m_c_recs)
+		return colBlockFirstDt(file, block);
+
+	uint8_t key[5];
+	if (file.seek(block * m_z_block) &&
+		file.read(key, 5) == 5 &&
+		key[0] == ZTAG_KEY)
+		return getRaw(key + 1, 4);
+	return 0;
+}
+
+
+int myIOTDataLog::decodeBlockCB(void *log, const uint8_t *block, int len, uint8_t *recs)
+	// SDDecodeCB for startSDBlocksBackwards()
+{
+	myIOTDataLog *self = (myIOTDataLog *) log;
+	return self->m_c_recs ?
+		self->decodeColBlock(block, len, recs) :
+		self->decodeBlock(block, len, recs, NULL, NULL);
+}
+
+
+int myIOTDataLog::readBlock(File &file, uint8_t *buf)
+	// Reads the next block from the file into the end of a blockBufSize()
+	// buffer and decodes it into records at the start of it.
+	// Returns the number of records, or -1 at the end of the file.
+{
+	int block_bytes = blockBytes();
+	uint8_t *raw = buf + blockBufSize() - block_bytes;
+	int got = file.read(raw, block_bytes);
+	if (got <= 0)
+		return -1;
+	return decodeBlockCB(this, raw, got, buf);
+}
+
+
+uint32_t myIOTDataLog::findBlock(uint32_t dt)
+	// Returns the number of blocks whose first record is at or before dt,
+	// by binary search, which is where a backwards iteration for
+	// records up to dt starts if the datalog is in order.
+	// Empty blocks are included in the iteration.
+{
+	String filename = dataFilename();
+	File file = SD.open(filename.c_str(), FILE_READ);
+	if (!file)
+		return 0;
+
+	int block_bytes = blockBytes();
+	uint32_t lo = 0;
+	uint32_t hi = (file.size() + block_bytes - 1) / block_bytes;
+	while (lo < hi)
+	{
+		uint32_t mid = (lo + hi) / 2;
+		if (blockFirstDt(file, mid) <= dt)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	file.close();
+	return lo;
+}
+
+
+bool myIOTDataLog::feedRollupBlocks(File &file, File *out, bool cascade)
+	// feedRollupsFrom() for the blocks from the file position to the end
+{
+	uint8_t buf[blockBufSize()];
+	int num;
+	while ((num = readBlock(file, buf)) >= 0)
+	{
+		for (int r=0; r<num; r++)
+			feedRollup(0, buf + r * m_rec_size, out, cascade);
+		jobYield("rollups", file.position(), file.size());
+	}
+	return true;
+}
+
+
+typedef struct {
+	uint32_t num_recs;
+	uint32_t first_dt;
+	uint32_t last_dt;
+	uint32_t tombstones;
+	uint32_t out_of_order;
+} blockScan_t;
+
+
+static void scanRecords(blockScan_t *scan, const uint8_t *recs, int num_recs, int rec_size)
+{
+	for (int r=0; r<num_recs; r++)
+	{
+		uint32_t dt = getRaw(recs + r * rec_size, 4);
+		if (!dt)
+		{
+			scan->tombstones++;
+			continue;
+		}
+		if (!scan->num_recs)
+			scan->first_dt = dt;
+		else if (dt < scan->last_dt)
+			scan->out_of_order++;
+		scan->last_dt = dt;
+		scan->num_recs++;
+	}
+}
+
+
+String myIOTDataLog::scanBlocks()
+	// scanFile() for a compressed or columnar datalog reads all of it,
+	// without a checkpoint, and reports the size of the blocks instead
+	// of spikes, which could not be tombstoned anyway.  The tombstones
+	// are the torn records in the open rows of a columnar datalog.
+{
+	flush();
+	uint32_t start_ms = millis();
+
+	blockScan_t scan;
+	memset(&scan, 0, sizeof(scan));
+	uint32_t blocks = 0;
+	uint32_t empty_blocks = 0;
+	uint32_t bytes = 0;
+	int block_bytes = blockBytes();
+
+	String filename = dataFilename();
+	File file = SD.open(filename.c_str(), FILE_READ);
+	if (file)
+	{
+		bytes = file.size();
+		uint8_t buf[blockBufSize()];
+		int num;
+		while ((num = readBlock(file, buf)) >= 0)
+		{
+			blocks++;
+			if (!num)
+				empty_blocks++;
+			scanRecords(&scan, buf, num, m_rec_size);
+		}
+		file.close();
+	}
+
+	uint32_t open_recs = 0;
+	if (m_c_recs)
+	{
+		String open_name = colOpenFilename();
+		file = SD.open(open_name.c_str(), FILE_READ);
+		if (file)
+		{
+			bytes += file.size();
+			uint8_t buf[m_c_recs * m_rec_size];
+			int got;
+			while ((got = file.read(buf, sizeof(buf))) > 0)
+			{
+				scanRecords(&scan, buf, got / m_rec_size, m_rec_size);
+				open_recs += got / m_rec_size;
+			}
+			file.close();
+		}
+	}
+
+	String result = "{";
+	result += "\"num_recs\":"      + String(scan.num_recs)     + ",";
+	result += "\"first_dt\":"      + String(scan.first_dt)     + ",";
+	result += "\"last_dt\":"       + String(scan.last_dt)      + ",";
+	result += "\"tombstones\":"    + String(scan.tombstones)   + ",";
+	result += "\"spikes\":[],";
+	result += "\"out_of_order\":"  + String(scan.out_of_order) + ",";
+	result += "\"block_bytes\":"   + String(block_bytes)       + ",";
+	result += "\"blocks\":"        + String(blocks)            + ",";
+	result += "\"empty_blocks\":"  + String(empty_blocks)      + ",";
+	if (m_c_recs)
+		result += "\"open_recs\":" + String(open_recs)         + ",";
+	result += "\"bytes\":"         + String(bytes)             + ",";
+	result += "\"raw_bytes\":"     + String((scan.num_recs + scan.tombstones) * m_rec_size) + ",";
+	result += "\"pending\":"       + String(m_pend_count)      + ",";
+	result += "\"pending_dropped\":" + String(m_pend_dropped)  + ",";
+	result += "\"needs_compact\":" + String(scan.tombstones > 0 ? "true" : "false") + ",";
+	result += "\"ms\":"            + String(millis() - start_ms);
+	result += "}";
+	return result;
+}
+
+
+#endif	// WITH_SD
@@ -0,0 +1,363 @@
+//-----------------------------------------------
+// myIOTDataLogExport.cpp - CSV and NDJSON export
+//-----------------------------------------------
+// exportData() streams the records in a time window as text for offline
+// analysis, oldest first, with the values decoded as the chart shows them.
+// The lines are built in one buffer on the stack, which is written to the
+// client whenever the next line might not fit, so the memory used does
+// not depend on the length of the export.  Like sendChartData() the
+// response has no content length and ends when the connection closes.
+
+#include "myIOTDataLog.h"
+#include "myIOTDevice.h"
+#include "myIOTLog.h"
+#include "myIOTWebServer.h"
+#include "myIotTempSensor.h"
+#include <math.h>
+
+#define DEBUG_EXPORT	0
+
+#define EXPORT_BUF		1024	// at least two lines
+#define EXPORT_VAL		48		// longest formatted value
+#define EXPORT_TIME		20		// "yyyy-mm-dd hh:mm:ss"
+
+
+struct logExport_t
+{
+	int format;
+	uint32_t cols;			// 0 = all
+	bool fahrenheit;
+	uint32_t from_dt;
+	uint32_t until;
+	char *buf;
+	int size;
+	int len;
+	int max_line;
+	uint32_t count;			// records exported
+	bool ok;				// false once a write has failed
+};
+
+
+static int exportTime(char *out, uint32_t dt)
+	// the local time, as timeToString() but with one space
+{
+	time_t t = dt;
+	struct tm *ts = localtime(&t);
+	return sprintf(out,"%04d-%02d-%02d %02d:%02d:%02d",
+		ts->tm_year + 1900,
+		ts->tm_mon + 1,
+		ts->tm_mday,
+		ts->tm_hour,
+		ts->tm_min,
+		ts->tm_sec);
+}
+
+
+static bool exportFlush(logExport_t *exp)
+{
+	if (exp->ok && exp->len)
+		exp->ok = myiot_web_server->writeBinaryData(exp->buf, exp->len);
+	exp->len = 0;
+	return exp->ok;
+}
+
+
+int myIOTDataLog::exportValue(char *out, int col, const uint8_t *val, int format, bool fahrenheit) const
+	// Formats the value of a column in display units and returns
+	// its length.  A float that is not a number is empty in CSV
+	// and null in NDJSON.
+{
+	uint32_t typ = m_col[col].type;
+	bool temperature =
+		typ == LOG_COL_TYPE_CENTIGRADE32 ||
+		typ == LOG_COL_TYPE_CENTIGRADE_RAW ||
+		typ == LOG_COL_TYPE_CENTIGRADE8;
+
+	if (typ == LOG_COL_TYPE_UINT16)
+	{
+		uint16_t v;
+		memcpy(&v,val,2);
+		return sprintf(out,"%u",v);
+	}
+	if (typ == LOG_COL_TYPE_UINT8)
+		return sprintf(out,"%u",*val);
+	if (typ == LOG_COL_TYPE_UINT8x10)
+		return sprintf(out,"%u",*val * 10);
+	if (typ == LOG_COL_TYPE_INT32)
+	{
+		int32_t v;
+		memcpy(&v,val,4);
+		return sprintf(out,"%d",v);
+	}
+	if (typ == LOG_COL_TYPE_INT16)
+	{
+		int16_t v;
+		memcpy(&v,val,2);
+		return sprintf(out,"%d",v);
+	}
+	if (typ == LOG_COL_TYPE_INT8)
+		return sprintf(out,"%d",(int8_t) *val);
+	if (typ == LOG_COL_TYPE_INT16_10)
+	{
+		int16_t v;
+		memcpy(&v,val,2);
+		return sprintf(out,"%0.1f",v / 10.0);
+	}
+	if (typ != LOG_COL_TYPE_FLOAT32 && !temperature)
+	{
+		uint32_t v;
+		memcpy(&v,val,4);
+		return sprintf(out,"%u",v);
+	}
+
+	float f;
+	if (typ == LOG_COL_TYPE_CENTIGRADE_RAW)
+	{
+		int16_t raw;
+		memcpy(&raw,val,2);
+		f = myIOTTempSensor::rawToDegreesC(raw);
+	}
+	else if (typ == LOG_COL_TYPE_CENTIGRADE8)
+		f = (int) *val - 40;
+	else
+		memcpy(&f,val,4);
+
+	if (isnan(f))
+		return format == LOG_EXPORT_NDJSON ? sprintf(out,"null") : 0;
+	if (temperature && fahrenheit)
+		f = centigradeToFarenheit(f);
+	return sprintf(out,temperature ? "%0.2f" : "%0.3f",f);
+}
+
+
+bool myIOTDataLog::exportRecords(logExport_t *exp, const uint8_t *recs, int num_recs)
+	// adds a line for each of the records in the window
+{
+	bool ndjson = exp->format == LOG_EXPORT_NDJSON;
+	for (int r=0; r<num_recs && exp->ok; r++)
+	{
+		const uint8_t *rec = recs + r * m_rec_size;
+		uint32_t dt;
+		memcpy(&dt,rec,4);
+		if (!dt || dt < exp->from_dt || dt > exp->until)
+			continue;
+
+		if (exp->len + exp->max_line > exp->size && !exportFlush(exp))
+			break;
+
+		char *out = exp->buf + exp->len;
+		char *p = out;
+		p += sprintf(p, ndjson ? "{\"dt\":%u,\"time\":\"" : "%u,", dt);
+		p += exportTime(p, dt);
+		if (ndjson)
+			*p++ = '"';
+
+		int offset = 4;
+		for (int i=0; i<m_num_cols; i++)
+		{
+			int size = getColSize(i);
+			if (!exp->cols || (exp->cols & (1UL << i)))
+			{
+				p += ndjson ?
+					sprintf(p,",\"%s\":",m_col[i].name) :
+					sprintf(p,",");
+				p += exportValue(p, i, rec + offset, exp->format, exp->fahrenheit);
+			}
+			offset += size;
+		}
+
+		if (ndjson)
+			*p++ = '}';
+		*p++ = '\n';
+		exp->len += p - out;
+		exp->count++;
+	}
+	return exp->ok;
+}
+
+
+#if WITH_SD
+
+	bool myIOTDataLog::exportFile(logExport_t *exp, const String &filename, uint32_t from_rec, uint32_t to_rec)
+		// exports the records from_rec..to_rec-1 of a file of whole
+		// records, or to the end of it if to_rec is 0
+	{
+		File file = SD.open(filename.c_str(), FILE_READ);
+		if (!file)
+			return true;
+
+		int buf_size = ((EXPORT_BUF + m_rec_size - 1) / m_rec_size) * m_rec_size;
+		uint8_t buf[buf_size];
+
+		uint32_t pos = from_rec * m_rec_size;
+		uint32_t end = file.size();
+		if (to_rec && to_rec * m_rec_size < end)
+			end = to_rec * m_rec_size;
+
+		bool ok = file.seek(pos);
+		while (ok && pos < end)
+		{
+			int to_read = min((uint32_t) buf_size, end - pos);
+			int got = file.read(buf, to_read);
+			if (got < m_rec_size)
+				break;
+			pos += got;
+			ok = exportRecords(exp, buf, got / m_rec_size);
+		}
+
+		file.close();
+		return exp->ok;
+	}
+
+
+	bool myIOTDataLog::exportBlocks(logExport_t *exp)
+		// Exports the compressed or columnar blocks from the one that
+		// contains from_dt, found by binary search, to the first one
+		// that starts after the window.
+	{
+		uint32_t block = findBlock(exp->from_dt);
+		if (block)
+			block--;
+
+		String filename = dataFilename();
+		File file = SD.open(filename.c_str(), FILE_READ);
+		if (!file)
+			return true;
+
+		uint8_t buf[blockBufSize()];
+		bool ok = file.seek(block * blockBytes());
+		int num;
+		while (ok && (num = readBlock(file, buf)) >= 0)
+		{
+			uint32_t first_dt;
+			memcpy(&first_dt,buf,4);
+			if (num && first_dt > exp->until)
+				break;
+			ok = exportRecords(exp, buf, num);
+		}
+
+		file.close();
+		return exp->ok;
+	}
+
+#endif	// WITH_SD
+
+
+String myIOTDataLog::exportData(uint32_t from_dt, uint32_t to_dt/*=0*/, int format/*=LOG_EXPORT_CSV*/, uint32_t cols/*=0*/, bool fahrenheit/*=false*/)
+{
+	#if WITH_SD
+		logJobLock lock(this);
+		flush();
+	#endif
+
+	#if DEBUG_EXPORT
+		uint32_t start_ms = millis();
+	#endif
+
+	cols = projectCols(cols);
+	bool ndjson = format == LOG_EXPORT_NDJSON;
+
+	// the buffer holds at least two of the longest lines
+
+	int max_line = 32 + EXPORT_TIME;
+	for (int i=0; i<m_num_cols; i++)
+	{
+		if (!cols || (cols & (1UL << i)))
+			max_line += strlen(m_col[i].name) + 4 + EXPORT_VAL;
+	}
+	int size = max(EXPORT_BUF, 2 * max_line);
+	char buf[size];
+
+	logExport_t exp;
+	exp.format = format;
+	exp.cols = cols;
+	exp.fahrenheit = fahrenheit;
+	exp.from_dt = from_dt;
+	exp.until = to_dt ? to_dt : 0xffffffff;
+	exp.buf = buf;
+	exp.size = size;
+	exp.len = 0;
+	exp.max_line = max_line;
+	exp.count = 0;
+	exp.ok = true;
+
+	String disposition = "attachment; filename=\"";
+	disposition += m_name;
+	disposition += ndjson ? ".ndjson\"" : ".csv\"";
+	myiot_web_server->sendHeader("Content-Disposition", disposition);
+	if (!myiot_web_server->startBinaryResponse(
+			ndjson ? "application/x-ndjson" : "text/csv",
+			CONTENT_LENGTH_UNKNOWN))
+		return "";
+
+	if (!ndjson)
+	{
+		char *p = buf;
+		p += sprintf(p,"dt,time");
+		for (int i=0; i<m_num_cols; i++)
+		{
+			if (!cols || (cols & (1UL << i)))
+				p += sprintf(p,",%s",m_col[i].name);
+		}
+		*p++ = '\n';
+		exp.len = p - buf;
+	}
+
+	#if WITH_SD
+
+		if (m_z_block || m_c_recs)
+		{
+			// the open records of a columnar datalog are newer than its blocks
+
+			if (m_c_recs && !m_c_valid)
+				recoverColumnar();
+			if (exportBlocks(&exp) && m_c_recs)
+				exportFile(&exp, colOpenFilename(), 0, 0);
+		}
+		else
+		{
+			// skip the segments that end before the window and stop at the
+			// first that starts after it, and within a file, start at the
+			// time index floor and end at the first record after to_dt
+
+			int num_files = numDataFiles();
+			for (int file_num=0; file_num<num_files && exp.ok; file_num++)
+			{
+				if (m_seg_type)
+				{
+					if (file_num < num_files - 1 && segmentKey(file_num + 1) <= from_dt)
+						continue;
+					if (segmentKey(file_num) > exp.until)
+						break;
+				}
+
+				String filename = dataFilename(file_num);
+				uint32_t from_rec = !m_seg_type && from_dt ? indexFloor(from_dt) : 0;
+				uint32_t to_rec = 0;
+				if (to_dt)
+				{
+					to_rec = findCeiling(filename.c_str(), m_rec_size, to_dt, !m_seg_type);
+					if (to_rec <= from_rec)
+						continue;
+				}
+				exportFile(&exp, filename, from_rec, to_rec);
+			}
+		}
+
+	#else
+
+		for (uint32_t n = 0; n < m_ram_count && exp.ok; n++)
+			exportRecords(&exp, ramRecord(n), 1);
+
+	#endif
+
+	exportFlush(&exp);
+
+	#if DEBUG_EXPORT
+		LOGD("exportData(%s) %s from(%u) to(%u) cols(0x%x) %u records in %u ms%s",
+			m_name,ndjson?"ndjson":"csv",from_dt,to_dt,cols,exp.count,
+			millis() - start_ms,exp.ok?"":" FAILED");
+	#endif
+
+	return exp.ok ? RESPONSE_HANDLED : "";
+}
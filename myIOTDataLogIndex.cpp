@@ -0,0 +1,520 @@
+//-----------------------------------------------
+// myIOTDataLogIndex.cpp - sparse time index sidecar
+//-----------------------------------------------
+// The optional "name.dtidx" file contains a small header followed
+// by one 8 byte entry for every Nth record in the datalog:
+//
+//		uint32_t dt			dt of the record at idx (0 if it was a tombstone)
+//		uint32_t idx		record number in the datalog (a multiple of N)
+//
+// The backwards iterator stops at the newest record with dt < cutoff,
+// so ANY entry with 0 < dt < cutoff is a safe floor for it, and the binary
+// search only ever returns such an entry.  If the datalog contains out of
+// order records (clock spikes) the search may return an earlier entry than
+// it could have, which costs some reading, but never loses records.
+//
+// Tombstones do not move records, so they do not affect the index.
+// compactFile() and trimBefore() do move them, so they remove the index,
+// which is then rebuilt from the datalog the next time it is needed.
+// The index is also verified against the datalog once per boot and
+// rebuilt if it does not match (i.e. a power loss between the two writes).
+
+#include "myIOTDataLog.h"
+#include "myIOTLog.h"
+
+#if WITH_SD
+
+#define DEBUG_INDEX		0
+
+#define CEIL_CHECK_RECS		64		// records checked after the ceiling
+
+#define DTIDX_MAGIC		0x58444954		// "TIDX"
+#define DTIDX_VERSION	1
+
+typedef struct {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t rec_size;
+	uint32_t every;
+	uint32_t reserved;
+} dtidxHeader_t;
+
+typedef struct {
+	uint32_t dt;
+	uint32_t idx;
+} dtidxEntry_t;
+
+
+
+String myIOTDataLog::indexFilename()
+{
+	String filename = "/";
+	filename += m_name;
+	filename += ".dtidx";
+	return filename;
+}
+
+
+void myIOTDataLog::setIndexInterval(int every_n_recs)
+{
+	if (m_seg_type && every_n_recs > 0)
+	{
+		LOGW("myIOTDataLog(%s) time index not used with segments",m_name);
+		every_n_recs = 0;
+	}
+	if (m_z_block && every_n_recs > 0)
+	{
+		LOGW("myIOTDataLog(%s) time index not used with compression",m_name);
+		every_n_recs = 0;
+	}
+	if (m_c_recs && every_n_recs > 0)
+	{
+		LOGW("myIOTDataLog(%s) time index not used with columnar blocks",m_name);
+		every_n_recs = 0;
+	}
+	m_idx_every = every_n_recs > 0 ? every_n_recs : 0;
+	m_idx_valid = false;
+	m_idx_count = 0;
+}
+
+
+void myIOTDataLog::invalidateIndex()
+{
+	m_idx_valid = false;
+	m_idx_count = 0;
+	String idxname = indexFilename();
+	if (SD.exists(idxname.c_str()))
+		SD.remove(idxname.c_str());
+}
+
+
+//-----------------------------------------
+// rebuildIndex()
+//-----------------------------------------
+
+bool myIOTDataLog::rebuildIndex()
+{
+	m_idx_valid = false;
+	m_idx_count = 0;
+
+	String filename = dataFilename();
+	String idxname = indexFilename();
+	uint32_t start_ms = millis();
+
+	if (SD.exists(idxname.c_str()))
+		SD.remove(idxname.c_str());
+
+	File idx_file = SD.open(idxname.c_str(), FILE_WRITE);
+	if (!idx_file)
+	{
+		LOGE("rebuildIndex() could not create %s", idxname.c_str());
+		return false;
+	}
+
+	dtidxHeader_t hdr;
+	hdr.magic    = DTIDX_MAGIC;
+	hdr.version  = DTIDX_VERSION;
+	hdr.rec_size = m_rec_size;
+	hdr.every    = m_idx_every;
+	hdr.reserved = 0;
+	bool ok = idx_file.write((uint8_t *)&hdr, sizeof(hdr)) == sizeof(hdr);
+
+	File file = SD.open(filename.c_str(), FILE_READ);
+	if (ok && file)
+	{
+		#define IDX_BASE_BUF  1024
+		int buf_size = ((IDX_BASE_BUF + m_rec_size - 1) / m_rec_size) * m_rec_size;
+		uint8_t read_buf[buf_size];
+
+		#define IDX_WRITE_ENTRIES 64
+		dtidxEntry_t entries[IDX_WRITE_ENTRIES];
+		int num_entries = 0;
+
+		uint32_t rec_idx = 0;
+		int got;
+		while (ok && (got = file.read(read_buf, buf_size)) > 0)
+		{
+			int recs = got / m_rec_size;		// ignore partial trailing bytes
+			for (int r = 0; r < recs; r++, rec_idx++)
+			{
+				if (rec_idx % m_idx_every == 0)
+				{
+					memcpy(&entries[num_entries].dt, read_buf + r * m_rec_size, 4);
+					entries[num_entries].idx = rec_idx;
+					num_entries++;
+					m_idx_count++;
+					if (num_entries == IDX_WRITE_ENTRIES)
+					{
+						int bytes = num_entries * sizeof(dtidxEntry_t);
+						ok = idx_file.write((uint8_t *)entries, bytes) == bytes;
+						num_entries = 0;
+					}
+				}
+			}
+		}
+
+		if (ok && num_entries)
+		{
+			int bytes = num_entries * sizeof(dtidxEntry_t);
+			ok = idx_file.write((uint8_t *)entries, bytes) == bytes;
+		}
+	}
+
+	if (file)
+		file.close();
+	idx_file.close();
+
+	if (!ok)
+	{
+		LOGE("rebuildIndex() error writing %s", idxname.c_str());
+		SD.remove(idxname.c_str());
+		m_idx_count = 0;
+		return false;
+	}
+
+	m_idx_valid = true;
+	LOGI("rebuildIndex(%s) %d entries every %d recs in %u ms",
+		 m_name, m_idx_count, m_idx_every, (uint32_t) (millis() - start_ms));
+	return true;
+}
+
+
+//-----------------------------------------
+// validateIndex()
+//-----------------------------------------
+
+bool myIOTDataLog::validateIndex(uint32_t num_recs)
+	// Called once per boot (or after invalidation) with the
+	// number of records in the datalog.  Checks the header and
+	// number of entries and rebuilds the index if they do not match.
+{
+	if (m_idx_valid)
+		return true;
+
+	String idxname = indexFilename();
+	File idx_file = SD.open(idxname.c_str(), FILE_READ);
+	if (!idx_file)
+		return rebuildIndex();
+
+	uint32_t expected = num_recs ? (num_recs - 1) / m_idx_every + 1 : 0;
+
+	dtidxHeader_t hdr;
+	dtidxEntry_t last;
+	last.dt = 0;
+	last.idx = 0;
+
+	bool ok =
+		idx_file.read((uint8_t *)&hdr, sizeof(hdr)) == sizeof(hdr) &&
+		hdr.magic    == DTIDX_MAGIC &&
+		hdr.version  == DTIDX_VERSION &&
+		hdr.rec_size == m_rec_size &&
+		hdr.every    == (uint32_t) m_idx_every &&
+		idx_file.size() == sizeof(hdr) + expected * sizeof(dtidxEntry_t);
+
+	if (ok && expected)
+	{
+		ok = idx_file.seek(sizeof(hdr) + (expected - 1) * sizeof(dtidxEntry_t)) &&
+			 idx_file.read((uint8_t *)&last, sizeof(last)) == sizeof(last) &&
+			 last.idx == (expected - 1) * m_idx_every;
+	}
+	idx_file.close();
+
+	if (!ok)
+	{
+		LOGW("validateIndex(%s) stale index; rebuilding",m_name);
+		return rebuildIndex();
+	}
+
+	m_idx_count = expected;
+	m_idx_valid = true;
+
+	#if DEBUG_INDEX
+		LOGD("validateIndex(%s) ok %d entries",m_name,m_idx_count);
+	#endif
+	return true;
+}
+
+
+//-----------------------------------------
+// indexRecords()
+//-----------------------------------------
+
+void myIOTDataLog::indexRecords(uint32_t first_idx, const uint8_t *recs, int num_recs)
+	// Called by appendRecords() after num_recs records, starting at
+	// record first_idx, have been appended to the datalog.  If the
+	// index had to be rebuilt it already has entries for them.
+{
+	if (!m_idx_valid && !validateIndex(first_idx))
+		return;
+
+	String idxname = indexFilename();
+	File idx_file;
+	bool ok = true;
+
+	for (int r = 0; ok && r < num_recs; r++)
+	{
+		uint32_t idx = first_idx + r;
+		if (idx % m_idx_every || idx / m_idx_every < m_idx_count)
+			continue;
+
+		if (!idx_file)
+		{
+			idx_file = SD.open(idxname.c_str(), FILE_APPEND);
+			if (!idx_file)
+			{
+				ok = false;
+				break;
+			}
+		}
+
+		dtidxEntry_t entry;
+		memcpy(&entry.dt, recs + r * m_rec_size, 4);
+		entry.idx = idx;
+		ok = idx_file.write((uint8_t *)&entry, sizeof(entry)) == sizeof(entry);
+		if (ok)
+		{
+			m_idx_count++;
+			#if DEBUG_INDEX
+				LOGD("indexRecords(%s) entry(%d) idx(%d) dt=%s",
+					m_name, m_idx_count - 1, idx, timeToString(entry.dt).c_str());
+			#endif
+		}
+	}
+
+	if (idx_file)
+		idx_file.close();
+
+	if (!ok)
+	{
+		LOGE("indexRecords() could not append to %s", idxname.c_str());
+		m_idx_valid = false;
+	}
+}
+
+
+//-----------------------------------------
+// indexFloor()
+//-----------------------------------------
+
+uint32_t myIOTDataLog::indexFloor(uint32_t cutoff)
+	// Binary search for the last entry with 0 < dt < cutoff.
+	// The backwards iteration would stop at or above that entry's
+	// record, so it need not read below it.  Tombstoned entries (dt==0)
+	// are treated as if they were after the cutoff.
+{
+	if (!m_idx_every)
+		return 0;
+
+	if (!m_idx_valid)
+	{
+		File file = SD.open(dataFilename().c_str(), FILE_READ);
+		if (!file)
+			return 0;
+		uint32_t num_recs = file.size() / m_rec_size;
+		file.close();
+		if (!validateIndex(num_recs))
+			return 0;
+	}
+
+	if (!m_idx_count)
+		return 0;
+
+	File idx_file = SD.open(indexFilename().c_str(), FILE_READ);
+	if (!idx_file)
+	{
+		m_idx_valid = false;
+		return 0;
+	}
+
+	uint32_t floor_rec = 0;
+	int32_t lo = 0;
+	int32_t hi = m_idx_count - 1;
+	while (lo <= hi)
+	{
+		int32_t mid = (lo + hi) / 2;
+		dtidxEntry_t entry;
+		if (!idx_file.seek(sizeof(dtidxHeader_t) + mid * sizeof(dtidxEntry_t)) ||
+			idx_file.read((uint8_t *)&entry, sizeof(entry)) != sizeof(entry))
+		{
+			LOGE("indexFloor() error reading entry(%d)",mid);
+			floor_rec = 0;
+			break;
+		}
+		if (entry.dt && entry.dt < cutoff)
+		{
+			floor_rec = entry.idx;
+			lo = mid + 1;
+		}
+		else
+			hi = mid - 1;
+	}
+	idx_file.close();
+
+	#if DEBUG_INDEX
+		LOGD("indexFloor(%s,%s) = %d",m_name,timeToString(cutoff).c_str(),floor_rec);
+	#endif
+	return floor_rec;
+}
+
+
+//-----------------------------------------
+// findFloor()
+//-----------------------------------------
+
+uint32_t myIOTDataLog::findFloor(uint32_t cutoff)
+{
+	if (m_idx_every)
+		return indexFloor(cutoff);
+
+	File file = SD.open(dataFilename().c_str(), FILE_READ);
+	if (!file)
+		return 0;
+
+	#define FLOOR_BASE_BUF  1024
+	int buf_size = ((FLOOR_BASE_BUF + m_rec_size - 1) / m_rec_size) * m_rec_size;
+	uint8_t read_buf[buf_size];
+
+	bool found = false;
+	uint32_t floor_rec = 0;
+	int32_t read_pos = (file.size() / m_rec_size) * m_rec_size;
+	while (read_pos > 0 && !found)
+	{
+		int read_bytes = read_pos < buf_size ? read_pos : buf_size;
+		read_pos -= read_bytes;
+		if (!file.seek(read_pos) ||
+			file.read(read_buf, read_bytes) != read_bytes)
+		{
+			LOGE("findFloor() error reading at %d",read_pos);
+			break;
+		}
+		for (int r = read_bytes / m_rec_size - 1; r >= 0; r--)
+		{
+			uint32_t dt;
+			memcpy(&dt, read_buf + r * m_rec_size, 4);
+			if (dt && dt < cutoff)
+			{
+				floor_rec = read_pos / m_rec_size + r;
+				found = true;
+				break;
+			}
+		}
+	}
+
+	file.close();
+	return floor_rec;
+}
+
+
+//-----------------------------------------
+// findCeiling()
+//-----------------------------------------
+
+uint32_t myIOTDataLog::findCeiling(const char *filename, int rec_size, uint32_t to_dt, bool use_index)
+	// Binary search for the first record with dt > to_dt, narrowed down
+	// by the index first if use_index and there is one.  Tombstones are
+	// treated as if they were before to_dt.
+	//
+	// Unlike indexFloor(), this is only right if the records are in order.
+	// A forward clock spike at a probe sends the search left, so that the
+	// records after the spike that are still before to_dt would not be
+	// sent.  So if the scan checkpoint reports out of order records, or
+	// any of the CEIL_CHECK_RECS records after the ceiling is at
+	// or before to_dt, the whole file is searched from the end instead.
+	// A longer spike that the datalog has not been scanned for since it
+	// was added can still hide the records after it.
+{
+	File file = SD.open(filename, FILE_READ);
+	if (!file)
+		return 0;
+
+	uint32_t num_recs = file.size() / rec_size;
+	if (scanFoundSpikes())
+	{
+		file.close();
+		return num_recs;
+	}
+	uint32_t lo = 0;
+	uint32_t hi = num_recs;
+
+	if (use_index && m_idx_every && validateIndex(num_recs) && m_idx_count)
+	{
+		File idx_file = SD.open(indexFilename().c_str(), FILE_READ);
+		uint32_t elo = 0;
+		uint32_t ehi = m_idx_count;
+		while (idx_file && elo < ehi)
+		{
+			uint32_t mid = (elo + ehi) / 2;
+			dtidxEntry_t entry;
+			if (!idx_file.seek(sizeof(dtidxHeader_t) + mid * sizeof(dtidxEntry_t)) ||
+				idx_file.read((uint8_t *)&entry, sizeof(entry)) != sizeof(entry))
+			{
+				LOGE("findCeiling() error reading entry(%d)",mid);
+				elo = 0;
+				ehi = m_idx_count;
+				break;
+			}
+			if (entry.dt > to_dt)
+				ehi = mid;
+			else
+				elo = mid + 1;
+		}
+		if (idx_file)
+			idx_file.close();
+
+		// the ceiling is after entry elo-1 and at or before entry elo
+
+		if (elo > 0)
+			lo = (elo - 1) * m_idx_every + 1;
+		if (elo < m_idx_count)
+			hi = elo * m_idx_every;
+	}
+
+	while (lo < hi)
+	{
+		uint32_t mid = (lo + hi) / 2;
+		uint32_t dt;
+		if (!file.seek(mid * rec_size) ||
+			file.read((uint8_t *)&dt, 4) != 4)
+		{
+			LOGE("findCeiling() error reading at %d",mid * rec_size);
+			hi = num_recs;
+			break;
+		}
+		if (dt > to_dt)
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+
+	// the records just after the ceiling should all be after to_dt
+
+	for (uint32_t r = hi; r < num_recs && r < hi + CEIL_CHECK_RECS; r++)
+	{
+		uint32_t dt;
+		if (!file.seek(r * rec_size) ||
+			file.read((uint8_t *)&dt, 4) != 4)
+		{
+			LOGE("findCeiling() error reading at %d",r * rec_size);
+			hi = num_recs;
+			break;
+		}
+		if (dt && dt <= to_dt)
+		{
+			#if DEBUG_INDEX
+				LOGD("findCeiling(%s) record %d is out of order",filename,r);
+			#endif
+			hi = num_recs;
+			break;
+		}
+	}
+
+	file.close();
+
+	#if DEBUG_INDEX
+		LOGD("findCeiling(%s,%s) = %d/%d",filename,timeToString(to_dt).c_str(),hi,num_recs);
+	#endif
+	return hi;
+}
+
+
+#endif	// WITH_SD
@@ -0,0 +1,414 @@
+//-----------------------------------------------
+// myIOTDataLogJob.cpp - maintenance on a background task
+//-----------------------------------------------
+// startJob() runs compactFile(), trimBefore(), tombstoneByDt(),
+// tombstoneRange(), tombstoneIndices(), or rebuildRollups() on a task on
+// the other core instead of in the HTTP handler, so that the loop task
+// keeps serving the web pages, the WebSocket, and the device.  There is
+// one job at a time, for any datalog.  The tombstones rebuild the rollups
+// on the job task too.
+//
+// The job does not change how they work.  Their loops call jobYield()
+// once per buffer, which, every LOG_JOB_SLICE_MS, gives the job lock to
+// the readers of the datalog (sendChartData(), scanFile(), getColStats(),
+// and verifyFile()) that are waiting for it, and takes it back.  The
+// readers only take it while a job is running on their datalog, so
+// otherwise they cost nothing, and they never see a file that is being
+// replaced.  The data files are only replaced by a rename at the end of
+// a rewrite, so a chart between slices shows the records as they were,
+// or, while tombstoning, without some of the deleted ones yet.  With
+// segments, each one is renamed when it is done, so a chart may show
+// some of them compacted and others not.  The
+// rollups are being rebuilt after a rewrite, so a chart does not use
+// them while a job is running.
+//
+// Appends do not wait for the lock.  While the job is running, addRecord()
+// keeps the records in the pending queue, as for myIOTDevice::m_suppress_log,
+// and the next addRecord(), flush(), or loop() appends them, in order,
+// once the job task has cleared m_job_busy at the end of the job.
+// The other maintenance methods refuse to run on a datalog with a job.
+//
+// The writer task of a datalog with a queue (myIOTDataLogQueue.cpp)
+// takes the same lock to append, so it is a recursive mutex, and it is
+// taken by the readers and maintenance methods of such a datalog even
+// when there is no job.  While a job is running, the writer keeps the
+// records pending, as addRecord() would have, until the pending queue
+// is full, and then leaves them in the ring until the job is done.
+//
+// Records that fit in neither are dropped, and jobStatus() reports how
+// many were during the job.
+
+#include "myIOTDataLog.h"
+#include "myIOTDevice.h"
+#include "myIOTLog.h"
+
+#if WITH_SD
+
+#define DEBUG_JOB	0
+
+#define JOB_STACK			8192	// the rewrite buffers are on the stack
+#define JOB_BROADCAST_MS	1000	// progress over the WebSocket
+
+#define JOB_IDLE		0
+#define JOB_QUEUED		1
+#define JOB_RUNNING		2
+#define JOB_DONE		3
+#define JOB_FAILED		4
+
+typedef struct {
+	myIOTDataLog *log;
+	int type;
+	uint32_t dt;
+	uint32_t *indices;				// owned by the job, for the tombstone jobs
+	int num_indices;
+	uint32_t id;
+	volatile int state;
+	const char *volatile phase;
+	volatile uint32_t done;			// progress through the phase
+	volatile uint32_t total;
+	volatile uint32_t slices;
+	volatile uint32_t max_slice_ms;
+	uint32_t start_ms;
+	volatile uint32_t end_ms;
+	bool reported;					// loop() has logged and broadcast the end
+	uint32_t dropped_before;		// records the datalog had dropped at the start
+} logJob_t;
+
+static logJob_t s_job;
+static QueueHandle_t s_job_queue = NULL;
+static SemaphoreHandle_t s_job_lock = NULL;
+static TaskHandle_t s_job_task = NULL;
+static uint32_t s_slice_start;
+static uint32_t s_job_broadcast_ms;
+
+
+static const char *jobTypeName(int type)
+{
+	return
+		type == LOG_JOB_COMPACT ? "compact" :
+		type == LOG_JOB_TRIM ? "trim" :
+		type == LOG_JOB_TOMBSTONE ? "tombstone" :
+		type == LOG_JOB_TOMBSTONE_RANGE ? "tombstone_range" :
+		type == LOG_JOB_TOMBSTONE_INDICES ? "tombstone_indices" :
+		type == LOG_JOB_ROLLUPS ? "rollups" : "none";
+}
+
+
+static const char *jobStateName(int state)
+{
+	return
+		state == JOB_QUEUED ? "queued" :
+		state == JOB_RUNNING ? "running" :
+		state == JOB_DONE ? "done" :
+		state == JOB_FAILED ? "failed" : "idle";
+}
+
+
+static bool onJobTask()
+{
+	return s_job_task && xTaskGetCurrentTaskHandle() == s_job_task;
+}
+
+
+static void endSlice()
+{
+	uint32_t ms = millis() - s_slice_start;
+	if (ms > s_job.max_slice_ms)
+		s_job.max_slice_ms = ms;
+	s_job.slices++;
+}
+
+
+void myIOTDataLog::jobTask(void *param)
+{
+	while (1)
+	{
+		logJob_t *job;
+		if (xQueueReceive(s_job_queue, &job, portMAX_DELAY) == pdTRUE)
+		{
+			xSemaphoreTakeRecursive(s_job_lock, portMAX_DELAY);
+			s_slice_start = millis();
+			job->state = JOB_RUNNING;
+
+			myIOTDataLog *log = job->log;
+			bool ok =
+				job->type == LOG_JOB_COMPACT ? log->compactFile() :
+				job->type == LOG_JOB_TRIM ? log->trimBefore(job->dt) :
+				job->type == LOG_JOB_TOMBSTONE ? log->tombstoneByDt(job->dt) :
+				job->type == LOG_JOB_TOMBSTONE_RANGE ? log->tombstoneRange(job->indices[0], job->indices[1]) :
+				job->type == LOG_JOB_TOMBSTONE_INDICES ? log->tombstoneIndices(job->indices, job->num_indices) :
+				log->rebuildRollups();
+			delete[] job->indices;
+			job->indices = NULL;
+
+			// the datalog is no longer busy as soon as the job is done,
+			// whether or not its loop() is called
+
+			endSlice();
+			job->end_ms = millis();
+			job->state = ok ? JOB_DONE : JOB_FAILED;
+			job->log->m_job_busy = false;
+			xSemaphoreGiveRecursive(s_job_lock);
+		}
+	}
+}
+
+
+bool myIOTDataLog::initJobLock()
+	// from setup(), by setQueue(), or from the loop task by startJob()
+{
+	if (!s_job_lock)
+		s_job_lock = xSemaphoreCreateRecursiveMutex();
+	if (!s_job_lock)
+		LOGE("initJobLock() could not create mutex");
+	return s_job_lock != NULL;
+}
+
+
+bool myIOTDataLog::initJobTask()
+{
+	if (s_job_queue)
+		return true;
+
+	s_job_queue = xQueueCreate(1, sizeof(logJob_t *));
+	if (!s_job_queue)
+	{
+		LOGE("initJobTask() could not create queue");
+		return false;
+	}
+
+	LOGI("starting dataLogJob task pinned to core %d",ESP32_CORE_OTHER);
+	xTaskCreatePinnedToCore(
+		jobTask,
+		"dataLogJob",
+		JOB_STACK,
+		NULL,
+		1,		// priority
+		&s_job_task,
+		ESP32_CORE_OTHER);
+	return true;
+}
+
+
+
+//------------------------------------
+// the job
+//------------------------------------
+
+bool myIOTDataLog::startJob(int job_type, uint32_t dt/*=0*/)
+{
+	bool with_dt = job_type == LOG_JOB_TRIM || job_type == LOG_JOB_TOMBSTONE;
+	if ((!with_dt && job_type != LOG_JOB_COMPACT && job_type != LOG_JOB_ROLLUPS) ||
+		(with_dt && !dt))
+	{
+		LOGE("startJob(%s) bad job(%d) dt(%u)",m_name,job_type,dt);
+		return false;
+	}
+	return queueJob(job_type, dt, NULL, 0);
+}
+
+
+bool myIOTDataLog::startJob(int job_type, const uint32_t *indices, int num_indices)
+{
+	if (!indices ||
+		(job_type == LOG_JOB_TOMBSTONE_RANGE ?
+			num_indices != 2 || indices[1] < indices[0] :
+		 job_type == LOG_JOB_TOMBSTONE_INDICES ?
+			num_indices <= 0 :
+			true))
+	{
+		LOGE("startJob(%s) bad job(%d) num_indices(%d)",m_name,job_type,num_indices);
+		return false;
+	}
+	uint32_t *copy = new uint32_t[num_indices];
+	memcpy(copy, indices, num_indices * sizeof(uint32_t));
+	return queueJob(job_type, 0, copy, num_indices);
+}
+
+
+bool myIOTDataLog::queueJob(int job_type, uint32_t dt, uint32_t *indices, int num_indices)
+	// takes ownership of the indices
+{
+	if (s_job.state == JOB_QUEUED || s_job.state == JOB_RUNNING)
+	{
+		LOGW("startJob(%s,%s) %s is still busy with %s",
+			m_name,jobTypeName(job_type),
+			s_job.log->m_name,jobTypeName(s_job.type));
+		delete[] indices;
+		return false;
+	}
+	if (!initJobLock() || !initJobTask())
+	{
+		delete[] indices;
+		return false;
+	}
+
+	// buffered records go to the file first, and later ones
+	// are pending until the job is done
+
+	flush();
+	m_job_busy = true;
+
+	s_job.log = this;
+	s_job.type = job_type;
+	s_job.dt = dt;
+	s_job.indices = indices;
+	s_job.num_indices = num_indices;
+	s_job.id++;
+	s_job.phase = "";
+	s_job.done = 0;
+	s_job.total = 0;
+	s_job.slices = 0;
+	s_job.max_slice_ms = 0;
+	s_job.start_ms = millis();
+	s_job.end_ms = 0;
+	s_job.reported = false;
+	s_job.dropped_before = m_pend_dropped + m_q_overruns;
+	s_job.state = JOB_QUEUED;
+	s_job_broadcast_ms = 0;
+
+	LOGI("startJob(%s) %d %s dt(%u)",m_name,s_job.id,jobTypeName(job_type),dt);
+
+	logJob_t *job = &s_job;
+	xQueueSend(s_job_queue, &job, portMAX_DELAY);
+	return true;
+}
+
+
+void myIOTDataLog::jobYield(const char *phase, uint32_t done, uint32_t total)
+{
+	if (!onJobTask())
+		return;
+
+	s_job.phase = phase;
+	s_job.done = done;
+	s_job.total = total;
+	if (millis() - s_slice_start < LOG_JOB_SLICE_MS)
+		return;
+
+	// the mutex does not queue, so a reader that is waiting
+	// for it gets it during the delay
+
+	endSlice();
+	xSemaphoreGiveRecursive(s_job_lock);
+	vTaskDelay(1);
+	xSemaphoreTakeRecursive(s_job_lock, portMAX_DELAY);
+	s_slice_start = millis();
+}
+
+
+uint32_t myIOTDataLog::jobDropped()
+	// records dropped by the datalog since the last job started
+{
+	myIOTDataLog *log = s_job.log;
+	return log ? log->m_pend_dropped + log->m_q_overruns - s_job.dropped_before : 0;
+}
+
+
+String myIOTDataLog::jobStatus()
+{
+	int state = s_job.state;
+	uint32_t total = s_job.total;
+	uint32_t done = s_job.done;
+	int progress =
+		state == JOB_DONE ? 100 :
+		total ? (int)(((uint64_t) done * 100) / total) : 0;
+	uint32_t end_ms = s_job.end_ms;
+	uint32_t ms =
+		state == JOB_IDLE ? 0 :
+		end_ms ? end_ms - s_job.start_ms :
+		millis() - s_job.start_ms;
+
+	String result = "{";
+	result += "\"job\":"          + String(s_job.id)                          + ",";
+	result += "\"name\":\""       + String(s_job.log ? s_job.log->m_name : "") + "\",";
+	result += "\"type\":\""       + String(jobTypeName(s_job.type))           + "\",";
+	result += "\"dt\":"           + String(s_job.dt)                          + ",";
+	result += "\"state\":\""      + String(jobStateName(state))               + "\",";
+	result += "\"phase\":\""      + String(state == JOB_IDLE ? "" : s_job.phase) + "\",";
+	result += "\"progress\":"     + String(progress)                          + ",";
+	result += "\"slices\":"       + String(s_job.slices)                      + ",";
+	result += "\"max_slice_ms\":" + String(s_job.max_slice_ms)                + ",";
+	result += "\"pending\":"      + String(s_job.log ? s_job.log->m_pend_count : 0) + ",";
+	result += "\"dropped\":"      + String(jobDropped())                      + ",";
+	result += "\"ms\":"           + String(ms);
+	result += "}";
+	return result;
+}
+
+
+void myIOTDataLog::loopJob()
+	// Called by loop() to broadcast the progress of a job on this
+	// datalog, and its end.  The job task clears m_job_busy, so that
+	// the pending records are appended even if loop() is not called.
+{
+	if (s_job.log != this || s_job.reported)
+		return;
+	int state = s_job.state;
+	bool finished = state == JOB_DONE || state == JOB_FAILED;
+	uint32_t now = millis();
+	if (!finished && now - s_job_broadcast_ms < JOB_BROADCAST_MS)
+		return;
+	s_job_broadcast_ms = now;
+
+	if (finished)
+	{
+		s_job.reported = true;
+		LOGI("myIOTDataLog(%s) job %d %s %s in %d ms, %d slices, longest %d ms",
+			m_name,s_job.id,jobTypeName(s_job.type),jobStateName(state),
+			s_job.end_ms - s_job.start_ms,s_job.slices,s_job.max_slice_ms);
+		uint32_t dropped = jobDropped();
+		if (dropped)
+			LOGW("myIOTDataLog(%s) dropped %u records during job %d; use a larger setPendingSize() or setQueue()",
+				m_name,dropped,s_job.id);
+	}
+
+	#if WITH_WS
+		String msg = "{\"datalog_job\":" + jobStatus() + "}";
+		my_iot_device->wsBroadcast(msg.c_str());
+	#endif
+
+	#if DEBUG_JOB
+		LOGD("loopJob(%s) %s",m_name,jobStatus().c_str());
+	#endif
+}
+
+
+
+//------------------------------------
+// the datalog while it runs
+//------------------------------------
+
+bool myIOTDataLog::maintaining() const
+	// records are kept pending
+{
+	return myIOTDevice::m_suppress_log || m_job_busy;
+}
+
+
+bool myIOTDataLog::jobRefused(const char *what)
+	// maintenance called directly while a job is running on this datalog
+{
+	if (!m_job_busy || onJobTask())
+		return false;
+	LOGE("%s(%s) not allowed while job %d is running",what,m_name,s_job.id);
+	return true;
+}
+
+
+logJobLock::logJobLock(const myIOTDataLog *log)
+{
+	m_locked = (log->jobBusy() || log->hasQueue()) && !onJobTask();
+	if (m_locked)
+		xSemaphoreTakeRecursive(s_job_lock, portMAX_DELAY);
+}
+
+
+logJobLock::~logJobLock()
+{
+	if (m_locked)
+		xSemaphoreGiveRecursive(s_job_lock);
+}
+
+
+#endif	// WITH_SD
@@ -0,0 +1,291 @@
+//-----------------------------------------------
+// myIOTDataLogQueue.cpp - a sample queue in front of the datalog
+//-----------------------------------------------
+// Without a queue, addRecord() appends the record, or flushes the
+// write-behind buffer, on the task that calls it, which then waits
+// for the SD card, sometimes for tens of ms.  setQueue() puts a ring
+// of records in front of the datalog instead:
+//
+//		addRecord()		stamps the dt, hands the record to the WebSocket
+//						live tail, copies it into the ring at m_q_head,
+//						and returns.  If the ring is full, the record is
+//						dropped and counted in m_q_overruns.
+//		writer task		on ESP32_CORE_OTHER, for all of the queued
+//						datalogs, takes the records at m_q_tail, with one
+//						writeRecords() for each contiguous run of them in
+//						the ring, and does the flushes of loop().  It does
+//						not touch the WebSockets.
+//
+// The ring has one producer and one consumer, so it needs no lock.
+// The head and tail are free running counts, each written by only one
+// side, with a release store after the copy into or out of the ring,
+// and an acquire load of the other side's count.  The capacity is a
+// power of two so that they wrap with it.  The consumer is the writer
+// task, or flush() on another task, and both hold the job lock while
+// they drain it.  The producer must be one task.
+//
+// The producer wakes the writer when the depth reaches the batch size.
+// The writer otherwise wakes every QUEUE_POLL_MS, and drains the ring
+// once flush_ms has elapsed since it was last seen empty or drained, so
+// that the records are appended in batches.
+//
+// The writer holds the job lock while it appends, and the readers of the
+// datalog hold it while they read, so a long chart request holds up the
+// writer, and the ring must be large enough for the records added in the
+// meantime.  getQueueHigh() shows how close it has come.
+//
+// During maintenance, i.e. while a job from startJob() is running, the
+// writer moves the records to the pending queue (see setPendingSize())
+// as usual until it is full, and then leaves them in the ring, so that
+// between them they hold the records added during the job, which are
+// appended once it is done.  Together they must be large enough for the
+// longest job.
+
+#include "myIOTDataLog.h"
+#include "myIOTDevice.h"
+#include "myIOTLog.h"
+
+#if WITH_SD
+
+#define DEBUG_QUEUE		0
+
+#define WRITER_STACK		8192	// appends, rollups, and torn record repairs
+#define WRITER_PRIORITY		2		// above the job task
+#define QUEUE_POLL_MS		100
+#define QUEUE_SHOW_MS		1000	// loopQueue() sets the values at most this often
+#define MAX_QUEUED_LOGS		8
+
+static myIOTDataLog *s_queued[MAX_QUEUED_LOGS];
+static volatile int s_num_queued = 0;
+static TaskHandle_t s_writer_task = NULL;
+
+
+bool myIOTDataLog::setQueue(int num_recs, int batch_recs/*=0*/, uint32_t flush_ms/*=1000*/)
+{
+	if (m_q_buf || num_recs < 2 || s_num_queued >= MAX_QUEUED_LOGS)
+	{
+		LOGE("setQueue(%s,%d) already called, too small, or more than %d queues",
+			m_name,num_recs,MAX_QUEUED_LOGS);
+		return false;
+	}
+	if (!initJobLock())
+		return false;
+
+	uint32_t max = 2;
+	while (max < (uint32_t) num_recs)
+		max <<= 1;
+	m_q_max = max;
+	m_q_batch =
+		batch_recs <= 0 ? max / 4 :
+		(uint32_t) batch_recs > max ? max : batch_recs;
+	if (!m_q_batch)
+		m_q_batch = 1;
+	m_q_flush_ms = flush_ms;
+	m_q_drain_ms = millis();
+	m_q_buf = new uint8_t[max * m_rec_size];
+
+	if (!s_writer_task)
+	{
+		LOGI("starting dataLogWriter task pinned to core %d",ESP32_CORE_OTHER);
+		xTaskCreatePinnedToCore(
+			writerTask,
+			"dataLogWriter",
+			WRITER_STACK,
+			NULL,
+			WRITER_PRIORITY,
+			&s_writer_task,
+			ESP32_CORE_OTHER);
+	}
+	s_queued[s_num_queued] = this;
+	s_num_queued++;
+
+	LOGI("myIOTDataLog(%s) queue %u records batch(%u) flush_ms(%u)",m_name,m_q_max,m_q_batch,flush_ms);
+	return true;
+}
+
+
+void myIOTDataLog::setQueueValues(valueIdType overruns_id, valueIdType high_id)
+{
+	m_q_overruns_id = overruns_id;
+	m_q_high_id = high_id;
+}
+
+
+uint32_t myIOTDataLog::getQueueDepth() const
+{
+	// the tail first, so that the head is never behind it
+
+	uint32_t tail = __atomic_load_n(&m_q_tail, __ATOMIC_ACQUIRE);
+	return __atomic_load_n(&m_q_head, __ATOMIC_ACQUIRE) - tail;
+}
+
+
+
+//------------------------------------
+// producer
+//------------------------------------
+
+bool myIOTDataLog::queueRecord(const uint8_t *rec)
+{
+	uint32_t head = m_q_head;
+	uint32_t depth = head - __atomic_load_n(&m_q_tail, __ATOMIC_ACQUIRE);
+	if (depth >= m_q_max)
+	{
+		m_q_overruns++;
+		return false;
+	}
+
+	memcpy(&m_q_buf[(head & (m_q_max - 1)) * m_rec_size], rec, m_rec_size);
+	__atomic_store_n(&m_q_head, head + 1, __ATOMIC_RELEASE);
+
+	depth++;
+	if (depth > m_q_high)
+		m_q_high = depth;
+	if (depth == m_q_batch)
+		xTaskNotifyGive(s_writer_task);
+	return true;
+}
+
+
+
+//------------------------------------
+// consumer
+//------------------------------------
+
+void myIOTDataLog::drainQueue()
+	// with the job lock held, on the writer task or by flush()
+{
+	if (m_q_draining)
+		return;		// flush() from writeRecords()
+	m_q_draining = true;
+
+	uint32_t tail = m_q_tail;
+	uint32_t head = __atomic_load_n(&m_q_head, __ATOMIC_ACQUIRE);
+	if (maintaining())
+	{
+		// only as many as fit in the pending queue,
+		// and the rest wait in the ring
+
+		uint32_t room = m_pend_max - m_pend_count;
+		if (head - tail > room)
+			head = tail + room;
+	}
+	while (tail != head)
+	{
+		// the records up to the head or the end of the ring,
+		// which the producer leaves alone until the tail passes them
+
+		uint32_t idx = tail & (m_q_max - 1);
+		uint32_t num = head - tail;
+		if (num > m_q_max - idx)
+			num = m_q_max - idx;
+
+		uint32_t start_ms = millis();
+		writeRecords(&m_q_buf[idx * m_rec_size], num);
+		uint32_t ms = millis() - start_ms;
+
+		m_q_batches++;
+		if (num > m_q_max_batch)
+			m_q_max_batch = num;
+		if (ms > m_q_max_write_ms)
+			m_q_max_write_ms = ms;
+
+		#if DEBUG_QUEUE
+			LOGD("drainQueue(%s) wrote %u records in %u ms",m_name,num,ms);
+		#endif
+
+		tail += num;
+		__atomic_store_n(&m_q_tail, tail, __ATOMIC_RELEASE);
+	}
+
+	m_q_drain_ms = millis();
+	m_q_draining = false;
+}
+
+
+void myIOTDataLog::loopWriter()
+	// on the writer task, does what addRecord() and loop() would have
+{
+	if (maintaining() && m_pend_count >= m_pend_max)
+		return;		// the ring holds them until it is done
+
+	uint32_t now = millis();
+	uint32_t depth = getQueueDepth();
+	if (!depth)
+		m_q_drain_ms = now;
+
+	bool timed = m_wb_count && m_wb_flush_ms && now - m_wb_start_ms >= m_wb_flush_ms;
+	bool pending = m_pend_count;
+	if (depth < m_q_batch &&
+		now - m_q_drain_ms < m_q_flush_ms &&
+		!timed && !pending)
+		return;
+
+	logJobLock lock(this);
+	drainQueue();
+	if (timed || pending)
+		flush();
+}
+
+
+void myIOTDataLog::writerTask(void *param)
+{
+	while (1)
+	{
+		ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(QUEUE_POLL_MS));
+		for (int i=0; i<s_num_queued; i++)
+			s_queued[i]->loopWriter();
+	}
+}
+
+
+
+//------------------------------------
+// counters
+//------------------------------------
+
+void myIOTDataLog::loopQueue()
+	// on the loop task, from loop()
+{
+	uint32_t now = millis();
+	if (now - m_q_shown_ms < QUEUE_SHOW_MS)
+		return;
+	m_q_shown_ms = now;
+
+	uint32_t overruns = m_q_overruns;
+	uint32_t high = m_q_high;
+	if (overruns != m_q_shown_overruns)
+	{
+		LOGW("myIOTDataLog(%s) queue full, %u records dropped since boot",m_name,overruns);
+		m_q_shown_overruns = overruns;
+		if (m_q_overruns_id)
+			my_iot_device->setInt(m_q_overruns_id, overruns);
+	}
+	if (high != m_q_shown_high)
+	{
+		m_q_shown_high = high;
+		if (m_q_high_id)
+			my_iot_device->setInt(m_q_high_id, high);
+	}
+}
+
+
+String myIOTDataLog::queueStatus()
+{
+	String result = "{";
+	result += "\"name\":\""       + String(m_name)          + "\",";
+	result += "\"size\":"         + String(m_q_max)         + ",";
+	result += "\"batch\":"        + String(m_q_batch)       + ",";
+	result += "\"depth\":"        + String(getQueueDepth()) + ",";
+	result += "\"high\":"         + String(m_q_high)        + ",";
+	result += "\"overruns\":"     + String(m_q_overruns)    + ",";
+	result += "\"written\":"      + String(m_q_tail)        + ",";
+	result += "\"batches\":"      + String(m_q_batches)     + ",";
+	result += "\"max_batch\":"    + String(m_q_max_batch)   + ",";
+	result += "\"max_write_ms\":" + String(m_q_max_write_ms);
+	result += "}";
+	return result;
+}
+
+
+#endif	// WITH_SD
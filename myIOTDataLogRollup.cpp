@@ -0,0 +1,470 @@
+//-----------------------------------------------
+// myIOTDataLogRollup.cpp - hourly and daily rollups, or a tile pyramid
+//-----------------------------------------------
+// When enabled, addRecord() (or flush()) feeds each record into the open
+// bucket of the first rollup level.  When a record arrives for a later
+// bucket, the open one is closed and appended to the rollup datalog, so
+// the rollup files only ever contain closed buckets.  Each closed bucket
+// is then fed into the open bucket of the next level, whose buckets are
+// a whole number of them (days of hours, or twice the size in a pyramid),
+// and so on up.
+//
+// So the open bucket of a level only holds closed buckets of the one
+// below, and the records since the last closed bucket of a level are
+// in exactly one of the open buckets of that level and those below it.
+//
+// The open buckets only live in memory.  After a reboot they are
+// recovered the first time they are needed, starting at rolled_until
+// (the end of the last closed bucket in the rollup file), from the rollup
+// file of the level below, or for the first level, from the datalog.
+// The datalog's time index, if any, or its segments, are used to find
+// where to start reading.  Levels are recovered from the top down, so
+// that buckets closed while recovering a level go to a recovered one.
+//
+// Records with a dt before rolled_until (i.e. after a clock spike that
+// closed buckets in the "future") are left out of the rollups.
+// compactFile() and trimBefore() rebuild the rollups from the datalog,
+// which corrects that, and so do the tombstone methods, so that the
+// tombstoned records are no longer summarized.
+
+#include "myIOTDataLog.h"
+#include "myIOTLog.h"
+
+#if WITH_SD
+
+#define DEBUG_ROLLUP	0
+
+
+String myIOTDataLog::rollupFilename(int level)
+{
+	uint32_t secs = m_rollup ? m_rollup[level].secs :
+		level == LOG_ROLLUP_DAY ? 86400 : 3600;
+
+	String filename = "/";
+	filename += m_name;
+	if (secs == 3600)
+		filename += ".1h";
+	else if (secs == 86400)
+		filename += ".1d";
+	else
+	{
+		filename += ".";
+		filename += String(secs);
+		filename += "s";
+	}
+	filename += ".datalog";
+	return filename;
+}
+
+
+void myIOTDataLog::initRollups(const uint32_t *secs, int num_levels)
+{
+	if (m_rollup)
+		delete[] m_rollup;
+	m_rollup = NULL;
+	m_num_rollups = 0;
+	if (!num_levels)
+		return;
+
+	m_rollup = new logRollup_t[num_levels];
+	m_num_rollups = num_levels;
+	for (int level=0; level<num_levels; level++)
+	{
+		logRollup_t *rollup = &m_rollup[level];
+		rollup->secs = secs[level];
+		rollup->recovered = false;
+		rollup->rolled_until = 0;
+		rollup->bucket_dt = 0;
+		accumClear(&rollup->acc);
+	}
+}
+
+
+void myIOTDataLog::setRollups(bool enable)
+{
+	static const uint32_t hour_day[] = { 3600, 86400 };
+	if (enable && !m_rollup)
+		initRollups(hour_day, 2);
+	else if (!enable && m_rollup)
+		initRollups(NULL, 0);
+}
+
+
+void myIOTDataLog::setRollupPyramid(uint32_t min_secs, int num_levels)
+{
+	uint32_t secs = 1;
+	while (secs * 2 <= min_secs)
+		secs *= 2;
+	if (num_levels > LOG_MAX_ROLLUPS)
+		num_levels = LOG_MAX_ROLLUPS;
+	while (num_levels > 1 && secs > (0xffffffff >> (num_levels - 1)))
+		num_levels--;		// would overflow
+
+	uint32_t level_secs[LOG_MAX_ROLLUPS];
+	for (int level=0; level<num_levels; level++)
+		level_secs[level] = secs << level;
+	initRollups(level_secs, num_levels > 0 ? num_levels : 0);
+
+	LOGI("myIOTDataLog(%s) rollup pyramid of %d levels from %d secs",m_name,m_num_rollups,secs);
+}
+
+
+int myIOTDataLog::pickRollup(uint32_t bucket_secs)
+	// returns the coarsest rollup level whose buckets are
+	// no larger than bucket_secs, or -1 if none
+{
+	if (!m_rollup)
+		return -1;
+	for (int level=m_num_rollups-1; level>=0; level--)
+	{
+		if (m_rollup[level].secs <= bucket_secs)
+			return level;
+	}
+	return -1;
+}
+
+
+//-----------------------------------------
+// feedRollup()
+//-----------------------------------------
+
+void myIOTDataLog::feedRollup(int level, const uint8_t *rec, File *out /*=NULL*/, bool cascade /*=true*/)
+	// Add a record, or above the first level, a closed bucket of the
+	// level below, to the open bucket of a level, closing the bucket
+	// and appending it to the rollup file (or the given open file)
+	// if the record belongs to a later bucket.  With cascade, the closed
+	// bucket is then fed to the next level if it has been recovered.
+{
+	logRollup_t *rollup = &m_rollup[level];
+
+	uint32_t dt;
+	memcpy(&dt,rec,4);
+	if (!dt || dt < rollup->rolled_until)
+		return;
+
+	uint32_t bucket_dt = dt - (dt % rollup->secs);
+	if (rollup->acc.count && bucket_dt != rollup->bucket_dt)
+	{
+		if (bucket_dt > rollup->bucket_dt)
+		{
+			int rollup_size = getRollupRecSize();
+			uint8_t rollup_rec[rollup_size];
+			accumToRollup(&rollup->acc, rollup->bucket_dt, rollup_rec);
+
+			bool ok;
+			if (out)
+			{
+				ok = out->write(rollup_rec, rollup_size) == rollup_size;
+			}
+			else
+			{
+				String filename = rollupFilename(level);
+				File file = SD.open(filename.c_str(), FILE_APPEND);
+				ok = file && file.write(rollup_rec, rollup_size) == rollup_size;
+				if (file)
+					file.close();
+			}
+
+			if (!ok)
+			{
+				// will be recovered from the datalog the next time around
+
+				LOGE("feedRollup(%s) could not write bucket",rollupFilename(level).c_str());
+				rollup->recovered = false;
+			}
+
+			#if DEBUG_ROLLUP
+				LOGD("feedRollup(%s) closed bucket %s count=%d",
+					rollupFilename(level).c_str(),
+					timeToString(rollup->bucket_dt).c_str(),
+					rollup->acc.count);
+			#endif
+
+			rollup->rolled_until = rollup->bucket_dt + rollup->secs;
+
+			if (cascade && level + 1 < m_num_rollups && m_rollup[level + 1].recovered)
+				feedRollup(level + 1, rollup_rec);
+		}
+		else
+		{
+			LOGW("feedRollup(%s) clock went back from %s to %s; discarding open bucket",
+				rollupFilename(level).c_str(),
+				timeToString(rollup->bucket_dt).c_str(),
+				timeToString(dt).c_str());
+		}
+		accumClear(&rollup->acc);
+	}
+
+	rollup->bucket_dt = bucket_dt;
+	if (level)
+		accumRollup(&rollup->acc,rec);
+	else
+		accumRecord(&rollup->acc,rec);
+}
+
+
+//-----------------------------------------
+// feedRollupsFrom()
+//-----------------------------------------
+
+bool myIOTDataLog::feedRollupsFrom(int file_num, uint32_t rec_idx, bool cascade)
+	// Feed datalog records, from record rec_idx in data file file_num
+	// to the end of the datalog, into the first rollup level.
+	// For a compressed or columnar datalog, rec_idx is a block number,
+	// and for a columnar one, the open records are fed after the blocks.
+{
+	String out_name = rollupFilename(0);
+	File out = SD.open(out_name.c_str(), FILE_APPEND);
+	if (!out)
+	{
+		LOGE("feedRollupsFrom() could not open %s",out_name.c_str());
+		return false;
+	}
+
+	#define ROLLUP_BASE_BUF  1024
+	int buf_size = ((ROLLUP_BASE_BUF + m_rec_size - 1) / m_rec_size) * m_rec_size;
+	uint8_t read_buf[buf_size];
+
+	// the open records of a columnar datalog may still be
+	// a copy of its last block if it was interrupted
+
+	if (m_c_recs && !m_c_valid)
+		recoverColumnar();
+
+	bool ok = true;
+	int num_files = numDataFiles();
+	for (; ok && file_num < num_files; file_num++, rec_idx = 0)
+	{
+		String filename = dataFilename(file_num);
+		File file = SD.open(filename.c_str(), FILE_READ);
+		if (file && (m_z_block || m_c_recs))
+		{
+			ok = file.seek(rec_idx * blockBytes()) &&
+				feedRollupBlocks(file, &out, cascade);
+			file.close();
+			if (!ok || !m_c_recs)
+				continue;
+		}
+		if (m_c_recs)
+		{
+			// then the open records, which may be all there is
+
+			filename = colOpenFilename();
+			file = SD.open(filename.c_str(), FILE_READ);
+			rec_idx = 0;
+		}
+		if (!file)
+			continue;	// no datalog yet
+
+		if (!file.seek(rec_idx * m_rec_size))
+			ok = false;
+
+		int got;
+		while (ok && (got = file.read(read_buf, buf_size)) > 0)
+		{
+			int recs = got / m_rec_size;	// ignore partial trailing bytes
+			for (int r = 0; r < recs; r++)
+				feedRollup(0, read_buf + r * m_rec_size, &out, cascade);
+			jobYield("rollups", file.position(), file.size());
+		}
+		file.close();
+	}
+
+	out.close();
+	return ok;
+}
+
+
+//-----------------------------------------
+// feedRollupFromBelow()
+//-----------------------------------------
+
+bool myIOTDataLog::feedRollupFromBelow(int level, uint32_t from_dt, bool cascade)
+	// Feed the closed buckets of the level below, starting at the
+	// first one at or after from_dt, into a level above the first.
+{
+	String in_name = rollupFilename(level - 1);
+	String out_name = rollupFilename(level);
+	int rollup_size = getRollupRecSize();
+
+	uint32_t start = from_dt ? findCeiling(in_name.c_str(), rollup_size, from_dt - 1, false) : 0;
+
+	File in = SD.open(in_name.c_str(), FILE_READ);
+	if (!in)
+		return true;	// nothing rolled up yet
+
+	File out = SD.open(out_name.c_str(), FILE_APPEND);
+	if (!out)
+	{
+		LOGE("feedRollupFromBelow() could not open %s",out_name.c_str());
+		in.close();
+		return false;
+	}
+
+	int buf_size = ((ROLLUP_BASE_BUF + rollup_size - 1) / rollup_size) * rollup_size;
+	uint8_t read_buf[buf_size];
+
+	bool ok = in.seek(start * rollup_size);
+	int got;
+	while (ok && (got = in.read(read_buf, buf_size)) > 0)
+	{
+		int recs = got / rollup_size;
+		for (int r = 0; r < recs; r++)
+			feedRollup(level, read_buf + r * rollup_size, &out, cascade);
+		jobYield("rollups", in.position(), in.size());
+	}
+
+	in.close();
+	out.close();
+	return ok;
+}
+
+
+//-----------------------------------------
+// recoverRollup()
+//-----------------------------------------
+
+bool myIOTDataLog::recoverRollup(int level)
+	// Re-establish rolled_until from the last record in the rollup
+	// file and re-create the open bucket from the datalog records
+	// that have not been rolled up yet.
+{
+	logRollup_t *rollup = &m_rollup[level];
+	rollup->recovered = false;
+	rollup->rolled_until = 0;
+	accumClear(&rollup->acc);
+
+	String filename = rollupFilename(level);
+	int rollup_size = getRollupRecSize();
+
+	File file = SD.open(filename.c_str(), FILE_READ);
+	if (file)
+	{
+		uint32_t size = file.size();
+		uint32_t last_dt = 0;
+		if (size % rollup_size)
+		{
+			LOGW("recoverRollup(%s) bad size(%d); rebuilding",filename.c_str(),size);
+			file.close();
+			SD.remove(filename.c_str());
+		}
+		else
+		{
+			if (size &&
+				file.seek(size - rollup_size) &&
+				file.read((uint8_t *)&last_dt,4) == 4)
+				rollup->rolled_until = last_dt + rollup->secs;
+			file.close();
+		}
+	}
+
+	uint32_t start_ms = millis();
+	if (level)
+	{
+		if (!feedRollupFromBelow(level,rollup->rolled_until,true))
+			return false;
+		rollup->recovered = true;
+		LOGI("recoverRollup(%s) in %u ms",filename.c_str(),(uint32_t) (millis()-start_ms));
+		return true;
+	}
+
+	// records at or after rolled_until can only be in segments
+	// that start at or after the segment containing it
+
+	int file_num = 0;
+	uint32_t start = 0;
+	if (rollup->rolled_until)
+	{
+		if (m_seg_type)
+			file_num = findSegment(segmentStart(rollup->rolled_until));
+		else if (m_z_block || m_c_recs)
+		{
+			// the block that starts at or before the newest record before it
+			start = findBlock(rollup->rolled_until - 1);
+			if (start)
+				start--;
+		}
+		else
+			start = findFloor(rollup->rolled_until);
+	}
+	if (!feedRollupsFrom(file_num,start,true))
+		return false;
+
+	rollup->recovered = true;
+	LOGI("recoverRollup(%s) from file %d record %d in %u ms",filename.c_str(),file_num,start,(uint32_t) (millis()-start_ms));
+	return true;
+}
+
+
+bool myIOTDataLog::recoverRollups(int level)
+	// Recovers the levels that need it, from the top down, and
+	// returns true if the given level and those below it are ok.
+{
+	bool ok = true;
+	for (int l=m_num_rollups-1; l>=0; l--)
+	{
+		if (!m_rollup[l].recovered && !recoverRollup(l) && l <= level)
+			ok = false;
+	}
+	return ok;
+}
+
+
+//-----------------------------------------
+// rollupRecords()
+//-----------------------------------------
+
+void myIOTDataLog::rollupRecords(const uint8_t *recs, int num_recs)
+	// Called by appendRecords() after the records have been
+	// appended to the datalog. Recovery reads them from there.
+{
+	bool feed = m_rollup[0].recovered;
+	recoverRollups(0);
+	if (feed)
+	{
+		for (int r=0; r<num_recs; r++)
+			feedRollup(0,recs + r * m_rec_size);
+	}
+}
+
+
+//-----------------------------------------
+// rebuildRollups()
+//-----------------------------------------
+
+bool myIOTDataLog::rebuildRollups()
+{
+	if (!m_rollup || jobRefused("rebuildRollups"))
+		return false;
+	logJobLock lock(this);
+	flush();
+
+	uint32_t start_ms = millis();
+	for (int level=0; level<m_num_rollups; level++)
+	{
+		logRollup_t *rollup = &m_rollup[level];
+		rollup->recovered = false;
+		rollup->rolled_until = 0;
+		accumClear(&rollup->acc);
+
+		String filename = rollupFilename(level);
+		if (SD.exists(filename.c_str()))
+			SD.remove(filename.c_str());
+	}
+
+	// one level at a time, each from the one below
+
+	bool ok = feedRollupsFrom(0,0,false);
+	for (int level=1; ok && level<m_num_rollups; level++)
+		ok = feedRollupFromBelow(level,0,false);
+	for (int level=0; level<m_num_rollups; level++)
+	{
+		m_rollup[level].recovered = ok;
+	}
+
+	LOGI("rebuildRollups(%s) ok=%d in %u ms",m_name,ok,(uint32_t) (millis()-start_ms));
+	return ok;
+}
+
+
+#endif	// WITH_SD
@@ -0,0 +1,328 @@
+//-----------------------------------------------
+// myIOTDataLogSampler.cpp - values sampled into a datalog
+//-----------------------------------------------
+// All of the samplers run on one schedule, from loop(), which does
+// nothing until SAMPLER_TICK_MS has passed since it last ran, and then
+// does whatever is due for each of them:
+//
+//		readings	every read_ms, on millis() deadlines that advance by
+//					read_ms, not from when the reading was taken, so
+//					that a late one does not delay the ones after it.
+//		records		when time(NULL) reaches m_next_dt, a multiple of
+//					period_secs, with that as the dt, so that the records
+//					are exactly period_secs apart, and those of samplers
+//					with the same period line up, however late loop()
+//					got to them.  The samplers that are due in the same
+//					tick add their records together.  LAST columns are
+//					read then, and the others use the readings.
+//
+// A reading may be late by up to SAMPLER_TICK_MS plus however long the
+// loop task was busy.  If it is held up for a whole period, or the clock
+// jumps forward, the record of the period that ended is added, the ones
+// after it are counted as missed, and the schedule carries on from the
+// current time.  If the clock jumps back, it starts again.  Nothing is
+// read or added until the clock has been set.
+
+#include "myIOTDataLogSampler.h"
+#include "myIOTDevice.h"
+#include "myIOTLog.h"
+#include "myIotTempSensor.h"
+#include <math.h>
+
+#define DEBUG_SAMPLER	0
+
+#define SAMPLER_TICK_MS		10
+#define SAMPLER_FLUSH_MS	60000	// how long records may wait in the write-behind buffer from start()
+
+static myIOTDataLogSampler *s_samplers[LOG_MAX_SAMPLERS];
+static int s_num_samplers = 0;
+static uint32_t s_tick_ms;
+
+
+//------------------------------------
+// implementation
+//------------------------------------
+
+static bool isTemperature(uint32_t typ)
+{
+	return
+		typ == LOG_COL_TYPE_CENTIGRADE32 ||
+		typ == LOG_COL_TYPE_CENTIGRADE_RAW ||
+		typ == LOG_COL_TYPE_CENTIGRADE8;
+}
+
+
+static double readValue(myIOTValue *value)
+{
+	switch (value->getType())
+	{
+		case VALUE_TYPE_BOOL  : return value->getBool();
+		case VALUE_TYPE_CHAR  : return value->getChar();
+		case VALUE_TYPE_TIME  : return value->getTime();
+		case VALUE_TYPE_FLOAT : return value->getFloat();
+		case VALUE_TYPE_ENUM  : return value->getEnum();
+		case VALUE_TYPE_BENUM : return value->getBenum();
+	}
+	return value->getInt();
+}
+
+
+static double clampRound(double v, double lo, double hi)
+{
+	if (isnan(v))
+		return 0;
+	v = floor(v + 0.5);
+	return v < lo ? lo : v > hi ? hi : v;
+}
+
+
+static void encodeSample(uint32_t typ, double v, uint8_t *out)
+	// v in display units to the column's stored units
+{
+	if (typ == LOG_COL_TYPE_UINT16)
+	{
+		uint16_t s = clampRound(v, 0, 65535);
+		memcpy(out, &s, 2);
+	}
+	else if (typ == LOG_COL_TYPE_UINT8)
+		*out = clampRound(v, 0, 255);
+	else if (typ == LOG_COL_TYPE_UINT8x10)
+		*out = clampRound(v / 10, 0, 255);
+	else if (typ == LOG_COL_TYPE_INT32)
+	{
+		int32_t s = clampRound(v, INT32_MIN, INT32_MAX);
+		memcpy(out, &s, 4);
+	}
+	else if (typ == LOG_COL_TYPE_INT16)
+	{
+		int16_t s = clampRound(v, -32768, 32767);
+		memcpy(out, &s, 2);
+	}
+	else if (typ == LOG_COL_TYPE_INT8)
+		*out = (uint8_t)(int8_t) clampRound(v, -128, 127);
+	else if (typ == LOG_COL_TYPE_INT16_10)
+	{
+		int16_t s = clampRound(v * 10, -32768, 32767);
+		memcpy(out, &s, 2);
+	}
+	else if (typ == LOG_COL_TYPE_FLOAT32 ||
+			 typ == LOG_COL_TYPE_CENTIGRADE32)
+	{
+		float s = v;
+		memcpy(out, &s, 4);
+	}
+	else if (typ == LOG_COL_TYPE_CENTIGRADE_RAW)
+	{
+		int16_t s = v >= TEMPERATURE_ERROR ? TEMP_RAW_ERROR :
+			clampRound(v * 128, -32768, TEMP_RAW_ERROR - 1);
+		memcpy(out, &s, 2);
+	}
+	else if (typ == LOG_COL_TYPE_CENTIGRADE8)
+		*out = clampRound(v + 40, 0, 255);
+	else	// UINT32
+	{
+		uint32_t s = clampRound(v, 0, UINT32_MAX);
+		memcpy(out, &s, 4);
+	}
+}
+
+
+
+//------------------------------------
+// myIOTDataLogSampler
+//------------------------------------
+
+myIOTDataLogSampler::myIOTDataLogSampler(
+		myIOTDataLog *log,
+		const logSample_t *samples,
+		uint32_t period_secs,
+		uint32_t read_ms /*=0*/) :
+	m_log(log),
+	m_sample(samples),
+	m_period(period_secs ? period_secs : 1),
+	m_read_ms(read_ms),
+	m_value(NULL),
+	m_acc(NULL),
+	m_next_dt(0),
+	m_next_read_ms(0),
+	m_readings(0),
+	m_samples(0),
+	m_missed(0)
+{}
+
+
+bool myIOTDataLogSampler::start(int batch_recs /*=0*/)
+{
+	const char *name = m_log->getName();
+	if (m_value || s_num_samplers >= LOG_MAX_SAMPLERS)
+	{
+		LOGE("myIOTDataLogSampler(%s) already started, or more than %d samplers",name,LOG_MAX_SAMPLERS);
+		return false;
+	}
+
+	int num_cols = m_log->getNumCols();
+	myIOTValue **values = new myIOTValue *[num_cols];
+	for (int i=0; i<num_cols; i++)
+	{
+		const logSample_t *sample = &m_sample[i];
+		myIOTValue *value = my_iot_device->findValueById(sample->id);
+		valueType type = value ? value->getType() : 0;
+		if (!value ||
+			type == VALUE_TYPE_COMMAND ||
+			type == VALUE_TYPE_STRING ||
+			sample->how < LOG_SAMPLE_LAST ||
+			sample->how > LOG_SAMPLE_MAX)
+		{
+			LOGE("myIOTDataLogSampler(%s) column(%s) value(%s) not found, a string or command, or bad how(%d)",
+				name,m_log->getCol(i)->name,sample->id,sample->how);
+			delete[] values;
+			return false;
+		}
+		values[i] = value;
+	}
+
+	m_value = values;
+	m_acc = new logSampleAcc_t[num_cols];
+	m_readings = 0;
+
+	#if WITH_SD
+		if (batch_recs > 0)
+		{
+			if (m_log->hasQueue() || m_log->hasWriteBehind())
+				LOGW("myIOTDataLogSampler(%s) batch_recs(%d) ignored; the datalog already has a queue or write-behind buffer",name,batch_recs);
+			else
+				m_log->setWriteBehind(batch_recs * m_log->getRecSize(), SAMPLER_FLUSH_MS);
+		}
+	#endif
+
+	s_samplers[s_num_samplers++] = this;
+	LOGI("myIOTDataLogSampler(%s) every %u secs, reading every %u ms",name,m_period,m_read_ms);
+	return true;
+}
+
+
+void myIOTDataLogSampler::readValues()
+{
+	int num_cols = m_log->getNumCols();
+	for (int i=0; i<num_cols; i++)
+	{
+		double v = readValue(m_value[i]);
+		logSampleAcc_t *acc = &m_acc[i];
+		if (!m_readings)
+			acc->count = 0;
+		acc->last = v;
+
+		// sensor errors are only kept as the last value
+
+		if (isnan(v) ||
+			(isTemperature(m_log->getCol(i)->type) && v >= TEMPERATURE_ERROR))
+			continue;
+		if (!acc->count || v < acc->min)
+			acc->min = v;
+		if (!acc->count || v > acc->max)
+			acc->max = v;
+		acc->sum = acc->count ? acc->sum + v : v;
+		acc->count++;
+	}
+	m_readings++;
+}
+
+
+void myIOTDataLogSampler::addSample(uint32_t dt)
+	// adds the record for the period that ends at dt
+{
+	// LAST is read now, not taken from the last of the readings,
+	// which may be up to read_ms old
+
+	int num_cols = m_log->getNumCols();
+	if (!m_readings || !m_read_ms)
+		readValues();
+	else
+	{
+		for (int i=0; i<num_cols; i++)
+		{
+			if (m_sample[i].how == LOG_SAMPLE_LAST)
+				m_acc[i].last = readValue(m_value[i]);
+		}
+	}
+
+	uint8_t rec[m_log->getRecSize()];
+	int offset = 4;		// addRecord() sets the dt
+	for (int i=0; i<num_cols; i++)
+	{
+		uint32_t typ = m_log->getCol(i)->type;
+		const logSampleAcc_t *acc = &m_acc[i];
+		int how = m_sample[i].how;
+		double none = isTemperature(typ) ? TEMPERATURE_ERROR : NAN;
+		double v =
+			how == LOG_SAMPLE_LAST ? acc->last :
+			!acc->count ? none :
+			how == LOG_SAMPLE_AVG ? acc->sum / acc->count :
+			how == LOG_SAMPLE_MIN ? acc->min :
+			acc->max;
+		encodeSample(typ, v, &rec[offset]);
+		offset += m_log->getColSize(i);
+	}
+
+	#if DEBUG_SAMPLER
+		LOGD("myIOTDataLogSampler(%s) dt(%u) from %u readings",m_log->getName(),dt,m_readings);
+	#endif
+
+	m_readings = 0;
+	if (m_log->addRecord(rec, dt))
+		m_samples++;
+}
+
+
+void myIOTDataLogSampler::run(uint32_t now, uint32_t now_ms)
+{
+	if (now < ILLEGAL_DT)
+		return;
+
+	// the end of the period that now is in
+
+	uint32_t aligned = (now / m_period + 1) * m_period;
+	if (!m_next_dt || m_next_dt > aligned)
+	{
+		// the first time, or the clock went back
+
+		m_next_dt = aligned;
+		m_next_read_ms = now_ms;
+		m_readings = 0;
+	}
+
+	if (m_read_ms && (int32_t)(now_ms - m_next_read_ms) >= 0)
+	{
+		readValues();
+		m_next_read_ms += m_read_ms;
+		if ((int32_t)(now_ms - m_next_read_ms) >= 0)
+			m_next_read_ms = now_ms + m_read_ms;
+	}
+
+	if (now < m_next_dt)
+		return;
+
+	addSample(m_next_dt);
+	if (aligned > m_next_dt + m_period)
+	{
+		uint32_t missed = (aligned - m_next_dt) / m_period - 1;
+		m_missed += missed;
+		LOGW("myIOTDataLogSampler(%s) missed %u records at %u",m_log->getName(),missed,m_next_dt + m_period);
+	}
+	m_next_dt = aligned;
+}
+
+
+void myIOTDataLogSampler::loop()
+{
+	if (!s_num_samplers)
+		return;
+	uint32_t now_ms = millis();
+	if (now_ms - s_tick_ms < SAMPLER_TICK_MS)
+		return;
+	s_tick_ms = now_ms;
+
+	uint32_t now = time(NULL);
+	for (int i=0; i<s_num_samplers; i++)
+		s_samplers[i]->run(now, now_ms);
+}
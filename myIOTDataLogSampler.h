@@ -0,0 +1,101 @@
+//-----------------------------------------------
+// myIOTDataLogSampler.h - values sampled into a datalog
+//-----------------------------------------------
+// A myIOTDataLogSampler binds values of the device to the columns of a
+// datalog, and adds a record of them every period_secs, instead of each
+// device having a timer in its loop() that reads the values and packs
+// a logRecord_t by hand:
+//
+//		static const logSample_t fridge_samples[] = {
+//			{ ID_TEMP1, LOG_SAMPLE_AVG },
+//			{ ID_TEMP2, LOG_SAMPLE_AVG },
+//			{ ID_COMPRESSOR, LOG_SAMPLE_MAX } };
+//
+//		myIOTDataLogSampler fridge_sampler(&fridge_log, fridge_samples, 60, 5000);
+//			// a record every minute, on the minute, of the average
+//			// temperatures and whether the compressor ran, from
+//			// the values read every 5 seconds
+//
+//		fridge_sampler.start();		// in setup(), after the device's setup()
+//
+// Values are read in display units, i.e. degrees for a CENTIGRADE_RAW
+// column, and converted to the column's stored units, rounded and
+// limited to its range.  See myIOTDataLogSampler.cpp for the schedule.
+
+#pragma once
+
+#include "myIOTDataLog.h"
+
+class myIOTValue;		// forward declaration for m_value
+
+
+#define LOG_SAMPLE_LAST		0		// the value read at the end of the period
+#define LOG_SAMPLE_AVG		1		// the average of the readings over the period
+#define LOG_SAMPLE_MIN		2		// the lowest of them
+#define LOG_SAMPLE_MAX		3		// the highest of them
+
+#define LOG_MAX_SAMPLERS	8
+
+
+typedef struct {
+	valueIdType id;			// a BOOL, CHAR, INT, TIME, ENUM, BENUM, or FLOAT value
+	int how;				// LOG_SAMPLE_LAST, AVG, MIN, or MAX
+} logSample_t;
+
+
+class myIOTDataLogSampler
+{
+public:
+
+	myIOTDataLogSampler(
+		myIOTDataLog *log,				// the datalog the records are added to
+		const logSample_t *samples,		// one for each column of the datalog
+		uint32_t period_secs,			// a record every period_secs, on multiples of it
+		uint32_t read_ms=0);			// how often the values are read for AVG, MIN,
+										// and MAX, 0 = only at the end of the period
+
+	bool start(int batch_recs=0);
+		// Call once from setup(), after the device's setup(), to look up
+		// the values and add the sampler to the ones run by loop().  If
+		// batch_recs is non-zero, and the SD datalog has neither a queue
+		// nor a write-behind buffer, it is given a write-behind buffer of
+		// that many records, flushed at least every minute, so that the
+		// records are appended in batches.  Otherwise the datalog is left
+		// as it is.  The sampler is then the only one that may call
+		// addRecord() for the datalog.
+	static void loop();
+		// Called from myIOTDevice::loop() to run all of the samplers
+
+	uint32_t getSamples() const  { return m_samples; }
+		// records added since boot
+	uint32_t getMissed() const   { return m_missed; }
+		// periods that passed without a record since boot,
+		// i.e. while loop() was held up or the clock jumped
+
+private:
+
+	typedef struct {
+		double last;
+		double sum;
+		double min;
+		double max;
+		uint32_t count;
+	} logSampleAcc_t;
+
+	myIOTDataLog *m_log;
+	const logSample_t *m_sample;
+	uint32_t m_period;
+	uint32_t m_read_ms;
+
+	myIOTValue **m_value;			// looked up by start()
+	logSampleAcc_t *m_acc;			// readings since the last record
+	uint32_t m_next_dt;				// end of the period, 0 until the clock is set
+	uint32_t m_next_read_ms;		// millis() of the next reading
+	uint32_t m_readings;			// since the last record
+	uint32_t m_samples;
+	uint32_t m_missed;
+
+	void readValues();
+	void addSample(uint32_t dt);
+	void run(uint32_t now, uint32_t now_ms);
+};
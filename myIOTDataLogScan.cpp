@@ -0,0 +1,509 @@
+//-----------------------------------------------
+// myIOTDataLogScan.cpp - scanFile() with a checkpoint sidecar
+//-----------------------------------------------
+// scanFile() saves its results in "name.scan" so that the next scan
+// only has to read the records appended since then:
+//
+//		scanHeader_t		the totals so far
+//		scanSpike_t[]		the spikes found so far
+//		scanSeg_t[]			per data file (segment) totals, one for an
+//							unsegmented datalog
+//		scanStack_t[]		the spike stack for the newest data file
+//
+// The datalog only changes by appending, except for maintenance, so
+// tombstoneByDt(), tombstoneByIndex() etc, compactFile(), and trimBefore()
+// remove the checkpoint, and the next scan reads everything again.
+// The checkpoint is also ignored if it does not match the data files,
+// i.e. the newest one scanned is now shorter, or was replaced.
+//
+// The new checkpoint is written to "name.scan.tmp" and renamed.
+//
+// Spikes are found in the same single forward pass, without seeking
+// back. A spike is the run of records before a drop in dt that are later
+// than the record after the drop. The start of that run is the record
+// after the last earlier one whose dt <= the new dt, which is what a
+// "previous smaller or equal" monotonic stack gives: each record pops
+// the entries later than itself and is pushed, so the stack is always
+// increasing and a drop pops exactly the spike.
+//
+// Normally dt only increases and everything stays on the stack, so it is
+// limited to SPIKE_STACK entries. When it fills, the older half keeps the
+// entries followed by an unusually large step, i.e. forward clock jumps,
+// which is where spikes start, and every other one of the rest. A spike
+// that starts at a jump is found exactly however long it is. If the clock
+// was set back into an older, thinned out, run of ordinary records, the
+// spike is reported as starting early, by at most the gap in that run.
+
+#include "myIOTDataLog.h"
+#include "myIOTLog.h"
+
+#if WITH_SD
+
+#define DEBUG_SCAN		0
+
+#define SCAN_MAGIC		0x4e414353		// "SCAN"
+#define SCAN_VERSION	2
+
+#define SPIKE_STACK		256
+
+typedef struct {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t rec_size;
+	uint32_t num_recs;			// records scanned
+	uint32_t first_dt;
+	uint32_t last_dt;			// also the dt the next record is compared to
+	uint32_t tombstones;
+	uint32_t num_spikes;
+	uint32_t num_segs;
+	uint32_t num_stack;
+	uint32_t file_first_idx;	// first non-tombstone record of the newest file
+	uint32_t file_first_dt;		// 0 if none yet
+} scanHeader_t;
+
+typedef struct {
+	uint32_t start_idx;
+	uint32_t end_idx;
+	uint32_t count;
+	uint32_t first_dt;
+	uint32_t last_dt;
+	uint32_t prev_dt;
+	uint32_t next_dt;
+} scanSpike_t;
+
+typedef struct {
+	uint32_t key;				// segment period start, 0 if not segmented
+	uint32_t first_idx;
+	uint32_t num_recs;
+	uint32_t first_dt;
+	uint32_t last_dt;
+	uint32_t tombstones;
+} scanSeg_t;
+
+typedef struct {
+	uint32_t idx;
+	uint32_t dt;
+	uint32_t next_dt;			// dt of the following non-tombstone record, 0 if none yet
+} scanStack_t;
+
+
+
+String myIOTDataLog::scanFilename()
+{
+	String filename = "/";
+	filename += m_name;
+	filename += ".scan";
+	return filename;
+}
+
+
+void myIOTDataLog::invalidateScan()
+{
+	String filename = scanFilename();
+	if (SD.exists(filename.c_str()))
+		SD.remove(filename.c_str());
+}
+
+
+bool myIOTDataLog::scanFoundSpikes()
+{
+	String filename = scanFilename();
+	File file = SD.open(filename.c_str(), FILE_READ);
+	if (!file)
+		return false;
+
+	scanHeader_t hdr;
+	bool found =
+		file.read((uint8_t *)&hdr, sizeof(hdr)) == sizeof(hdr) &&
+		hdr.magic == SCAN_MAGIC &&
+		hdr.version == SCAN_VERSION &&
+		hdr.num_spikes;
+	file.close();
+	return found;
+}
+
+
+static void addSpikeJson(String &json, const scanSpike_t *spike, bool comma)
+{
+	if (comma) json += ",";
+	json += "{";
+	json += "\"start_idx\":"  + String(spike->start_idx) + ",";
+	json += "\"end_idx\":"    + String(spike->end_idx)   + ",";
+	json += "\"count\":"      + String(spike->count)     + ",";
+	json += "\"first_dt\":"   + String(spike->first_dt)  + ",";
+	json += "\"last_dt\":"    + String(spike->last_dt)   + ",";
+	json += "\"prev_dt\":"    + String(spike->prev_dt)   + ",";
+	json += "\"next_dt\":"    + String(spike->next_dt);
+	json += "}";
+}
+
+
+//-----------------------------------------
+// spike stack
+//-----------------------------------------
+
+static int compareStep(const void *a, const void *b)
+{
+	uint32_t sa = *((const uint32_t *) a);
+	uint32_t sb = *((const uint32_t *) b);
+	return sa < sb ? -1 : sa > sb ? 1 : 0;
+}
+
+
+static int thinStack(scanStack_t *stack, int num)
+	// Called with a full stack. In the older half, keeps the entries that
+	// are followed by more than twice the median step, and every other one
+	// of the rest, so older runs get sparser the more often they are thinned.
+	// If that does not free an eighth of the stack the oldest are dropped.
+{
+	int half = num / 2;
+	uint32_t steps[half];
+	for (int i = 0; i < half; i++)
+		steps[i] = stack[i].next_dt - stack[i].dt;
+	qsort(steps, half, sizeof(uint32_t), compareStep);
+	uint32_t jump = 2 * steps[half / 2];
+
+	int kept = 0;
+	bool drop = false;
+	for (int i = 0; i < half; i++)
+	{
+		if (stack[i].next_dt - stack[i].dt > jump)
+			stack[kept++] = stack[i];
+		else if (!(drop = !drop))
+			stack[kept++] = stack[i];
+	}
+	int skip = kept > half - num / 8 ? kept - half + num / 8 : 0;
+	if (skip)
+	{
+		memmove(stack, stack + skip, (kept - skip) * sizeof(scanStack_t));
+		kept -= skip;
+	}
+	memmove(stack + kept, stack + half, (num - half) * sizeof(scanStack_t));
+	return kept + num - half;
+}
+
+
+//-----------------------------------------
+// loadScan()
+//-----------------------------------------
+
+static bool loadScan(
+	File &file,
+	int rec_size,
+	scanHeader_t *hdr,
+	scanSeg_t *segs,
+	int num_files,
+	scanStack_t *stack)
+	// Reads and checks the header, segments, and spike stack of an
+	// open checkpoint, and leaves it positioned at the first spike.
+{
+	if (file.read((uint8_t *)hdr, sizeof(scanHeader_t)) != sizeof(scanHeader_t) ||
+		hdr->magic    != SCAN_MAGIC ||
+		hdr->version  != SCAN_VERSION ||
+		hdr->rec_size != rec_size ||
+		hdr->num_segs < 1 ||
+		hdr->num_segs > (uint32_t) num_files ||
+		hdr->num_stack > SPIKE_STACK ||
+		file.size() != sizeof(scanHeader_t) +
+			hdr->num_spikes * sizeof(scanSpike_t) +
+			hdr->num_segs * sizeof(scanSeg_t) +
+			hdr->num_stack * sizeof(scanStack_t))
+		return false;
+
+	int segs_bytes = hdr->num_segs * sizeof(scanSeg_t);
+	int stack_bytes = hdr->num_stack * sizeof(scanStack_t);
+	return
+		file.seek(file.size() - segs_bytes - stack_bytes) &&
+		file.read((uint8_t *)segs, segs_bytes) == segs_bytes &&
+		file.read((uint8_t *)stack, stack_bytes) == stack_bytes &&
+		file.seek(sizeof(scanHeader_t));
+}
+
+
+//-----------------------------------------
+// scanFile()
+//-----------------------------------------
+
+String myIOTDataLog::scanFile()
+	// For a segmented datalog the indexes are into the concatenation
+	// of the segments, and spikes only extend back to the start of the
+	// segment they were found in.
+{
+	logJobLock lock(this);
+	if (m_z_block || m_c_recs)
+		return scanBlocks();
+	flush();
+
+	#if DEBUG_SCAN
+		uint32_t start_ms = millis();
+		uint32_t scanned = 0;
+	#endif
+
+	int num_files = numDataFiles();
+	scanSeg_t *segs = new scanSeg_t[num_files > 0 ? num_files : 1];
+	scanStack_t *stack = new scanStack_t[SPIKE_STACK];
+	scanHeader_t hdr;
+
+	String scan_name = scanFilename();
+	String tmp_name = scan_name + ".tmp";
+	File old_scan = SD.open(scan_name.c_str(), FILE_READ);
+	bool resume = old_scan && num_files > 0 &&
+		loadScan(old_scan, m_rec_size, &hdr, segs, num_files, stack);
+
+	// the newest data file scanned is the only one that could have grown
+
+	if (resume)
+	{
+		scanSeg_t *last = &segs[hdr.num_segs - 1];
+		File data = SD.open(dataFilename(hdr.num_segs - 1).c_str(), FILE_READ);
+		resume =
+			data &&
+			data.size() / m_rec_size >= last->num_recs &&
+			last->key == (m_seg_type ? segmentKey(hdr.num_segs - 1) : 0);
+		if (data)
+			data.close();
+	}
+	if (!resume)
+	{
+		memset(&hdr, 0, sizeof(hdr));
+		hdr.magic = SCAN_MAGIC;
+		hdr.version = SCAN_VERSION;
+		hdr.rec_size = m_rec_size;
+	}
+
+	// the new checkpoint gets the old spikes, then the new ones
+
+	if (SD.exists(tmp_name.c_str()))
+		SD.remove(tmp_name.c_str());
+	File new_scan = SD.open(tmp_name.c_str(), FILE_WRITE);
+	bool write_ok = new_scan &&
+		new_scan.write((uint8_t *)&hdr, sizeof(hdr)) == sizeof(hdr);
+
+	String spikes_json = "[";
+	for (uint32_t i = 0; i < hdr.num_spikes; i++)
+	{
+		scanSpike_t spike;
+		if (old_scan.read((uint8_t *)&spike, sizeof(spike)) != sizeof(spike))
+		{
+			// the checkpoint went bad under us; start over next time
+
+			LOGE("scanFile() could not read %s",scan_name.c_str());
+			write_ok = false;
+			break;
+		}
+		addSpikeJson(spikes_json, &spike, i);
+		if (write_ok)
+			write_ok = new_scan.write((uint8_t *)&spike, sizeof(spike)) == sizeof(spike);
+	}
+	if (old_scan)
+		old_scan.close();
+
+	// Chunked forward read — one SD read per chunk instead of one seek
+	// per record, and no seeks back for spikes.
+	#define SCAN_BASE_BUF  1024
+	int      buf_size = ((SCAN_BASE_BUF + m_rec_size - 1) / m_rec_size) * m_rec_size;
+	uint8_t  stack_buffer[buf_size];
+
+	int first_file = resume ? hdr.num_segs - 1 : 0;
+	for (int file_num = first_file; file_num < num_files; file_num++)
+	{
+		scanSeg_t *seg = &segs[file_num];
+		if (file_num >= (int) hdr.num_segs)
+		{
+			memset(seg, 0, sizeof(scanSeg_t));
+			seg->key = m_seg_type ? segmentKey(file_num) : 0;
+			seg->first_idx = hdr.num_recs;
+			hdr.num_segs = file_num + 1;
+
+			// spikes do not extend back into the previous file
+
+			hdr.num_stack = 0;
+			hdr.file_first_idx = 0;
+			hdr.file_first_dt = 0;
+		}
+
+		String filename = dataFilename(file_num);
+		File file = SD.open(filename.c_str(), FILE_READ);
+		if (!file)
+		{
+			LOGE("scanFile() could not open %s", filename.c_str());
+			write_ok = false;
+			if (!m_seg_type)
+			{
+				delete[] segs;
+				delete[] stack;
+				if (new_scan)
+				{
+					new_scan.close();
+					SD.remove(tmp_name.c_str());
+				}
+				return "";
+			}
+			continue;
+		}
+
+		uint32_t size        = file.size();
+		uint32_t base        = seg->first_idx;	// index of the first record in this file
+		uint32_t rec_idx     = seg->num_recs;	// within this file
+		uint32_t file_offset = rec_idx * m_rec_size;
+
+		#if DEBUG_SCAN
+			scanned += size / m_rec_size - rec_idx;
+		#endif
+		hdr.num_recs += size / m_rec_size - rec_idx;
+		seg->num_recs = size / m_rec_size;
+
+		while (file_offset < size)
+		{
+			int to_read = (int)min((uint32_t)buf_size, size - file_offset);
+			to_read = (to_read / m_rec_size) * m_rec_size;
+			if (to_read == 0) break;
+
+			if (!file.seek(file_offset)) break;
+			int got = file.read(stack_buffer, to_read);
+			if (got <= 0) break;
+
+			int recs_in_chunk = got / m_rec_size;
+			for (int r = 0; r < recs_in_chunk; r++, rec_idx++)
+			{
+				uint32_t dt;
+				memcpy(&dt, stack_buffer + r * m_rec_size, 4);
+
+				if (dt == 0) { hdr.tombstones++; seg->tombstones++; continue; }
+				if (!hdr.first_dt) hdr.first_dt = dt;
+				if (!seg->first_dt) seg->first_dt = dt;
+				if (!hdr.file_first_dt)
+				{
+					hdr.file_first_idx = base + rec_idx;
+					hdr.file_first_dt = dt;
+				}
+
+				// the top of the stack is always the previous record
+
+				uint32_t num = hdr.num_stack;
+				if (num)
+					stack[num - 1].next_dt = dt;
+
+				if (hdr.last_dt && dt < hdr.last_dt)
+				{
+					// Drop-back: the entries later than dt are the spike
+
+					while (num && stack[num - 1].dt > dt)
+						num--;
+
+					scanSpike_t spike;
+					spike.next_dt   = dt;
+					spike.end_idx   = base + rec_idx - 1;
+					spike.last_dt   = hdr.last_dt;
+					if (num)
+					{
+						spike.start_idx = stack[num - 1].idx + 1;
+						spike.first_dt  = stack[num - 1].next_dt;
+						spike.prev_dt   = stack[num - 1].dt;
+					}
+					else if (hdr.file_first_idx < base + rec_idx)
+					{
+						spike.start_idx = hdr.file_first_idx;
+						spike.first_dt  = hdr.file_first_dt;
+						spike.prev_dt   = 0;
+					}
+					else	// first record in the file
+					{
+						spike.start_idx = spike.end_idx;
+						spike.first_dt  = hdr.last_dt;
+						spike.prev_dt   = 0;
+					}
+
+					spike.count = spike.end_idx - spike.start_idx + 1;
+					addSpikeJson(spikes_json, &spike, hdr.num_spikes);
+					hdr.num_spikes++;
+					if (write_ok)
+						write_ok = new_scan.write((uint8_t *)&spike, sizeof(spike)) == sizeof(spike);
+				}
+
+				if (num == SPIKE_STACK)
+					num = thinStack(stack, num);
+				stack[num].idx = base + rec_idx;
+				stack[num].dt = dt;
+				stack[num].next_dt = 0;
+				hdr.num_stack = num + 1;
+
+				hdr.last_dt = dt;
+				seg->last_dt = dt;
+			}
+
+			file_offset += got;
+		}
+
+		file.close();
+	}
+
+	spikes_json += "]";
+
+	String segs_json = "[";
+	for (uint32_t n = 0; n < hdr.num_segs; n++)
+	{
+		scanSeg_t *seg = &segs[n];
+		if (n) segs_json += ",";
+		segs_json += "{";
+		segs_json += "\"name\":\""       + dataFilename(n).substring(1) + "\",";
+		segs_json += "\"first_idx\":"    + String(seg->first_idx)  + ",";
+		segs_json += "\"num_recs\":"     + String(seg->num_recs)   + ",";
+		segs_json += "\"first_dt\":"     + String(seg->first_dt)   + ",";
+		segs_json += "\"last_dt\":"      + String(seg->last_dt)    + ",";
+		segs_json += "\"tombstones\":"   + String(seg->tombstones);
+		segs_json += "}";
+	}
+	segs_json += "]";
+
+	// finish the checkpoint
+
+	if (write_ok)
+	{
+		int segs_bytes = hdr.num_segs * sizeof(scanSeg_t);
+		int stack_bytes = hdr.num_stack * sizeof(scanStack_t);
+		write_ok =
+			hdr.num_segs &&
+			new_scan.write((uint8_t *)segs, segs_bytes) == segs_bytes &&
+			new_scan.write((uint8_t *)stack, stack_bytes) == stack_bytes &&
+			new_scan.seek(0) &&
+			new_scan.write((uint8_t *)&hdr, sizeof(hdr)) == sizeof(hdr);
+	}
+	if (new_scan)
+		new_scan.close();
+	if (write_ok)
+	{
+		if (SD.exists(scan_name.c_str()))
+			SD.remove(scan_name.c_str());
+		write_ok = SD.rename(tmp_name.c_str(), scan_name.c_str());
+	}
+	if (!write_ok)
+	{
+		LOGW("scanFile() could not write %s",scan_name.c_str());
+		SD.remove(tmp_name.c_str());
+	}
+	delete[] segs;
+	delete[] stack;
+
+	#if DEBUG_SCAN
+		LOGD("scanFile(%s) %s read %d/%d records in %d ms",
+			m_name,resume?"resumed":"full",scanned,hdr.num_recs,millis()-start_ms);
+	#endif
+
+	String result = "{";
+	result += "\"num_recs\":"      + String(hdr.num_recs)   + ",";
+	result += "\"first_dt\":"      + String(hdr.first_dt)   + ",";
+	result += "\"last_dt\":"       + String(hdr.last_dt)    + ",";
+	result += "\"tombstones\":"    + String(hdr.tombstones) + ",";
+	result += "\"spikes\":"        + spikes_json            + ",";
+	if (m_seg_type)
+		result += "\"segments\":"  + segs_json              + ",";
+	result += "\"pending\":"       + String(m_pend_count)   + ",";
+	result += "\"pending_dropped\":" + String(m_pend_dropped) + ",";
+	result += "\"needs_compact\":" + String(hdr.tombstones > 0 ? "true" : "false");
+	result += "}";
+	return result;
+}
+
+
+#endif	// WITH_SD
@@ -0,0 +1,188 @@
+//-----------------------------------------------
+// myIOTDataLogSchema.h - compile time datalog record layout
+//-----------------------------------------------
+// myIOTDataLogT<> is a myIOTDataLog whose column types are template
+// parameters, so the offsets and record size are known at compile time,
+// and clients get typed access to the record instead of filling
+// logRecord_t bytes with pointer casts:
+//
+//		myIOTDataLogT<
+//			LOG_COL_TYPE_CENTIGRADE_RAW,
+//			LOG_COL_TYPE_CENTIGRADE_RAW,
+//			LOG_COL_TYPE_UINT8 > data_log("fridge", {
+//				{ "temp1", 5 },
+//				{ "temp2", 5 },
+//				{ "state", 1 } });
+//
+//		myIOTDataLogT<...>::Record rec;
+//		rec.set<0>(raw1);
+//		rec.set<1>(raw2);
+//		rec.set<2>(state);
+//		data_log.addRecord(rec);
+//
+// C++11 does not allow string literals as template parameters, so
+// the column names and tick intervals are passed to the constructor.
+// They are checked to be the right number at compile time and become
+// the same logColumn_t array a client would otherwise declare, so the
+// file format and chart header are exactly the same as before.
+//
+// Values are in the column's stored units, i.e. CENTIGRADE_RAW is the
+// int16_t DS18B20 reading and UINT8x10 is the value divided by 10.
+// The static get<>() and set<>() methods work on any record pointer
+// so that decode and aggregation loops can be written per schema.
+
+#pragma once
+
+#include "myIOTDataLog.h"
+
+
+template <uint32_t TYPE> struct logColType;
+
+	// the stored C type of each column type
+
+#define LOG_COL_STORED(TYPE, CTYPE) \
+	template <> struct logColType<TYPE> { \
+		typedef CTYPE type; \
+		static const int size = sizeof(CTYPE); };
+
+LOG_COL_STORED(LOG_COL_TYPE_UINT32,			uint32_t)
+LOG_COL_STORED(LOG_COL_TYPE_UINT16,			uint16_t)
+LOG_COL_STORED(LOG_COL_TYPE_UINT8,			uint8_t)
+LOG_COL_STORED(LOG_COL_TYPE_UINT8x10,		uint8_t)
+LOG_COL_STORED(LOG_COL_TYPE_INT32,			int32_t)
+LOG_COL_STORED(LOG_COL_TYPE_INT16,			int16_t)
+LOG_COL_STORED(LOG_COL_TYPE_INT8,			int8_t)
+LOG_COL_STORED(LOG_COL_TYPE_FLOAT32,		float)
+LOG_COL_STORED(LOG_COL_TYPE_CENTIGRADE32,	float)
+LOG_COL_STORED(LOG_COL_TYPE_CENTIGRADE_RAW,	int16_t)
+LOG_COL_STORED(LOG_COL_TYPE_CENTIGRADE8,	uint8_t)
+LOG_COL_STORED(LOG_COL_TYPE_INT16_10,		int16_t)
+
+#undef LOG_COL_STORED
+
+
+//------------------------------------
+// offsets and sizes
+//------------------------------------
+
+template <uint32_t... TYPES> struct logSchemaSize;
+
+template <> struct logSchemaSize<>
+{
+	static const int value = 4;		// the dt
+};
+
+template <uint32_t FIRST, uint32_t... REST> struct logSchemaSize<FIRST, REST...>
+{
+	static const int value = logColType<FIRST>::size + logSchemaSize<REST...>::value;
+};
+
+
+template <int COL, uint32_t... TYPES> struct logSchemaCol;
+	// the type and offset of column COL
+
+template <uint32_t FIRST, uint32_t... REST> struct logSchemaCol<0, FIRST, REST...>
+{
+	static const uint32_t type = FIRST;
+	static const int offset = 4;
+};
+
+template <int COL, uint32_t FIRST, uint32_t... REST> struct logSchemaCol<COL, FIRST, REST...>
+{
+	static const uint32_t type = logSchemaCol<COL - 1, REST...>::type;
+	static const int offset = logColType<FIRST>::size + logSchemaCol<COL - 1, REST...>::offset;
+};
+
+
+//------------------------------------
+// myIOTDataLogT
+//------------------------------------
+
+typedef struct {
+	const char *name;
+	float tick_interval;
+} logColName_t;
+
+
+template <int NUM_COLS> struct logSchemaCols
+	// base-from-member so the columns exist before
+	// the myIOTDataLog constructor looks at them
+{
+	logColumn_t m_schema_col[NUM_COLS];
+};
+
+
+template <uint32_t... TYPES>
+class myIOTDataLogT :
+	private logSchemaCols<sizeof...(TYPES)>,
+	public myIOTDataLog
+{
+public:
+
+	static const int NUM_COLS = sizeof...(TYPES);
+	static const int REC_SIZE = logSchemaSize<TYPES...>::value;
+
+	static_assert(NUM_COLS > 0 && NUM_COLS <= DATA_COLS_MAX, "myIOTDataLogT: bad number of columns");
+
+	template <int COL> struct col
+	{
+		static_assert(COL >= 0 && COL < NUM_COLS, "myIOTDataLogT: no such column");
+		static const uint32_t type = logSchemaCol<COL, TYPES...>::type;
+		static const int offset = logSchemaCol<COL, TYPES...>::offset;
+		typedef typename logColType<type>::type value_t;
+	};
+
+	template <int COL> static typename col<COL>::value_t get(const uint8_t *rec)
+	{
+		typename col<COL>::value_t val;
+		memcpy(&val, rec + col<COL>::offset, sizeof(val));
+		return val;
+	}
+	template <int COL> static void set(uint8_t *rec, typename col<COL>::value_t val)
+	{
+		memcpy(rec + col<COL>::offset, &val, sizeof(val));
+	}
+
+	struct Record
+	{
+		uint8_t bytes[REC_SIZE];
+
+		Record() { memset(bytes, 0, REC_SIZE); }
+
+		uint32_t dt() const { uint32_t dt; memcpy(&dt, bytes, 4); return dt; }
+		template <int COL> typename col<COL>::value_t get() const { return myIOTDataLogT::get<COL>(bytes); }
+		template <int COL> void set(typename col<COL>::value_t val) { myIOTDataLogT::set<COL>(bytes, val); }
+	};
+
+	myIOTDataLogT(const char *name, const logColName_t (&names)[sizeof...(TYPES)]) :
+		logSchemaCols<sizeof...(TYPES)>(makeCols(names)),
+		myIOTDataLog(name, NUM_COLS, this->m_schema_col)
+	{}
+
+	using myIOTDataLog::addRecord;
+	bool addRecord(Record &rec)
+		// assigns the dt field of the record
+	{
+		return myIOTDataLog::addRecord(rec.bytes);
+	}
+
+private:
+
+	// copying would leave the base pointing at the other object's columns
+
+	myIOTDataLogT(const myIOTDataLogT &);
+	myIOTDataLogT &operator=(const myIOTDataLogT &);
+
+	static logSchemaCols<sizeof...(TYPES)> makeCols(const logColName_t (&names)[sizeof...(TYPES)])
+	{
+		static const uint32_t types[] = { TYPES... };
+		logSchemaCols<sizeof...(TYPES)> cols;
+		for (int i=0; i<NUM_COLS; i++)
+		{
+			cols.m_schema_col[i].name = names[i].name;
+			cols.m_schema_col[i].type = types[i];
+			cols.m_schema_col[i].tick_interval = names[i].tick_interval;
+		}
+		return cols;
+	}
+};
@@ -0,0 +1,340 @@
+//-----------------------------------------------
+// myIOTDataLogSegment.cpp - time segmented datalogs
+//-----------------------------------------------
+// In segmented mode the datalog is a series of files, one per day,
+// week (starting Sunday), or month, named "name.YYYYMMDD.datalog" for
+// the local date of the start of the period, so that trimBefore() can
+// delete whole files instead of rewriting the datalog.
+//
+// The "name.segs" manifest is an array of uint32_t period starts, one
+// per segment, in order.  Only the count and newest one are kept in memory.
+//
+// Records are appended to the newest segment unless they belong to a
+// later period, in which case they start a new one.  Out of order
+// records (clock spikes) stay in the segment they arrived in, so the
+// segments, like a single datalog, are in the order records were added,
+// and the backwards iteration reads across them without noticing.
+
+#include "myIOTDataLog.h"
+#include "myIOTLog.h"
+
+#if WITH_SD
+
+#define DEBUG_SEGMENT	0
+
+
+static uint32_t daysFromCivil(int y, int m, int d)
+	// days since 1970-01-01 for a proleptic gregorian date
+{
+	y -= m <= 2;
+	int era = (y >= 0 ? y : y - 399) / 400;
+	int yoe = y - era * 400;
+	int doy = (153 * (m + (m > 2 ? -3 : 9)) + 2) / 5 + d - 1;
+	int doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+	return era * 146097 + doe - 719468;
+}
+
+
+
+void myIOTDataLog::setSegments(int seg_type)
+{
+	m_seg_type = seg_type;
+	m_seg_count = -1;
+	m_seg_last = 0;
+	if (m_seg_type && m_idx_every)
+	{
+		LOGW("myIOTDataLog(%s) time index disabled for segmented datalog",m_name);
+		setIndexInterval(0);
+	}
+	if (m_seg_type && m_z_block)
+	{
+		LOGW("myIOTDataLog(%s) compression disabled for segmented datalog",m_name);
+		setCompression(0);
+	}
+	if (m_seg_type && m_c_recs)
+	{
+		LOGW("myIOTDataLog(%s) columnar blocks disabled for segmented datalog",m_name);
+		setColumnar(0);
+	}
+}
+
+
+String myIOTDataLog::segmentsFilename()
+{
+	String filename = "/";
+	filename += m_name;
+	filename += ".segs";
+	return filename;
+}
+
+
+String myIOTDataLog::segmentFilename(uint32_t key)
+{
+	time_t t = key;
+	struct tm tm;
+	gmtime_r(&t,&tm);		// dt's are local times
+
+	char buf[40];
+	sprintf(buf,".%04d%02d%02d",tm.tm_year + 1900,tm.tm_mon + 1,tm.tm_mday);
+
+	String filename = "/";
+	filename += m_name;
+	filename += buf;
+	filename += ".datalog";
+	return filename;
+}
+
+
+uint32_t myIOTDataLog::segmentStart(uint32_t dt)
+	// returns the start of the period containing dt
+{
+	uint32_t days = dt / 86400;
+	if (m_seg_type == LOG_SEGMENT_WEEK)
+	{
+		days -= (days + 4) % 7;		// 1970-01-01 was a Thursday
+	}
+	else if (m_seg_type == LOG_SEGMENT_MONTH)
+	{
+		time_t t = dt;
+		struct tm tm;
+		gmtime_r(&t,&tm);
+		days = daysFromCivil(tm.tm_year + 1900, tm.tm_mon + 1, 1);
+	}
+	return days * 86400;
+}
+
+
+//-----------------------------------------
+// manifest
+//-----------------------------------------
+
+bool myIOTDataLog::loadSegments()
+	// Reads the segment count and newest segment from the manifest.
+	// If there is no manifest, an existing single datalog becomes
+	// the first segment.
+{
+	m_seg_count = 0;
+	m_seg_last = 0;
+
+	String segs_name = segmentsFilename();
+	File segs = SD.open(segs_name.c_str(), FILE_READ);
+	if (segs)
+	{
+		m_seg_count = segs.size() / 4;
+		if (m_seg_count &&
+			(!segs.seek((m_seg_count - 1) * 4) ||
+			 segs.read((uint8_t *)&m_seg_last,4) != 4))
+		{
+			LOGE("loadSegments() could not read %s",segs_name.c_str());
+			m_seg_count = -1;
+		}
+		segs.close();
+
+		#if DEBUG_SEGMENT
+			LOGD("loadSegments(%s) %d segments, newest %s",
+				m_name,m_seg_count,timeToString(m_seg_last).c_str());
+		#endif
+		return m_seg_count >= 0;
+	}
+
+	String filename = dataFilename();
+	File file = SD.open(filename.c_str(), FILE_READ);
+	if (!file)
+		return true;
+
+	uint32_t first_dt = 0;
+	file.read((uint8_t *)&first_dt,4);
+	file.close();
+
+	uint32_t key = segmentStart(first_dt ? first_dt : time(NULL));
+	String seg_name = segmentFilename(key);
+	if (!SD.rename(filename.c_str(), seg_name.c_str()) ||
+		!newSegment(key))
+	{
+		LOGE("loadSegments() could not convert %s to %s",filename.c_str(),seg_name.c_str());
+		m_seg_count = -1;
+		return false;
+	}
+
+	LOGI("loadSegments() converted %s to %s",filename.c_str(),seg_name.c_str());
+	return true;
+}
+
+
+bool myIOTDataLog::newSegment(uint32_t key)
+{
+	String segs_name = segmentsFilename();
+	File segs = SD.open(segs_name.c_str(), FILE_APPEND);
+	bool ok = segs && segs.write((uint8_t *)&key,4) == 4;
+	if (segs)
+		segs.close();
+
+	if (!ok)
+	{
+		LOGE("newSegment() could not append to %s",segs_name.c_str());
+		m_seg_count = -1;
+		return false;
+	}
+
+	m_seg_count++;
+	m_seg_last = key;
+
+	#if DEBUG_SEGMENT
+		LOGD("newSegment(%s) %d %s",m_name,m_seg_count-1,segmentFilename(key).c_str());
+	#endif
+	return true;
+}
+
+
+uint32_t myIOTDataLog::segmentKey(int n)
+	// returns the period start of the nth segment or 0 on error
+{
+	if (n == m_seg_count - 1)
+		return m_seg_last;
+
+	uint32_t key = 0;
+	File segs = SD.open(segmentsFilename().c_str(), FILE_READ);
+	if (segs)
+	{
+		if (!segs.seek(n * 4) ||
+			segs.read((uint8_t *)&key,4) != 4)
+			key = 0;
+		segs.close();
+	}
+	if (!key)
+		LOGE("segmentKey(%s,%d) could not read manifest",m_name,n);
+	return key;
+}
+
+
+int myIOTDataLog::findSegment(uint32_t key)
+	// returns the first segment whose period starts at or after key
+{
+	int n = numDataFiles();
+	while (n > 0 && segmentKey(n - 1) >= key)
+		n--;
+	return n;
+}
+
+
+bool myIOTDataLog::removeSegments(int num)
+	// remove the num oldest segments and their manifest entries
+{
+	if (num <= 0)
+		return true;
+
+	String segs_name = segmentsFilename();
+	String tmp_name = segs_name + ".tmp";
+
+	File segs = SD.open(segs_name.c_str(), FILE_READ);
+	if (!segs)
+	{
+		LOGE("removeSegments() could not open %s",segs_name.c_str());
+		return false;
+	}
+
+	for (int n = 0; n < num; n++)
+	{
+		uint32_t key = 0;
+		segs.seek(n * 4);
+		segs.read((uint8_t *)&key,4);
+		String filename = segmentFilename(key);
+		if (SD.exists(filename.c_str()))
+			SD.remove(filename.c_str());
+		LOGI("removeSegments() removed %s",filename.c_str());
+	}
+
+	// copy the remaining entries to a new manifest
+
+	if (SD.exists(tmp_name.c_str()))
+		SD.remove(tmp_name.c_str());
+	File tmp = SD.open(tmp_name.c_str(), FILE_WRITE);
+	bool ok = tmp && segs.seek(num * 4);
+
+	uint8_t buf[256];
+	int got;
+	while (ok && (got = segs.read(buf, sizeof(buf))) > 0)
+		ok = tmp.write(buf, got) == got;
+
+	segs.close();
+	if (tmp)
+		tmp.close();
+
+	if (ok)
+	{
+		SD.remove(segs_name.c_str());
+		ok = SD.rename(tmp_name.c_str(), segs_name.c_str());
+	}
+	if (!ok)
+		LOGE("removeSegments() could not rewrite %s",segs_name.c_str());
+
+	// re-read the manifest either way
+
+	return loadSegments() && ok;
+}
+
+
+//-----------------------------------------
+// data files
+//-----------------------------------------
+
+int myIOTDataLog::numDataFiles()
+{
+	if (!m_seg_type)
+		return 1;
+	if (m_seg_count < 0 && !loadSegments())
+		return 0;
+	return m_seg_count;
+}
+
+
+String myIOTDataLog::dataFilename(int n)
+{
+	if (!m_seg_type)
+		return dataFilename();
+	return segmentFilename(segmentKey(n));
+}
+
+
+bool myIOTDataLog::appendSegments(const uint8_t *recs, int num_recs)
+	// appends runs of records to the newest segment, starting
+	// new segments as needed, then adds them to the rollups.
+{
+	if (m_seg_count < 0 && !loadSegments())
+		return false;
+
+	bool ok = true;
+	int done = 0;
+	while (ok && done < num_recs)
+	{
+		int n = 0;
+		while (done + n < num_recs)
+		{
+			uint32_t dt;
+			memcpy(&dt, recs + (done + n) * m_rec_size, 4);
+			uint32_t key = segmentStart(dt);
+			if (!m_seg_count || key > m_seg_last)
+			{
+				if (n)
+					break;		// write the run so far first
+				ok = newSegment(key);
+				if (!ok)
+					break;
+			}
+			n++;
+		}
+
+		uint32_t size;
+		if (ok)
+			ok = appendToFile(segmentFilename(m_seg_last), recs + done * m_rec_size, n, &size);
+		if (ok)
+			done += n;
+	}
+
+	if (done && m_rollup)
+		rollupRecords(recs, done);
+	return ok;
+}
+
+
+#endif	// WITH_SD
@@ -0,0 +1,368 @@
+//-----------------------------------------------
+// myIOTDataLogStats.cpp - column ranges for the chart header
+//-----------------------------------------------
+// setRunningStats() keeps a logAccum_t of all of the records in the
+// datalog.  appendRecords() adds the records to it and saves it in
+// "name.stats" before it appends them:
+//
+//		statsHeader_t		magic, version, rec_size
+//		rollup record		the dt of the newest record, the count, and
+//							the min, max, and sum of each column
+//
+// so a power loss can leave it with records the datalog does not have,
+// but not the other way around, and the ranges in the chart header are
+// never narrower than the data.  The sidecar is not used if the datalog
+// has a newer record than it, i.e. one appended while the stats were
+// not enabled.
+//
+// A min or max can not be taken back, so the tombstone methods and
+// trimBefore() remove the sidecar, and the stats are rebuilt by one pass
+// over the datalog, as for getColStats(), the next time they are needed.
+// Records appended in the meantime are left to that pass.  compactFile()
+// does not change them.
+//
+// For the last range_secs, getChartHeader() uses the rollups, if any:
+// the closed buckets that overlap the range, from the level that has at
+// least RANGE_MIN_BUCKETS of them, found by binary search, and then the
+// open buckets, as in sendChartData().  Without rollups it uses the stats
+// of the whole datalog.  The write-behind buffer is added in either case.
+
+#include "myIOTDataLog.h"
+#include "myIOTLog.h"
+
+#define DEBUG_STATS		0
+
+#define STATS_MAGIC		0x54415453		// "STAT"
+#define STATS_VERSION	1
+
+#define STATS_UNKNOWN	0		// the sidecar has not been read
+#define STATS_VALID		1
+#define STATS_STALE		2		// to be rebuilt by colRanges()
+
+#define RANGE_MIN_BUCKETS	64
+#define RANGE_BUF			1024
+
+
+#if WITH_SD
+
+typedef struct {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t rec_size;
+} statsHeader_t;
+
+
+String myIOTDataLog::statsFilename()
+{
+	String filename = "/";
+	filename += m_name;
+	filename += ".stats";
+	return filename;
+}
+
+
+void myIOTDataLog::setRunningStats(bool enable)
+{
+	if (enable && !m_stats)
+	{
+		m_stats = new logAccum_t;
+		accumClear(m_stats);
+		m_stats_last = 0;
+		m_stats_state = STATS_UNKNOWN;
+	}
+	else if (!enable && m_stats)
+	{
+		delete m_stats;
+		m_stats = NULL;
+	}
+}
+
+
+uint32_t myIOTDataLog::newestDt()
+	// the dt of the last record on the card, or 0 if there are none
+{
+	int num_files = numDataFiles();
+	if (!num_files)
+		return 0;
+
+	uint32_t dt = 0;
+	if (m_c_recs)
+	{
+		File open = SD.open(colOpenFilename().c_str(), FILE_READ);
+		if (open)
+		{
+			uint32_t num = open.size() / m_rec_size;
+			if (num && open.seek((num - 1) * m_rec_size) &&
+				open.read((uint8_t *)&dt, 4) != 4)
+				dt = 0;
+			open.close();
+		}
+		if (dt)
+			return dt;
+	}
+
+	File file = SD.open(dataFilename(num_files - 1).c_str(), FILE_READ);
+	if (!file)
+		return 0;
+	uint32_t size = file.size();
+	if (m_z_block || m_c_recs)
+	{
+		uint8_t buf[blockBufSize()];
+		int num = size && file.seek(((size - 1) / blockBytes()) * blockBytes()) ?
+			readBlock(file, buf) : 0;
+		if (num > 0)
+			memcpy(&dt, &buf[(num - 1) * m_rec_size], 4);
+	}
+	else if (size >= (uint32_t) m_rec_size)
+	{
+		if (!file.seek((size / m_rec_size - 1) * m_rec_size) ||
+			file.read((uint8_t *)&dt, 4) != 4)
+			dt = 0;
+	}
+	file.close();
+	return dt;
+}
+
+
+bool myIOTDataLog::loadStats()
+{
+	int rollup_size = getRollupRecSize();
+	uint8_t rec[rollup_size];
+	statsHeader_t hdr;
+
+	String filename = statsFilename();
+	File file = SD.open(filename.c_str(), FILE_READ);
+	bool ok = file &&
+		file.size() == sizeof(hdr) + rollup_size &&
+		file.read((uint8_t *)&hdr, sizeof(hdr)) == sizeof(hdr) &&
+		hdr.magic    == STATS_MAGIC &&
+		hdr.version  == STATS_VERSION &&
+		hdr.rec_size == m_rec_size &&
+		file.read(rec, rollup_size) == rollup_size;
+	if (file)
+		file.close();
+
+	uint32_t last_dt = 0;
+	if (ok)
+	{
+		memcpy(&last_dt, rec, 4);
+		ok = newestDt() <= last_dt;
+	}
+	if (ok)
+	{
+		accumClear(m_stats);
+		accumRollup(m_stats, rec);
+		m_stats_last = last_dt;
+	}
+
+	#if DEBUG_STATS
+		LOGD("loadStats(%s) ok=%d count=%u last(%u)",m_name,ok,m_stats->count,last_dt);
+	#endif
+
+	m_stats_state = ok ? STATS_VALID : STATS_STALE;
+	return ok;
+}
+
+
+bool myIOTDataLog::saveStats()
+{
+	int rollup_size = getRollupRecSize();
+	uint8_t rec[rollup_size];
+	statsHeader_t hdr;
+	hdr.magic = STATS_MAGIC;
+	hdr.version = STATS_VERSION;
+	hdr.rec_size = m_rec_size;
+	accumToRollup(m_stats, m_stats_last, rec);
+
+	String filename = statsFilename();
+	File file = SD.open(filename.c_str(), FILE_WRITE);
+	bool ok = file &&
+		file.write((uint8_t *)&hdr, sizeof(hdr)) == sizeof(hdr) &&
+		file.write(rec, rollup_size) == rollup_size;
+	if (file)
+		file.close();
+	if (!ok)
+		LOGE("saveStats() could not write %s",filename.c_str());
+	return ok;
+}
+
+
+bool myIOTDataLog::recoverStats()
+	// rebuilds the stats from the datalog if the sidecar is not valid
+{
+	if (m_stats_state == STATS_UNKNOWN)
+		loadStats();
+	if (m_stats_state == STATS_VALID)
+		return true;
+
+	#if DEBUG_STATS
+		uint32_t start_ms = millis();
+	#endif
+
+	uint32_t counts[3] = {0,0,0};
+	accumClear(m_stats);
+	accumFiles(m_stats, 0, 0xffffffff, 0, counts);
+	m_stats_last = newestDt();
+	m_stats_state = STATS_VALID;
+	saveStats();
+
+	LOGI("myIOTDataLog(%s) rebuilt the running stats of %u records",m_name,m_stats->count);
+	#if DEBUG_STATS
+		LOGD("recoverStats(%s) in %u ms",m_name,(uint32_t) (millis() - start_ms));
+	#endif
+	return true;
+}
+
+
+void myIOTDataLog::statsRecords(const uint8_t *recs, int num_recs)
+{
+	if (m_stats_state == STATS_UNKNOWN)
+		loadStats();
+	if (m_stats_state != STATS_VALID)
+		return;
+
+	for (int r=0; r<num_recs; r++)
+	{
+		const uint8_t *rec = recs + r * m_rec_size;
+		uint32_t dt;
+		memcpy(&dt, rec, 4);
+		if (!dt)
+			continue;
+		accumRecord(m_stats, rec);
+		if (dt > m_stats_last)
+			m_stats_last = dt;
+	}
+	saveStats();
+}
+
+
+void myIOTDataLog::invalidateStats()
+{
+	String filename = statsFilename();
+	if (SD.exists(filename.c_str()))
+		SD.remove(filename.c_str());
+	m_stats_state = STATS_STALE;
+}
+
+
+bool myIOTDataLog::rollupRanges(logAccum_t *acc, uint32_t from_dt)
+{
+	uint32_t now = time(NULL);
+	uint32_t span = now > from_dt ? now - from_dt : 0;
+	int level = 0;
+	while (level < m_num_rollups - 1 &&
+		   m_rollup[level + 1].secs * RANGE_MIN_BUCKETS <= span)
+		level++;
+	if (!recoverRollups(level))
+		return false;
+
+	uint32_t secs = m_rollup[level].secs;
+	int rollup_size = getRollupRecSize();
+	String filename = rollupFilename(level);
+	File file = SD.open(filename.c_str(), FILE_READ);
+	if (file)
+	{
+		// the first closed bucket that ends after from_dt
+
+		uint32_t lo = 0;
+		uint32_t hi = file.size() / rollup_size;
+		while (lo < hi)
+		{
+			uint32_t mid = (lo + hi) / 2;
+			uint32_t dt = 0;
+			if (!file.seek(mid * rollup_size) ||
+				file.read((uint8_t *)&dt, 4) != 4)
+				break;
+			if (dt + secs <= from_dt)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+
+		int per_buf = max(1, RANGE_BUF / rollup_size);
+		uint8_t buf[per_buf * rollup_size];
+		int got;
+		file.seek(lo * rollup_size);
+		while ((got = file.read(buf, per_buf * rollup_size)) >= rollup_size)
+		{
+			for (int i=0; i<got / rollup_size; i++)
+				accumRollup(acc, &buf[i * rollup_size]);
+		}
+		file.close();
+	}
+
+	// the open buckets of the level and those below it hold
+	// the records since the end of the rollup file
+
+	for (int l=0; l<=level; l++)
+	{
+		logRollup_t *rollup = &m_rollup[l];
+		if (rollup->acc.count && rollup->bucket_dt + rollup->secs > from_dt)
+			accumMerge(acc, &rollup->acc);
+	}
+
+	#if DEBUG_STATS
+		LOGD("rollupRanges(%s) from(%u) level(%d) count=%u",m_name,from_dt,level,acc->count);
+	#endif
+	return true;
+}
+
+
+bool myIOTDataLog::colRanges(logAccum_t *acc, uint32_t from_dt)
+	// not while a job may be changing the datalog or rebuilding the rollups,
+	// and not while the writer task of a queue is appending to it
+{
+	if (!m_stats || m_job_busy)
+		return false;
+
+	logJobLock lock(this);
+	accumClear(acc);
+	if (!from_dt || !m_rollup || !rollupRanges(acc, from_dt))
+	{
+		accumClear(acc);
+		if (!recoverStats())
+			return false;
+		accumMerge(acc, m_stats);
+	}
+
+	for (int i=0; i<m_wb_count; i++)
+	{
+		const uint8_t *rec = &m_wb_buf[i * m_rec_size];
+		uint32_t dt;
+		memcpy(&dt, rec, 4);
+		if (dt && dt >= from_dt)
+			accumRecord(acc, rec);
+	}
+	return acc->count > 0;
+}
+
+
+#else	// !WITH_SD
+
+
+void myIOTDataLog::setRunningStats(bool enable)
+{
+	m_ram_stats = enable;
+}
+
+
+bool myIOTDataLog::colRanges(logAccum_t *acc, uint32_t from_dt)
+	// there is no sidecar, the ring buffer is in RAM
+{
+	if (!m_ram_stats)
+		return false;
+
+	accumClear(acc);
+	for (uint32_t n = 0; n < m_ram_count; n++)
+	{
+		const uint8_t *rec = ramRecord(n);
+		uint32_t dt;
+		memcpy(&dt, rec, 4);
+		if (dt && dt >= from_dt)
+			accumRecord(acc, rec);
+	}
+	return acc->count > 0;
+}
+
+
+#endif	// !WITH_SD
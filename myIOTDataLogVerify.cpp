@@ -0,0 +1,554 @@
+//-----------------------------------------------
+// myIOTDataLogVerify.cpp - block checksums and verifyFile()
+//-----------------------------------------------
+// The optional "name.crc" file contains a small header followed
+// by the CRC32 of each complete block of N records in the datalog.
+// The CRC of the partial block at the end is kept in RAM, and its
+// entry is appended by the append that completes the block.
+//
+// Tombstones change records in place, so tombstoneByDt() and
+// tombstoneRuns() recompute the checksums of the blocks they touched.
+// compactFile() and trimBefore() move the records, so they remove the
+// sidecar, which is then rebuilt the next time it is needed.  As with
+// the time index, the sidecar is checked against the datalog once per
+// boot, and the entries of any blocks that were appended without them
+// (a power loss between the two writes) are added then.
+//
+// verifyFile() reads the datalog and the sidecar once, front to back,
+// and reports the blocks whose records no longer match their checksum,
+// and any torn record, the partial record a power loss during an append
+// leaves at the end of a file.  The iterators ignore a torn record, and
+// appendToFile() makes it into a tombstone before appending after it.
+
+#include "myIOTDataLog.h"
+#include "myIOTLog.h"
+#include <rom/crc.h>
+
+#if WITH_SD
+
+#define DEBUG_CRC		0
+
+#define CRC_MAGIC		0x53435243		// "CRCS"
+#define CRC_VERSION		1
+
+#define VERIFY_MAX_BAD	32				// bad blocks listed by verifyFile()
+
+typedef struct {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t rec_size;
+	uint32_t every;
+	uint32_t reserved;
+} crcHeader_t;
+
+
+
+String myIOTDataLog::crcFilename()
+{
+	String filename = "/";
+	filename += m_name;
+	filename += ".crc";
+	return filename;
+}
+
+
+void myIOTDataLog::setChecksums(int every_n_recs)
+{
+	if (m_seg_type && every_n_recs > 0)
+	{
+		LOGW("myIOTDataLog(%s) checksums not used with segments",m_name);
+		every_n_recs = 0;
+	}
+	if (m_z_block && every_n_recs > 0)
+	{
+		LOGW("myIOTDataLog(%s) checksums not used with compression",m_name);
+		every_n_recs = 0;
+	}
+	if (m_c_recs && every_n_recs > 0)
+	{
+		LOGW("myIOTDataLog(%s) checksums not used with columnar blocks",m_name);
+		every_n_recs = 0;
+	}
+	m_crc_every = every_n_recs > 0 ? every_n_recs : 0;
+	m_crc_valid = false;
+	m_crc_count = 0;
+	m_crc_run = 0;
+}
+
+
+void myIOTDataLog::invalidateChecksums()
+{
+	m_crc_valid = false;
+	m_crc_count = 0;
+	m_crc_run = 0;
+	String crcname = crcFilename();
+	if (SD.exists(crcname.c_str()))
+		SD.remove(crcname.c_str());
+}
+
+
+static bool readCrcHeader(File &crc_file, int rec_size, int every)
+{
+	crcHeader_t hdr;
+	return
+		crc_file.read((uint8_t *)&hdr, sizeof(hdr)) == sizeof(hdr) &&
+		hdr.magic    == CRC_MAGIC &&
+		hdr.version  == CRC_VERSION &&
+		hdr.rec_size == rec_size &&
+		hdr.every    == (uint32_t) every &&
+		(crc_file.size() - sizeof(hdr)) % sizeof(uint32_t) == 0;
+}
+
+
+//-----------------------------------------
+// validateChecksums()
+//-----------------------------------------
+
+bool myIOTDataLog::validateChecksums(uint32_t num_recs)
+	// Called once per boot (or after invalidation) with the number
+	// of records in the datalog.  Starts a new sidecar if the header
+	// does not match, or it has more blocks than the datalog, then
+	// checksums the records after its last block, appending entries
+	// for the complete blocks, to establish the running CRC.
+{
+	if (m_crc_valid)
+		return true;
+
+	String crcname = crcFilename();
+	uint32_t blocks = num_recs / m_crc_every;
+	uint32_t have = 0;
+	uint32_t start_ms = millis();
+
+	bool ok = false;
+	File crc_file = SD.open(crcname.c_str(), FILE_READ);
+	if (crc_file)
+	{
+		ok = readCrcHeader(crc_file, m_rec_size, m_crc_every);
+		if (ok)
+		{
+			have = (crc_file.size() - sizeof(crcHeader_t)) / sizeof(uint32_t);
+			ok = have <= blocks;
+		}
+		crc_file.close();
+		if (!ok)
+			LOGW("validateChecksums(%s) stale checksums; rebuilding",m_name);
+	}
+
+	if (!ok)
+	{
+		have = 0;
+		if (SD.exists(crcname.c_str()))
+			SD.remove(crcname.c_str());
+
+		crcHeader_t hdr;
+		hdr.magic    = CRC_MAGIC;
+		hdr.version  = CRC_VERSION;
+		hdr.rec_size = m_rec_size;
+		hdr.every    = m_crc_every;
+		hdr.reserved = 0;
+
+		crc_file = SD.open(crcname.c_str(), FILE_WRITE);
+		ok = crc_file &&
+			 crc_file.write((uint8_t *)&hdr, sizeof(hdr)) == sizeof(hdr);
+		if (crc_file)
+			crc_file.close();
+		if (!ok)
+		{
+			LOGE("validateChecksums() could not create %s", crcname.c_str());
+			return false;
+		}
+	}
+
+	// checksum the records after the last block in the sidecar
+
+	uint32_t rec_idx = have * m_crc_every;
+	uint32_t crc = 0;
+
+	if (rec_idx < num_recs)
+	{
+		File file = SD.open(dataFilename().c_str(), FILE_READ);
+		ok = file && file.seek(rec_idx * m_rec_size);
+		if (ok && have < blocks)
+		{
+			crc_file = SD.open(crcname.c_str(), FILE_APPEND);
+			if (!crc_file)
+				ok = false;
+		}
+
+		#define CRC_BASE_BUF  1024
+		int buf_size = ((CRC_BASE_BUF + m_rec_size - 1) / m_rec_size) * m_rec_size;
+		uint8_t read_buf[buf_size];
+
+		while (ok && rec_idx < num_recs)
+		{
+			int to_read = (int)min((uint32_t)buf_size, (num_recs - rec_idx) * m_rec_size);
+			ok = file.read(read_buf, to_read) == to_read;
+			int recs = to_read / m_rec_size;
+			for (int r = 0; ok && r < recs; )
+			{
+				uint32_t fill = rec_idx % m_crc_every;
+				int n = min((uint32_t)(recs - r), m_crc_every - fill);
+				crc = crc32_le(fill ? crc : 0, read_buf + r * m_rec_size, n * m_rec_size);
+				r += n;
+				rec_idx += n;
+				if (rec_idx % m_crc_every == 0)
+					ok = crc_file.write((uint8_t *)&crc, sizeof(crc)) == sizeof(crc);
+			}
+		}
+
+		if (file)
+			file.close();
+		if (crc_file)
+			crc_file.close();
+	}
+
+	if (!ok)
+	{
+		LOGE("validateChecksums(%s) error at record %d",m_name,rec_idx);
+		SD.remove(crcname.c_str());
+		return false;
+	}
+
+	m_crc_count = blocks;
+	m_crc_run = num_recs % m_crc_every ? crc : 0;
+	m_crc_valid = true;
+
+	if (have < blocks)
+		LOGI("validateChecksums(%s) added %d blocks in %u ms",
+			 m_name, blocks - have, (uint32_t) (millis() - start_ms));
+	#if DEBUG_CRC
+		LOGD("validateChecksums(%s) ok %d blocks",m_name,m_crc_count);
+	#endif
+	return true;
+}
+
+
+//-----------------------------------------
+// crcRecords()
+//-----------------------------------------
+
+void myIOTDataLog::crcRecords(uint32_t first_idx, const uint8_t *recs, int num_recs)
+	// Called by appendRecords() after num_recs records, starting at
+	// record first_idx, have been appended to the datalog.
+{
+	if (!m_crc_valid && !validateChecksums(first_idx))
+		return;
+
+	String crcname = crcFilename();
+	File crc_file;
+	bool ok = true;
+
+	uint32_t rec_idx = first_idx;
+	for (int r = 0; ok && r < num_recs; )
+	{
+		uint32_t fill = rec_idx % m_crc_every;
+		int n = min((uint32_t)(num_recs - r), m_crc_every - fill);
+		m_crc_run = crc32_le(fill ? m_crc_run : 0, recs + r * m_rec_size, n * m_rec_size);
+		r += n;
+		rec_idx += n;
+
+		if (rec_idx % m_crc_every == 0)
+		{
+			if (!crc_file)
+				crc_file = SD.open(crcname.c_str(), FILE_APPEND);
+			ok = crc_file &&
+				 crc_file.write((uint8_t *)&m_crc_run, sizeof(m_crc_run)) == sizeof(m_crc_run);
+			if (ok)
+			{
+				m_crc_count++;
+				#if DEBUG_CRC
+					LOGD("crcRecords(%s) block(%d) crc=0x%08x",
+						m_name, m_crc_count - 1, m_crc_run);
+				#endif
+			}
+		}
+	}
+
+	if (crc_file)
+		crc_file.close();
+
+	if (!ok)
+	{
+		LOGE("crcRecords() could not append to %s", crcname.c_str());
+		m_crc_valid = false;
+	}
+}
+
+
+//-----------------------------------------
+// updateChecksums()
+//-----------------------------------------
+
+void myIOTDataLog::updateChecksums(uint32_t first_idx, uint32_t last_idx)
+	// Called after the records first_idx..last_idx have been
+	// changed in place to recompute the checksums of their blocks.
+{
+	String filename = dataFilename();
+	File file = SD.open(filename.c_str(), FILE_READ);
+	if (!file)
+		return;
+	uint32_t num_recs = file.size() / m_rec_size;
+	file.close();
+
+	// validating computes the running CRC from the changed
+	// records, so only the blocks already in the sidecar remain
+
+	if (!m_crc_valid && !validateChecksums(num_recs))
+		return;
+	if (last_idx >= num_recs)
+		last_idx = num_recs - 1;
+	if (first_idx > last_idx)
+		return;
+
+	uint32_t block = first_idx / m_crc_every;
+	uint32_t end_block = last_idx / m_crc_every;		// inclusive
+	uint32_t rec_idx = block * m_crc_every;
+	uint32_t end_idx = min((end_block + 1) * m_crc_every, num_recs);
+
+	file = SD.open(filename.c_str(), FILE_READ);
+	File crc_file = SD.open(crcFilename().c_str(), "r+");
+	bool ok = file && crc_file && file.seek(rec_idx * m_rec_size);
+
+	#define UPD_BASE_BUF  1024
+	int buf_size = ((UPD_BASE_BUF + m_rec_size - 1) / m_rec_size) * m_rec_size;
+	uint8_t read_buf[buf_size];
+
+	uint32_t crc = 0;
+	int updated = 0;
+	while (ok && rec_idx < end_idx)
+	{
+		int to_read = (int)min((uint32_t)buf_size, (end_idx - rec_idx) * m_rec_size);
+		ok = file.read(read_buf, to_read) == to_read;
+		int recs = to_read / m_rec_size;
+		for (int r = 0; ok && r < recs; )
+		{
+			uint32_t fill = rec_idx % m_crc_every;
+			int n = min((uint32_t)(recs - r), m_crc_every - fill);
+			crc = crc32_le(fill ? crc : 0, read_buf + r * m_rec_size, n * m_rec_size);
+			r += n;
+			rec_idx += n;
+
+			if (rec_idx % m_crc_every == 0)
+			{
+				ok = crc_file.seek(sizeof(crcHeader_t) + block * sizeof(uint32_t)) &&
+					 crc_file.write((uint8_t *)&crc, sizeof(crc)) == sizeof(crc);
+				block++;
+				updated++;
+			}
+			else if (rec_idx == num_recs)
+				m_crc_run = crc;
+		}
+	}
+
+	if (file)
+		file.close();
+	if (crc_file)
+		crc_file.close();
+
+	if (!ok)
+	{
+		LOGE("updateChecksums(%s) error; removing checksums",m_name);
+		invalidateChecksums();
+		return;
+	}
+
+	#if DEBUG_CRC
+		LOGD("updateChecksums(%s) %d..%d updated %d blocks",m_name,first_idx,last_idx,updated);
+	#endif
+}
+
+
+//-----------------------------------------
+// verifyFile()
+//-----------------------------------------
+
+String myIOTDataLog::verifyFile()
+{
+	logJobLock lock(this);
+	flush();
+	if (m_z_block || m_c_recs)
+	{
+		LOGE("verifyFile(%s) not supported for a %s datalog",m_name,m_z_block?"compressed":"columnar");
+		return "";
+	}
+	uint32_t start_ms = millis();
+
+	// The sidecar is only read.  Blocks without an entry, and the
+	// partial block if the running CRC has not been established
+	// since boot, are reported as unchecked records.
+
+	File crc_file;
+	uint32_t num_sums = 0;
+	if (m_crc_every)
+	{
+		crc_file = SD.open(crcFilename().c_str(), FILE_READ);
+		if (crc_file && readCrcHeader(crc_file, m_rec_size, m_crc_every))
+			num_sums = (crc_file.size() - sizeof(crcHeader_t)) / sizeof(uint32_t);
+		else if (crc_file)
+		{
+			LOGW("verifyFile(%s) stale checksums",m_name);
+			crc_file.close();
+		}
+	}
+
+	#define VERIFY_BASE_BUF  1024
+	int buf_size = ((VERIFY_BASE_BUF + m_rec_size - 1) / m_rec_size) * m_rec_size;
+	uint8_t read_buf[buf_size];
+
+	#define VERIFY_SUMS  64
+	uint32_t sums[VERIFY_SUMS];
+	uint32_t sums_base = 0;			// block number of sums[0]
+	uint32_t sums_got = 0;
+
+	uint32_t num_recs = 0;
+	uint32_t tombstones = 0;
+	uint32_t torn_bytes = 0;
+	uint32_t checked = 0;			// blocks
+	uint32_t num_bad = 0;
+	uint32_t crc = 0;
+	bool read_ok = true;
+
+	String bad_json = "[";
+	String torn_json = "[";
+
+	int num_files = numDataFiles();
+	for (int file_num = 0; read_ok && file_num < num_files; file_num++)
+	{
+		String filename = dataFilename(file_num);
+		File file = SD.open(filename.c_str(), FILE_READ);
+		if (!file)
+		{
+			if (!m_seg_type)
+				break;		// no datalog yet
+			LOGE("verifyFile() could not open %s", filename.c_str());
+			read_ok = false;
+			break;
+		}
+
+		uint32_t size = file.size();
+		uint32_t torn = size % m_rec_size;
+		if (torn)
+		{
+			if (torn_bytes) torn_json += ",";
+			torn_json += "{\"name\":\"" + filename.substring(1) + "\",";
+			torn_json += "\"offset\":" + String(size - torn) + ",";
+			torn_json += "\"bytes\":"  + String(torn) + "}";
+			torn_bytes += torn;
+		}
+
+		uint32_t file_offset = 0;
+		uint32_t file_bytes = size - torn;
+		while (read_ok && file_offset < file_bytes)
+		{
+			int to_read = (int)min((uint32_t)buf_size, file_bytes - file_offset);
+			int got = file.read(read_buf, to_read);
+			if (got != to_read)
+			{
+				LOGE("verifyFile() error reading %s at %d", filename.c_str(), file_offset);
+				read_ok = false;
+				break;
+			}
+
+			int recs = got / m_rec_size;
+			for (int r = 0; r < recs; r++)
+			{
+				if (!*((uint32_t *)(read_buf + r * m_rec_size)))
+					tombstones++;
+			}
+
+			for (int r = 0; crc_file && r < recs; )
+			{
+				uint32_t fill = num_recs % m_crc_every;
+				int n = min((uint32_t)(recs - r), m_crc_every - fill);
+				crc = crc32_le(fill ? crc : 0, read_buf + r * m_rec_size, n * m_rec_size);
+				r += n;
+				num_recs += n;
+
+				uint32_t block = num_recs / m_crc_every - 1;
+				if (num_recs % m_crc_every || block >= num_sums)
+					continue;
+
+				if (block >= sums_base + sums_got)
+				{
+					sums_base = block;
+					sums_got = min((uint32_t)VERIFY_SUMS, num_sums - block);
+					int bytes = sums_got * sizeof(uint32_t);
+					if (crc_file.read((uint8_t *)sums, bytes) != bytes)
+					{
+						LOGE("verifyFile() error reading checksums");
+						read_ok = false;
+						break;
+					}
+				}
+
+				checked++;
+				if (sums[block - sums_base] != crc)
+				{
+					if (num_bad < VERIFY_MAX_BAD)
+					{
+						if (num_bad) bad_json += ",";
+						bad_json += String(block);
+					}
+					num_bad++;
+				}
+			}
+			if (!crc_file)
+				num_recs += recs;
+
+			file_offset += got;
+		}
+
+		file.close();
+	}
+
+	// the partial block can be checked against the running CRC
+
+	uint32_t unchecked = num_recs - checked * m_crc_every;
+	if (crc_file)
+	{
+		crc_file.close();
+		uint32_t block = num_recs / m_crc_every;
+		if (unchecked &&
+			unchecked < (uint32_t) m_crc_every &&
+			m_crc_valid &&
+			m_crc_count == block)
+		{
+			unchecked = 0;
+			if (crc != m_crc_run)
+			{
+				if (num_bad < VERIFY_MAX_BAD)
+				{
+					if (num_bad) bad_json += ",";
+					bad_json += String(block);
+				}
+				num_bad++;
+			}
+		}
+	}
+	else
+		unchecked = num_recs;
+
+	bad_json += "]";
+	torn_json += "]";
+
+	uint32_t ms = millis() - start_ms;
+	LOGI("verifyFile(%s) %d recs %d blocks bad(%d) torn(%d) in %d ms",
+		m_name, num_recs, checked, num_bad, torn_bytes, ms);
+
+	String result = "{";
+	result += "\"ok\":"            + String(read_ok && !num_bad && !torn_bytes ? "true" : "false") + ",";
+	result += "\"num_recs\":"      + String(num_recs)       + ",";
+	result += "\"tombstones\":"    + String(tombstones)     + ",";
+	result += "\"torn\":"          + torn_json              + ",";
+	result += "\"block_recs\":"    + String(m_crc_every)    + ",";
+	result += "\"blocks\":"        + String(checked)        + ",";
+	result += "\"bad_blocks\":"    + bad_json               + ",";
+	result += "\"num_bad\":"       + String(num_bad)        + ",";
+	result += "\"unchecked\":"     + String(unchecked)      + ",";
+	result += "\"ms\":"            + String(ms);
+	result += "}";
+	return result;
+}
+
+
+#endif	// WITH_SD
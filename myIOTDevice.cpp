@@ -7,6 +7,7 @@
 #include "myIOTSerial.h"
 #include "myIOTWifi.h"
 #include "myIOTHTTP.h"
+#include "myIOTDataLogSampler.h"
 #include <SPIFFS.h>
 #include <FS.h>
 #include <WiFi.h>
@@ -23,6 +24,8 @@
 
 #if WITH_SD
     #include <SD.h>
+    static void loopDataLogs(bool flush);
+        // in the Data Log Registration section below
 #endif
 
 #if WITH_NTP
@@ -639,6 +642,11 @@ void myIOTDevice::onConnectAP()
         my_web_sockets.broadcast(msg);
     }
 
+    void myIOTDevice::wsDataLogRecord(const myIOTDataLog *log, const uint8_t *rec)
+    {
+        my_web_sockets.sendDataLogRecord(log,rec);
+    }
+
     void myIOTDevice::onFileSystemChanged(bool sdcard)
     {
         my_web_sockets.onFileSystemChanged(sdcard);
@@ -660,6 +668,9 @@ void myIOTDevice::onConnectAP()
 void myIOTDevice::reboot()
 {
     LOGU("Rebooting ...");
+    #if WITH_SD
+        loopDataLogs(true);
+    #endif
     my_iot_device->setBool(ID_DEVICE_BOOTING,1);
     vTaskDelay(1500 / portTICK_PERIOD_MS);
     ESP.restart();
@@ -1240,6 +1251,11 @@ void myIOTDevice::loop()
         myIOTSerial::loop();        // has a task
     #endif
 
+    #if WITH_SD
+        loopDataLogs(false);        // write-behind timers
+    #endif
+    myIOTDataLogSampler::loop();    // values sampled into datalogs
+
     #if WITH_AUTO_REBOOT
         // check auto reboot every 30 seconds
         // There is some weird behavior here on the bilgeAlarm.
@@ -1270,8 +1286,6 @@ void myIOTDevice::loop()
 // Data Log Registration and base onCustomLink
 //---------------------------------------------------------------
 
-#if WITH_SD
-
 #include "myIOTDataLog.h"
 #include "myIOTWebServer.h"
 
@@ -1301,12 +1315,46 @@ void myIOTDevice::addDataLog(myIOTDataLog *log, int default_period, int with_deg
 	}
 }
 
+
+myIOTDataLog *myIOTDevice::findDataLog(const char *name)
+{
+	for (int i = 0; i < s_num_data_logs; i++)
+	{
+		if (!strcmp(name, s_data_logs[i]->getName()))
+			return s_data_logs[i];
+	}
+	return NULL;
+}
+
+
+#if WITH_SD
+
+static void loopDataLogs(bool flush)
+	// flush any write-behind buffers, or only those whose time is up
+{
+	for (int i = 0; i < s_num_data_logs; i++)
+	{
+		if (flush)
+			s_data_logs[i]->flush();
+		else
+			s_data_logs[i]->loop();
+	}
+}
+
+static String jobResponse(bool ok)
+	// the maintenance links return when the job has been started,
+	// with its status, or ok=false if another one is still running
+{
+	return ok ?
+		"{\"ok\":true,\"job\":" + myIOTDataLog::jobStatus() + "}" :
+		"{\"ok\":false,\"job\":" + myIOTDataLog::jobStatus() + "}";
+}
+
 #endif	// WITH_SD
 
 
 String myIOTDevice::onCustomLink(const String &path, const char **mime_type)
 {
-#if WITH_SD
 	String data_name = myiot_web_server->hasArg("data_name") ?
 		myiot_web_server->arg("data_name") : String("");
 
@@ -1324,46 +1372,101 @@ String myIOTDevice::onCustomLink(const String &path, const char **mime_type)
 
 	if (log)
 	{
+		// cols is a bitmask of the columns to send, i.e. of the shown
+		// series, with a matching chart_header; 0 or missing is all of them
+
+		uint32_t cols = myiot_web_server->getArg("cols", 0);
+
 		if (path.startsWith("chart_header"))
 		{
+			// secs limits the column ranges to the last secs, as
+			// for chart_data, and defaults to the chart period
+
 			*mime_type = "application/json";
 			return log->getChartHeader(
 				s_data_log_periods[log_idx],
 				s_data_log_degrees[log_idx],
-				s_data_log_colors[log_idx]);
+				s_data_log_colors[log_idx],
+				cols,
+				myiot_web_server->getArg("secs", -1));
 		}
 		else if (path.startsWith("chart_data"))
 		{
+			// from/to select an absolute window, i.e. when zooming
+
 			uint32_t secs = myiot_web_server->getArg("secs", 0);
-			return log->sendChartData(secs);
+			int points = myiot_web_server->getArg("points", 0);
+			uint32_t from = myiot_web_server->getArg("from", 0);
+			uint32_t to = myiot_web_server->getArg("to", 0);
+			if (from || to)
+				return log->sendChartData(from, true, points, 0, to, cols);
+			return log->sendChartData(secs, false, points, 0, 0, cols);
 		}
 		else if (path.startsWith("update_chart_data"))
 		{
+			// when decimating, the client passes the chart's secs
+			// so that the buckets line up with the original query
+
 			uint32_t since = myiot_web_server->getArg("since", 0);
-			return log->sendChartData(since, true);
+			int points = myiot_web_server->getArg("points", 0);
+			uint32_t secs = myiot_web_server->getArg("secs", 0);
+			return log->sendChartData(since, true, points, secs, 0, cols);
 		}
 		else if (path.startsWith("scan_datalog"))
 		{
 			*mime_type = "application/json";
 			return log->scanFile();
 		}
+		else if (path.startsWith("datalog_stats"))
+		{
+			// min/max/avg of the cols from..to, i.e. for a chart's window
+
+			uint32_t from = myiot_web_server->getArg("from", 0);
+			uint32_t to = myiot_web_server->getArg("to", 0);
+			*mime_type = "application/json";
+			return log->getColStats(from, to, cols);
+		}
+		else if (path.startsWith("export_datalog"))
+		{
+			// format=csv (the default) or ndjson, from/to as for datalog_stats,
+			// with temperatures in the DEGREE_TYPE if the chart shows them
+
+			uint32_t from = myiot_web_server->getArg("from", 0);
+			uint32_t to = myiot_web_server->getArg("to", 0);
+			int format = myiot_web_server->arg("format") == "ndjson" ?
+				LOG_EXPORT_NDJSON : LOG_EXPORT_CSV;
+			bool fahrenheit = s_data_log_degrees[log_idx] &&
+				getEnum(ID_DEGREE_TYPE) == DEGREE_TYPE_FARENHEIGHT;
+			return log->exportData(from, to, format, cols, fahrenheit);
+		}
+#if WITH_SD
+		// the maintenance links start a job (see myIOTDataLog::startJob())
+		// so that the loop task keeps running; scan_datalog and
+		// verify_datalog do not change the records, and run here to
+		// return their results
+
 		else if (path.startsWith("delete_record"))
 		{
 			uint32_t dt = myiot_web_server->getArg("dt", 0);
 			if (!dt) return "";
-			m_suppress_log = true;
-			bool ok = log->tombstoneByDt(dt);
-			m_suppress_log = false;
 			*mime_type = "application/json";
-			return ok ? "{\"ok\":true}" : "{\"ok\":false}";
+			return jobResponse(log->startJob(LOG_JOB_TOMBSTONE, dt));
 		}
 		else if (path.startsWith("delete_out_of_order"))
 		{
 			String indices_str = myiot_web_server->hasArg("indices") ?
 				myiot_web_server->arg("indices") : String("");
 			if (!indices_str.length()) return "";
-			m_suppress_log = true;
-			bool ok = true;
+
+			int num_indices = 1;
+			for (int i = 0; i < (int)indices_str.length(); i++)
+			{
+				if (indices_str[i] == ',')
+					num_indices++;
+			}
+			uint32_t *indices = new uint32_t[num_indices];
+			num_indices = 0;
+
 			int start = 0;
 			while (start <= (int)indices_str.length())
 			{
@@ -1372,54 +1475,65 @@ String myIOTDevice::onCustomLink(const String &path, const char **mime_type)
 					indices_str.substring(start, comma) :
 					indices_str.substring(start);
 				if (idx_str.length())
-				{
-					uint32_t idx = (uint32_t)idx_str.toInt();
-					if (!log->tombstoneByIndex(idx))
-						ok = false;
-				}
+					indices[num_indices++] = (uint32_t)idx_str.toInt();
 				if (comma < 0) break;
 				start = comma + 1;
 			}
-			m_suppress_log = false;
+
+			bool ok = log->startJob(LOG_JOB_TOMBSTONE_INDICES, indices, num_indices);
+			delete[] indices;
 			*mime_type = "application/json";
-			return ok ? "{\"ok\":true}" : "{\"ok\":false}";
+			return jobResponse(ok);
 		}
 		else if (path.startsWith("trim_before"))
 		{
 			uint32_t dt = myiot_web_server->getArg("dt", 0);
 			if (!dt) return "";
-			m_suppress_log = true;
-			bool ok = log->trimBefore(dt);
-			m_suppress_log = false;
 			*mime_type = "application/json";
-			return ok ? "{\"ok\":true}" : "{\"ok\":false}";
+			return jobResponse(log->startJob(LOG_JOB_TRIM, dt));
 		}
 		else if (path.startsWith("compact_datalog"))
 		{
-			m_suppress_log = true;
-			bool ok = log->compactFile();
-			m_suppress_log = false;
 			*mime_type = "application/json";
-			return ok ? "{\"ok\":true}" : "{\"ok\":false}";
+			return jobResponse(log->startJob(LOG_JOB_COMPACT));
+		}
+		else if (path.startsWith("rebuild_rollups"))
+		{
+			*mime_type = "application/json";
+			return jobResponse(log->startJob(LOG_JOB_ROLLUPS));
+		}
+		else if (path.startsWith("datalog_job"))
+		{
+			// the progress of the maintenance links,
+			// which is also broadcast as {"datalog_job":...}
+
+			*mime_type = "application/json";
+			return myIOTDataLog::jobStatus();
+		}
+		else if (path.startsWith("datalog_queue"))
+		{
+			// the counters of a datalog with setQueue()
+
+			if (!log->hasQueue()) return "";
+			*mime_type = "application/json";
+			return log->queueStatus();
+		}
+		else if (path.startsWith("verify_datalog"))
+		{
+			*mime_type = "application/json";
+			return log->verifyFile();
 		}
 		else if (path.startsWith("delete_spike"))
 		{
 			uint32_t start_idx = myiot_web_server->getArg("start_idx", 0);
 			uint32_t end_idx   = myiot_web_server->getArg("end_idx",   0);
 			if (end_idx < start_idx) return "";
-			m_suppress_log = true;
-			bool ok = true;
-			for (uint32_t idx = start_idx; idx <= end_idx; idx++)
-			{
-				if (!log->tombstoneByIndex(idx))
-					ok = false;
-			}
-			m_suppress_log = false;
+			uint32_t range[2] = { start_idx, end_idx };
 			*mime_type = "application/json";
-			return ok ? "{\"ok\":true}" : "{\"ok\":false}";
+			return jobResponse(log->startJob(LOG_JOB_TOMBSTONE_RANGE, range, 2));
 		}
-	}
 #endif	// WITH_SD
+	}
 
 	return "";
 }
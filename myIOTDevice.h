@@ -112,9 +112,7 @@ typedef struct {
 }   myIOTWidget_t;
 
 
-#if WITH_SD
-	class myIOTDataLog;		// forward declaration for addDataLog()
-#endif
+class myIOTDataLog;		// forward declaration for addDataLog()
 
 
 class myIOTDevice
@@ -212,8 +210,12 @@ class myIOTDevice
         #if WITH_SD
             static volatile bool m_suppress_log;
                 // set true during maintenance operations to suppress addRecord()
-            void addDataLog(myIOTDataLog *log, int default_period=86400, int with_degrees=0, const String *series_colors=NULL);
         #endif
+        void addDataLog(myIOTDataLog *log, int default_period=86400, int with_degrees=0, const String *series_colors=NULL);
+            // registers the datalog for the chart_header, chart_data, and
+            // other /custom/ links (only the chart links without an SD card)
+        myIOTDataLog *findDataLog(const char *name);
+            // returns the registered datalog with the name, or NULL
 
         
         // Values
@@ -268,6 +270,8 @@ class myIOTDevice
 
         #if WITH_WS
             void wsBroadcast(const char *msg);
+            void wsDataLogRecord(const myIOTDataLog *log, const uint8_t *rec);
+                // called by myIOTDataLog::addRecord() for the live tail
             void onFileSystemChanged(bool sdcard);
             String valueListJson();
             String getAsWsSetCommand(valueIdType id);
@@ -14,6 +14,7 @@
 #if WITH_WS
 
 #include "myIOTDevice.h"
+#include "myIOTDataLog.h"
 #include "myIOTLog.h"
 #include "myIOTWifi.h"
 #include <ArduinoJson.h>
@@ -118,7 +119,10 @@ void myIOTWebSockets::setup()
         {
             vTaskDelay(1);
             if (started)
+            {
+                sendDataLogFrames();
                 m_web_sockets.loop();
+            }
             #ifdef DEBUG_WS_TASK_STACK
                 UBaseType_t high = uxTaskGetStackHighWaterMark(NULL);
                 if (saved != high)
@@ -136,7 +140,10 @@ void myIOTWebSockets::setup()
     void myIOTWebSockets::loop()
     {
         if (started)
+        {
+            sendDataLogFrames();
             m_web_sockets.loop();
+        }
     }
 #endif
 
@@ -160,6 +167,182 @@ void myIOTWebSockets::sendTXT(int num, const char *msg)
 
 
 
+//----------------------------------------
+// datalog live tail
+//----------------------------------------
+// A chart page sends {"cmd":"datalog_subscribe","data_name":...,"cols":...}
+// and then gets each record added to that datalog as a binary frame of the
+// name, a zero byte, and the record, projected to the cols bitmask as for
+// the chart_data link, instead of polling update_chart_data.
+// "datalog_unsubscribe" stops it, and so does disconnecting.
+//
+// sendDataLogRecord() is called from whatever task adds the record,
+// or the dataLogWriter task, and WebSocketsServer is not thread safe,
+// so it only copies the record into a FreeRTOS queue, created by the
+// first subscription.  The WS task (or loop() without WS_TASK) sends
+// the frames from the queue, and is also the only task that changes or
+// reads the subscriptions.  If the queue is full, the record is left
+// out of the live tail, and counted, but is still in the datalog.
+
+#define DEBUG_LOG_SUBS      0
+#define WS_MAX_LOG_SUBS     4
+    // datalogs per client
+#define WS_LOG_QUEUE        16
+    // records waiting to be sent
+#define WS_MAX_LOG_REC      (4 + DATA_COLS_MAX * 4)
+
+typedef struct {
+    const myIOTDataLog *log;    // NULL = free
+    uint32_t cols;
+} wsLogSub_t;
+
+static wsLogSub_t log_subs[WEBSOCKETS_SERVER_CLIENT_MAX][WS_MAX_LOG_SUBS];
+static volatile int num_log_subs = 0;
+    // so that addRecord() costs nothing without subscribers
+
+typedef struct {
+    const myIOTDataLog *log;
+    uint8_t rec[WS_MAX_LOG_REC];
+} wsLogRec_t;
+
+static QueueHandle_t log_queue = NULL;
+static volatile uint32_t log_dropped = 0;
+static uint32_t log_shown_dropped = 0;
+
+
+void myIOTWebSockets::subscribeDataLog(int num, const char *name, uint32_t cols, bool subscribe)
+{
+    if (num >= WEBSOCKETS_SERVER_CLIENT_MAX)
+        return;
+    myIOTDataLog *log = name ? my_iot_device->findDataLog(name) : NULL;
+    if (!log)
+    {
+        LOGE("WS[%u] datalog_subscribe unknown datalog(%s)",num,name ? name : "");
+        sendTXT(num,"{\"error\":\"unknown datalog\"}");
+        return;
+    }
+
+    wsLogSub_t *subs = log_subs[num];
+    wsLogSub_t *found = NULL;
+    wsLogSub_t *free_sub = NULL;
+    for (int i=0; i<WS_MAX_LOG_SUBS; i++)
+    {
+        if (subs[i].log == log)
+            found = &subs[i];
+        else if (!subs[i].log && !free_sub)
+            free_sub = &subs[i];
+    }
+
+    if (!subscribe)
+    {
+        if (found)
+        {
+            found->log = NULL;
+            num_log_subs--;
+        }
+    }
+    else if (found)
+        found->cols = log->projectCols(cols);
+    else if (free_sub)
+    {
+        if (!log_queue)
+            log_queue = xQueueCreate(WS_LOG_QUEUE, sizeof(wsLogRec_t));
+        free_sub->cols = log->projectCols(cols);
+        free_sub->log = log;
+        num_log_subs++;
+    }
+    else
+    {
+        LOGE("WS[%u] datalog_subscribe(%s) more than %d datalogs",num,name,WS_MAX_LOG_SUBS);
+        sendTXT(num,"{\"error\":\"too many datalog subscriptions\"}");
+        return;
+    }
+
+    #if DEBUG_LOG_SUBS
+        LOGD("WS[%u] %s(%s) cols(0x%x) num_log_subs=%d",
+            num,subscribe?"subscribe":"unsubscribe",name,cols,num_log_subs);
+    #endif
+
+    String msg = subscribe ? "{\"datalog_subscribed\":\"" : "{\"datalog_unsubscribed\":\"";
+    msg += name;
+    msg += "\"}";
+    sendTXT(num,msg.c_str());
+}
+
+
+void myIOTWebSockets::clearDataLogSubs(int num)
+{
+    if (num >= WEBSOCKETS_SERVER_CLIENT_MAX)
+        return;
+    for (int i=0; i<WS_MAX_LOG_SUBS; i++)
+    {
+        if (log_subs[num][i].log)
+        {
+            log_subs[num][i].log = NULL;
+            num_log_subs--;
+        }
+    }
+}
+
+
+void myIOTWebSockets::sendDataLogRecord(const myIOTDataLog *log, const uint8_t *rec)
+    // on any task
+{
+    if (!started || !num_log_subs || !log_queue)
+        return;
+    int rec_size = log->getRecSize();
+    if (rec_size > WS_MAX_LOG_REC)
+        return;
+
+    wsLogRec_t item;
+    item.log = log;
+    memcpy(item.rec, rec, rec_size);
+    if (xQueueSend(log_queue, &item, 0) != pdTRUE)
+        log_dropped++;
+}
+
+
+void myIOTWebSockets::sendDataLogFrames()
+    // on the WS task, before m_web_sockets.loop()
+{
+    if (!log_queue)
+        return;
+
+    uint32_t dropped = log_dropped;
+    if (dropped != log_shown_dropped)
+    {
+        LOGW("WS datalog queue full, %u records not sent since boot",dropped);
+        log_shown_dropped = dropped;
+    }
+
+    wsLogRec_t item;
+    while (xQueueReceive(log_queue, &item, 0) == pdTRUE)
+    {
+        if (!started || !num_log_subs)
+            continue;
+
+        const myIOTDataLog *log = item.log;
+        const char *name = log->getName();
+        int name_len = strlen(name) + 1;
+        uint8_t frame[name_len + log->getRecSize()];
+        memcpy(frame, name, name_len);
+
+        for (int num=0; num<WEBSOCKETS_SERVER_CLIENT_MAX; num++)
+        {
+            for (int i=0; i<WS_MAX_LOG_SUBS; i++)
+            {
+                const wsLogSub_t *sub = &log_subs[num][i];
+                if (sub->log != log)
+                    continue;
+                int bytes = log->projectRecords(&frame[name_len], item.rec, 1, sub->cols);
+                m_web_sockets.sendBIN(num, frame, name_len + bytes);
+            }
+        }
+    }
+}
+
+
+
 static String myJson(const char *id, bool quoted, String value, bool comma_after)
 {
     String rslt = "\"";
@@ -368,6 +551,7 @@ void myIOTWebSockets::webSocketEvent(uint8_t num, WStype_t ws_type, uint8_t *dat
         case WStype_DISCONNECTED:
             LOGI("WS[%u] Disconnected!", num);
             connect_count--;
+            clearDataLogSubs(num);
             break;
         case WStype_CONNECTED:
             {
@@ -515,6 +699,14 @@ void myIOTWebSockets::webSocketEvent(uint8_t num, WStype_t ws_type, uint8_t *dat
                     {
                         sendTXT(num,my_iot_device->valueListJson().c_str());
                     }
+                    else if (cmd == "datalog_subscribe" ||
+                             cmd == "datalog_unsubscribe")
+                    {
+                        subscribeDataLog(num,
+                            (const char *) in_doc["data_name"],
+                            in_doc["cols"] | 0,
+                            cmd == "datalog_subscribe");
+                    }
                     else
                     {
                         LOGE("unknown WS command: %s",cmd.c_str());
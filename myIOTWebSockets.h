@@ -11,6 +11,8 @@
 
 #include <WebSocketsServer.h>
 
+class myIOTDataLog;
+
 class myIOTWebSockets
 {
     public:
@@ -30,6 +32,11 @@ class myIOTWebSockets
 
         static void onFileSystemChanged(bool sdcard);
 
+        static void sendDataLogRecord(const myIOTDataLog *log, const uint8_t *rec);
+            // queues the record, from any task, for the WS task to send
+            // as a binary frame to the clients that have subscribed to
+            // the datalog
+
 
     protected:
 
@@ -41,6 +48,9 @@ class myIOTWebSockets
 
         static void sendTXT(int num, const char *msg);
         static void onDeleteFile(int num, String filename);
+        static void subscribeDataLog(int num, const char *name, uint32_t cols, bool subscribe);
+        static void clearDataLogSubs(int num);
+        static void sendDataLogFrames();
 
         #ifdef WS_TASK
             static void webSocketTask(void *param);